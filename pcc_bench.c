@@ -0,0 +1,1068 @@
+
+
+/* Submitter: Adam
+ * Operating Systems 2022A
+ * Tel Aviv University
+ ==============================================
+ * A benchmark of the counting kernels, and a load generator for the server
+ *
+ * `bench kernels` times every counting kernel the CPU supports on a synthetic buffer, and the
+ * byte histogram behind the other class sets, projected onto each of them.
+ * `bench load` uploads synthetic files to a server from many threads at once, checks
+ * every reply against a local count, and reports the throughput and latencies.
+ * `bench merge` times merging counts from 1 to MERGE_BENCH_MAX_THREADS threads at once: into
+ * a single shared histogram, into histograms packed next to each other, and into the shards
+ * the server merges into (see `struct pcc_shard`), whose cost should stay flat.
+ * `bench check` checks every counting kernel the CPU supports against the scalar one, over random and
+ * adversarial buffers at every misalignment, each ending right before a page that can't be read. It also
+ * checks the content hash against the reference vectors of XXH64, and runs the decoders of the protocol
+ * over random bytes. It needs no server, and exits with 1 upon any mismatch.
+ * `bench conform` runs a server on loopback through the ways a client may break the protocol: headers cut
+ * short, connections closed early, huge declared sizes, invalid flags and fuzzed frame headers. After
+ * each case, the server must still count an upload right.
+ */
+
+
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "pcc_protocol.h"
+#include "pcc_count.h"
+#include "pcc_hash.h"
+
+#define bool int
+#define true 1
+#define false 0
+#define KERNEL_BENCH_SECONDS 0.5 // how long each kernel is timed for
+#define MERGE_BENCH_MAX_THREADS 64 // the merging threads are doubled from 1 up to this many
+#define MERGE_BENCH_MERGES 50000 // how many times each merging thread merges its counts
+#define CHECK_MAX_SIZE (1 << 20) // the longest buffer the kernels are checked over
+#define CHECK_SHORT_SIZE 512     // every length up to this one is checked, then lengths doubling up to CHECK_MAX_SIZE
+#define CHECK_ALIGNMENTS 64      // every buffer is checked at this many misalignments
+#define CHECK_PATTERNS 6         // the patterns of `fill_check_pattern`
+#define CHECK_FUZZ_ROUNDS 100000 // the random histograms and frame headers the decoders are run over
+#define CONFORM_BODY_SIZE 65536  // the size of the bodies of the conformance suite
+#define CONFORM_SANE_SIZE 1000   // and of the upload that checks the server still serves right
+#define CONFORM_SANE_EVERY 100   // the fuzzed frame headers between two such checks
+#define CONFORM_BROKEN_FRAMES 3  // the frames sent right before a frame header that breaks the protocol
+#define CONFORM_FUZZ_ROUNDS 2000 // the fuzzed frame headers sent
+#define CONFORM_WAIT_SECONDS 5   // the seconds the server has to reply to a connection, or close it
+#define CONFORM_SETTLE_MS 100    // the milliseconds the server is given to admit an upload, before the next one is sent
+
+
+
+/*************** TYPES ******************/
+/* the state of a thread of the load generator */
+struct load_thread {
+	pthread_t thread;
+	int index;
+	uint64_t seed;           // the state of its random generator
+	char *payload;           // the synthetic file, `max_size` bytes, uploads send a prefix of it
+	uint64_t *latencies;     // the latency of each upload, in nanoseconds
+	uint64_t uploads;        // how many uploads were completed
+	uint64_t bytes;          // how many bytes they held
+	uint64_t connections;    // how many connections were opened
+	uint64_t mismatches;     // how many replies didn't match the local count
+	uint64_t shed;           // how many uploads the server refused (see `PCC_REPLY_SHED`)
+};
+
+/* the counters the threads of the contention benchmark merge into */
+enum merge_layout {
+	MERGE_SHARED, // a single histogram of every thread, added to with atomic read-modify-write instructions
+	MERGE_PACKED, // a histogram per thread, packed next to each other, so neighbours share cache lines
+	MERGE_SHARDS  // a shard per thread, as the server merges into
+};
+
+/* what came of a connection of the conformance suite, once the client closed its side */
+enum conform_result {
+	CONFORM_REPLIED, // a reply arrived (and maybe more), then the server closed the connection
+	CONFORM_CLOSED,  // the server closed the connection without replying
+	CONFORM_TIMEOUT  // the server neither replied nor closed the connection in time
+};
+
+/* the state of a thread of the contention benchmark */
+struct merge_thread {
+	pthread_t thread;
+	int index;
+	enum merge_layout layout;
+};
+/***************************************************/
+
+
+
+/*************** GLOBAL VARIABLES ******************/
+int concurrency = 4;           // the amount of threads uploading at once (`-c`)
+uint64_t uploads_per_thread = 100; // the amount of uploads each thread makes (`-n`)
+uint64_t min_size = 1000000;   // the sizes of the files are uniformly distributed between these (`-s min[:max]`)
+uint64_t max_size = 1000000;
+double printable_ratio = 0.9;  // the share of printable bytes in the files (`-p`)
+uint64_t frames_per_connection = 1; // 1 for a single-shot upload per connection, otherwise a session of that many frames (`-f`)
+uint64_t seed = 1;             // the seed of the synthetic files and sizes (`-S`)
+struct sockaddr_in serv_addr;  // the server the load is generated against
+pcc_kernel kernel = NULL;      // the kernel computing the local counts
+atomic_uint_least64_t shared_counts[PCC_CHARS_RANGE + 2]; // the histogram, files and bytes of the shared layout of `bench merge`
+uint64_t (*packed_counts)[PCC_CHARS_RANGE + 2] = NULL;    // those of each thread of the packed layout
+struct pcc_shard *shards = NULL;                          // and the shard of each thread of the sharded layout
+/***************************************************/
+
+
+
+/*************** AUXILIARY FUNCTION DECLARATIONS ***************/
+/* Print an error, and in case <terminate> is true, any errors will
+ * terminate the calling process. */
+static void print_err(char* error_message, bool terminate);
+
+/* Returns the next number of the xorshift64* generator whose state is <state> */
+static uint64_t next_random(uint64_t *state);
+
+/* Fills the <size> bytes of <buff> with random bytes, `printable_ratio` of them printable */
+static void fill_payload(char buff[], uint64_t size, uint64_t *state);
+
+/* Returns the time elapsed since <start>, in seconds */
+static double elapsed_since(struct timespec *start);
+
+/* Times every counting kernel the CPU supports over a synthetic buffer of `max_size` bytes,
+ * and checks that they all agree with the scalar kernel */
+static void bench_kernels(void);
+
+/* Uploads `uploads_per_thread` synthetic files from each of `concurrency` threads, and prints
+ * the throughput, the uploads and connections per second, and the latencies of the uploads */
+static void bench_load(void);
+
+/* Merges a histogram from 1, 2, 4... up to MERGE_BENCH_MAX_THREADS threads at once, MERGE_BENCH_MERGES times
+ * from each, into each of the layouts of `enum merge_layout`, and prints the time a merge takes */
+static void bench_merge(void);
+
+/* The entry point of a thread of the contention benchmark <arg> */
+static void *merge_thread_main(void *arg);
+
+/* The entry point of a thread of the load generator <arg> */
+static void *load_thread_main(void *arg);
+
+/* Checks the counting kernels, the content hash and the decoders of the protocol (see `bench check`), printing
+ * whether each of them passed. Exits with 1 upon any mismatch */
+static void bench_check(void);
+
+/* Fills the <size> bytes of <buff> with the pattern <pattern> of the kernel check, out of CHECK_PATTERNS:
+ * random bytes, every byte value in turn, bytes >= 128 only, printable bytes only, the edges of those ranges,
+ * and long runs of a byte */
+static void fill_check_pattern(char buff[], uint64_t size, unsigned int pattern, uint64_t *state);
+
+/* Runs the conformance suite against the server (see `bench conform`), printing whether each case passed.
+ * Exits with 1 upon any failure */
+static void bench_conform(void);
+
+/* Encodes the headers of a frame flagged with <flags> into <headers>: a frame of <size> bytes, whose other headers
+ * are zeroed (but for the hash <hash>, if it has a hash header alone). Return the size of the headers */
+static uint64_t conform_frame(char headers[], uint32_t flags, uint64_t size, uint64_t hash);
+
+/* Connects to the server and sends the <opening_size> bytes of <opening> (the size of an upload, or the magic of a
+ * session), then the <size> bytes of <headers> and the <body_size> bytes of <body>, and closes its side of the
+ * connection. Reads until the server closes it too, storing the first count replied in <reply> unless it's NULL.
+ *
+ * Return how the connection ended (see `enum conform_result`) */
+static enum conform_result conform_send(const char headers[], uint64_t size, const void *opening, uint64_t opening_size, const char body[], uint64_t body_size, uint64_t *reply);
+
+/* Same as `send_data`, but returns <false> upon any error instead of terminating */
+static bool conform_write(int sockfd, const void *buff, uint64_t size);
+
+/* Sends a hashed frame of CONFORM_BODY_SIZE bytes of <payload>, then a lookup, whose headers are the <size> bytes of
+ * <headers>, in a session of their own. Return the reply to the lookup if the body was counted as <expected>, or
+ * anything but <expected> and PCC_REPLY_MISS otherwise */
+static uint64_t conform_lookup(const char headers[], uint64_t size, const char payload[], uint64_t expected);
+
+/* Sends CONFORM_BROKEN_FRAMES frames of the first CONFORM_SANE_SIZE bytes of <payload> in a session, followed at once
+ * by a frame header of unknown flags. Return whether every frame was replied to right before the server closed it */
+static bool conform_broken_session(const char payload[]);
+
+/* Holds an upload of CONFORM_BODY_SIZE bytes half-sent, meanwhile sending an upload of a huge declared size, then one of
+ * the largest declared size (which wraps around once added to the held one). Return whether the latter was refused
+ * whenever the former was, such as by the in-flight budget (`-b`) of the server, or whether the server couldn't serve
+ * the latter ones in time (such as a single worker of the blocking mode, tied up by the held upload) */
+static bool conform_budget_overflow(const char payload[]);
+
+/* Returns whether the server counts a single-shot upload of the first CONFORM_SANE_SIZE bytes of <payload> right */
+static bool conform_sane(const char payload[]);
+
+/* Connects to the server, opening a session if <session> is true. Terminates upon failure */
+static int connect_server(bool session);
+
+/* These functions send all of the <size> bytes of <buff> over the socket <sockfd>, or receive
+ * <size> bytes into it. Both terminate upon failure */
+static void send_data(int sockfd, const void *buff, uint64_t size);
+static void recv_data(int sockfd, void *buff, uint64_t size);
+
+/* Compares two latencies, for qsort(3) */
+static int compare_latencies(const void *a, const void *b);
+/**************************************************/
+
+
+
+
+
+/*************** AUXILIARY FUNCTION DEFINITIONS ***************/
+static void print_err(char* error_message, bool terminate) {
+	int tmp_errno = errno;
+	perror(error_message); // this basically prints error_message, with <strerror(errno)> appended to it */
+	errno = tmp_errno;
+
+	if (terminate) {
+		exit(1);
+	}
+}
+
+static uint64_t next_random(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void fill_payload(char buff[], uint64_t size, uint64_t *state) {
+	uint64_t threshold = (uint64_t)(printable_ratio * (double)UINT32_MAX);
+
+	for (uint64_t i = 0; i < size; i++) {
+		uint64_t r = next_random(state);
+		if ( (r & UINT32_MAX) < threshold ) { // a printable character, 32 to 126
+			buff[i] = (char)(32 + (r >> 32) % 95);
+		} else { // anything else, 0 to 31 or 127 to 255
+			uint64_t other = (r >> 32) % 161;
+			buff[i] = (char)((other < 32) ? other : other + 95);
+		}
+	}
+}
+
+static double elapsed_since(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bench_kernels(void) {
+	const char *names[] = { "scalar", "sse4.2", "avx2", "bytes" };
+	uint64_t expected[PCC_CHARS_RANGE] = {0};
+	uint64_t expected_chars = 0;
+	uint64_t state = seed;
+
+	char *buff = malloc(max_size);
+	if ( NULL == buff ) {
+		print_err("Error: Couldn't allocate the buffer of the benchmark", true);
+	}
+	fill_payload(buff, max_size, &state);
+	expected_chars = update_pcc_current_scalar(buff, max_size, expected);
+
+	printf("Counting kernels over %lu bytes (%.0f%% printable)\n", max_size, printable_ratio * 100);
+	for (unsigned int k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+		pcc_kernel impl = select_pcc_kernel(names[k]);
+		if ( NULL == impl ) {
+			printf("%s: not supported by this CPU\n", names[k]);
+			continue;
+		}
+
+		// repeating the count until enough time passed, checking it every time
+		uint64_t iterations = 0;
+		bool agrees = true;
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			uint64_t pcc[PCC_CHARS_RANGE] = {0};
+			agrees &= (expected_chars == impl(buff, max_size, pcc)) && (0 == memcmp(pcc, expected, sizeof(pcc)));
+			iterations++;
+		} while ( elapsed_since(&start) < KERNEL_BENCH_SECONDS );
+		double elapsed = elapsed_since(&start);
+
+		printf("%s: %.2f GB/s%s\n", names[k], iterations * max_size / elapsed / 1e9, agrees ? "" : " (MISMATCH against scalar)");
+	}
+	
+	// the other class sets: the byte histogram, then its projection (checked through the printable one)
+	const char *class_sets[] = { "printable", "bytes", "lines", "utf8" };
+	for (unsigned int c = 0; c < sizeof(class_sets) / sizeof(class_sets[0]); c++) {
+		struct pcc_class_set classes;
+		pcc_class_set_by_name(&classes, class_sets[c]);
+		
+		uint64_t iterations = 0;
+		bool agrees = true;
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			uint64_t bytes[PCC_BYTE_VALUES] = {0};
+			uint64_t hist[PCC_MAX_BUCKETS] = {0};
+			uint64_t pcc[PCC_CHARS_RANGE] = {0};
+			pcc_count_bytes(buff, max_size, bytes);
+			pcc_project(&classes, bytes, hist);
+			agrees &= (expected_chars == pcc_project_printable(bytes, pcc)) && (0 == memcmp(pcc, expected, sizeof(pcc)));
+			iterations++;
+		} while ( elapsed_since(&start) < KERNEL_BENCH_SECONDS );
+		double elapsed = elapsed_since(&start);
+		
+		printf("bytes -> %s: %.2f GB/s%s\n", class_sets[c], iterations * max_size / elapsed / 1e9, agrees ? "" : " (MISMATCH against scalar)");
+	}
+
+	free(buff);
+}
+
+static void bench_load(void) {
+	struct load_thread *threads = calloc(concurrency, sizeof(struct load_thread));
+	if ( NULL == threads ) {
+		print_err("Error: Couldn't allocate the threads of the load generator", true);
+	}
+
+	// every thread generates its own file up front, so generating it isn't timed
+	for (int i = 0; i < concurrency; i++) {
+		threads[i].index = i;
+		threads[i].seed = seed + i + 1;
+		if ( NULL == (threads[i].payload = malloc(max_size)) || NULL == (threads[i].latencies = calloc(uploads_per_thread, sizeof(uint64_t))) ) {
+			print_err("Error: Couldn't allocate the buffers of the load generator", true);
+		}
+		fill_payload(threads[i].payload, max_size, &threads[i].seed);
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < concurrency; i++) {
+		if ( 0 != (errno = pthread_create(&threads[i].thread, NULL, load_thread_main, &threads[i])) ) {
+			print_err("Error: Couldn't create a thread of the load generator", true);
+		}
+	}
+	for (int i = 0; i < concurrency; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+	double elapsed = elapsed_since(&start);
+
+	// gathering the results of every thread
+	uint64_t uploads = 0, bytes = 0, connections = 0, mismatches = 0, shed = 0;
+	uint64_t *latencies = malloc(concurrency * uploads_per_thread * sizeof(uint64_t));
+	if ( NULL == latencies ) {
+		print_err("Error: Couldn't allocate the latencies of the load generator", true);
+	}
+	for (int i = 0; i < concurrency; i++) {
+		memcpy(latencies + uploads, threads[i].latencies, threads[i].uploads * sizeof(uint64_t));
+		uploads += threads[i].uploads;
+		bytes += threads[i].bytes;
+		connections += threads[i].connections;
+		mismatches += threads[i].mismatches;
+		shed += threads[i].shed;
+		free(threads[i].payload);
+		free(threads[i].latencies);
+	}
+	qsort(latencies, uploads, sizeof(uint64_t), compare_latencies);
+
+	printf("Load: %d threads, %lu uploads of %lu to %lu bytes (%.0f%% printable), %lu per connection\n",
+	       concurrency, uploads, min_size, max_size, printable_ratio * 100, frames_per_connection);
+	printf("Throughput: %.3f GB/s (%lu bytes in %.3f sec)\n", bytes / elapsed / 1e9, bytes, elapsed);
+	printf("Uploads: %.0f per sec\n", uploads / elapsed);
+	printf("Connections: %.0f per sec\n", connections / elapsed);
+	if ( uploads > 0 ) {
+		printf("Latency: p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+		       latencies[(uploads - 1) * 50 / 100] / 1e3, latencies[(uploads - 1) * 99 / 100] / 1e3,
+		       latencies[(uploads - 1) * 999 / 1000] / 1e3, latencies[uploads - 1] / 1e3);
+	}
+	printf("Mismatched replies: %lu\n", mismatches);
+	printf("Refused uploads: %lu\n", shed);
+
+	free(latencies);
+	free(threads);
+	if ( mismatches > 0 ) {
+		exit(1);
+	}
+}
+
+static void bench_merge(void) {
+	const char *names[] = { "shared atomics", "packed", "shards" };
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	ncpus = (ncpus > 0) ? ncpus : 1;
+
+	// every layout has room for the most threads
+	if ( NULL == (packed_counts = calloc(MERGE_BENCH_MAX_THREADS, sizeof(*packed_counts))) ||
+	     NULL == (shards = aligned_alloc(PCC_CACHE_LINE_SIZE, MERGE_BENCH_MAX_THREADS * sizeof(struct pcc_shard))) ) {
+		print_err("Error: Couldn't allocate the counters of the benchmark", true);
+	}
+
+	printf("Merging a histogram of %d counts, %d times per thread (%ld CPUs), in ns per merge per busy CPU\n", PCC_CHARS_RANGE, MERGE_BENCH_MERGES, ncpus);
+	printf("threads %16s %16s %16s\n", names[0], names[1], names[2]);
+	for (int nthreads = 1; nthreads <= MERGE_BENCH_MAX_THREADS; nthreads *= 2) {
+		struct merge_thread threads[MERGE_BENCH_MAX_THREADS];
+		printf("%7d", nthreads);
+
+		for (int layout = MERGE_SHARED; layout <= MERGE_SHARDS; layout++) {
+			memset(shared_counts, 0, sizeof(shared_counts));
+			memset(packed_counts, 0, MERGE_BENCH_MAX_THREADS * sizeof(*packed_counts));
+			memset(shards, 0, MERGE_BENCH_MAX_THREADS * sizeof(struct pcc_shard));
+
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (int i = 0; i < nthreads; i++) {
+				threads[i].index = i;
+				threads[i].layout = layout;
+				if ( 0 != (errno = pthread_create(&threads[i].thread, NULL, merge_thread_main, &threads[i])) ) {
+					print_err("Error: Couldn't create a thread of the benchmark", true);
+				}
+			}
+			for (int i = 0; i < nthreads; i++) {
+				pthread_join(threads[i].thread, NULL);
+			}
+			double elapsed = elapsed_since(&start);
+
+			// summing the counts of every thread, as upon reading the statistics
+			uint64_t pcc[PCC_CHARS_RANGE], files = 0, bytes = 0;
+			if ( layout == MERGE_SHARED ) {
+				files = atomic_load(&shared_counts[PCC_CHARS_RANGE]);
+			} else {
+				for (int i = 0; i < nthreads; i++) {
+					if ( layout == MERGE_PACKED ) {
+						files += packed_counts[i][PCC_CHARS_RANGE];
+					} else {
+						uint64_t shard_files, shard_bytes;
+						pcc_shard_read(&shards[i], pcc, &shard_files, &shard_bytes);
+						files += shard_files;
+						bytes += shard_bytes;
+					}
+				}
+			}
+
+			// the time a merge takes on each CPU that's busy merging
+			double busy = (nthreads < ncpus) ? nthreads : ncpus;
+			printf(" %16.1f%s", elapsed * 1e9 * busy / ((double)nthreads * MERGE_BENCH_MERGES),
+			       (files == (uint64_t)nthreads * MERGE_BENCH_MERGES) ? "" : " (LOST MERGES)");
+		}
+		printf("\n");
+	}
+
+	free(packed_counts);
+	free(shards);
+}
+
+static void *merge_thread_main(void *arg) {
+	struct merge_thread *t = arg;
+	uint64_t pcc[PCC_CHARS_RANGE]; // the statistics of a "file", different for every thread
+
+	for (unsigned int i = 0; i < PCC_CHARS_RANGE; i++) {
+		pcc[i] = i + t->index;
+	}
+
+	for (int m = 0; m < MERGE_BENCH_MERGES; m++) {
+		if ( t->layout == MERGE_SHARED ) {
+			for (unsigned int i = 0; i < PCC_CHARS_RANGE; i++) {
+				atomic_fetch_add_explicit(&shared_counts[i], pcc[i], memory_order_relaxed);
+			}
+			atomic_fetch_add_explicit(&shared_counts[PCC_CHARS_RANGE], 1, memory_order_relaxed);
+			atomic_fetch_add_explicit(&shared_counts[PCC_CHARS_RANGE + 1], 4096, memory_order_relaxed);
+		} else if ( t->layout == MERGE_PACKED ) {
+			uint64_t *counts = packed_counts[t->index];
+			for (unsigned int i = 0; i < PCC_CHARS_RANGE; i++) {
+				counts[i] += pcc[i];
+			}
+			counts[PCC_CHARS_RANGE] += 1;
+			counts[PCC_CHARS_RANGE + 1] += 4096;
+		} else {
+			pcc_shard_add(&shards[t->index], pcc, 1, 4096);
+		}
+		__asm__ volatile("" ::: "memory"); // every merge is stored, rather than folded into a single one
+	}
+
+	return NULL;
+}
+
+static void *load_thread_main(void *arg) {
+	struct load_thread *t = arg;
+	bool session = (frames_per_connection > 1);
+	int sockfd = -1;
+	uint64_t frames = 0; // how many frames were sent over the current connection
+
+	for (uint64_t u = 0; u < uploads_per_thread; u++) {
+		uint64_t size = min_size + ((max_size > min_size) ? next_random(&t->seed) % (max_size - min_size + 1) : 0);
+		uint64_t pcc[PCC_CHARS_RANGE] = {0};
+		uint64_t expected = kernel(t->payload, size, pcc);
+		uint64_t reply_n = 0;
+
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		// a new connection for every upload, or for every `frames_per_connection` frames of a session
+		if ( sockfd == -1 ) {
+			sockfd = connect_server(session);
+			t->connections++;
+		}
+
+		if ( session ) {
+			char header[PCC_FRAME_HEADER_SIZE];
+			struct pcc_frame_header frame = { .flags = 0, .size = size };
+			pcc_encode_frame_header(header, &frame);
+			send_data(sockfd, header, PCC_FRAME_HEADER_SIZE);
+		} else {
+			uint64_t size_n = htobe64(size);
+			send_data(sockfd, &size_n, PCC_SIZE_HEADER_SIZE);
+		}
+		send_data(sockfd, t->payload, size);
+		recv_data(sockfd, &reply_n, PCC_REPLY_SIZE);
+
+		// a refused upload isn't timed, and the server ignores the rest of its session
+		if ( reply_n == htobe64(PCC_REPLY_SHED) ) {
+			close(sockfd);
+			sockfd = -1;
+			frames = 0;
+			t->shed++;
+			continue;
+		}
+
+		if ( !session || ++frames == frames_per_connection || u + 1 == uploads_per_thread ) {
+			close(sockfd);
+			sockfd = -1;
+			frames = 0;
+		}
+
+		t->latencies[t->uploads++] = (uint64_t)(elapsed_since(&start) * 1e9);
+		t->bytes += size;
+		t->mismatches += (be64toh(reply_n) != expected);
+	}
+
+	return NULL;
+}
+
+static void bench_check(void) {
+	const char *names[] = { "sse4.2", "avx2", "bytes" };
+	uint64_t state = seed;
+	uint64_t failures = 0;
+	
+	// the buffers end right before a page that can't be read, so reading a byte past their end faults
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint64_t region_size = (CHECK_MAX_SIZE + page_size - 1) / page_size * page_size;
+	char *region = mmap(NULL, region_size + page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( MAP_FAILED == region || 0 != mprotect(region + region_size, page_size, PROT_NONE) ) {
+		print_err("Error: Couldn't map the buffer of the check", true);
+	}
+	char *guard = region + region_size;
+	char *pattern_buff = malloc(CHECK_MAX_SIZE + CHECK_ALIGNMENTS); // the pattern, copied next to the guard page at every length
+	if ( NULL == pattern_buff ) {
+		print_err("Error: Couldn't allocate the buffer of the check", true);
+	}
+	
+	// the counting kernels against the scalar one, over every pattern at every length up to CHECK_SHORT_SIZE (and a few longer
+	// ones), starting at every misalignment and ending right at the guard page
+	for (unsigned int pattern = 0; pattern < CHECK_PATTERNS; pattern++) {
+		fill_check_pattern(pattern_buff, CHECK_MAX_SIZE + CHECK_ALIGNMENTS, pattern, &state);
+		
+		for (uint64_t size = 0; size <= CHECK_MAX_SIZE; size = (size < CHECK_SHORT_SIZE) ? size + 1 : size * 2 + next_random(&state) % 64) {
+			for (unsigned int offset = 0; offset < CHECK_ALIGNMENTS && offset + size <= CHECK_MAX_SIZE; offset++) {
+				char *buff = guard - size - offset; // ending <offset> bytes before the guard page, so starting misaligned as often
+				memcpy(buff, pattern_buff + offset, size);
+				
+				uint64_t expected[PCC_CHARS_RANGE] = {0};
+				uint64_t expected_chars = update_pcc_current_scalar(buff, size, expected);
+				for (unsigned int k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+					pcc_kernel impl = select_pcc_kernel(names[k]);
+					uint64_t pcc[PCC_CHARS_RANGE] = {0};
+					if ( NULL != impl && (expected_chars != impl(buff, size, pcc) || 0 != memcmp(pcc, expected, sizeof(pcc))) ) {
+						fprintf(stderr, "Error: %s: pattern %u, %lu bytes, %u bytes before the end of a page: mismatch against scalar\n",
+						        names[k], pattern, size, offset);
+						failures++;
+					}
+				}
+				
+				// the byte histogram behind the other class sets, against a byte at a time
+				uint64_t bytes[PCC_BYTE_VALUES] = {0}, expected_bytes[PCC_BYTE_VALUES] = {0};
+				pcc_count_bytes(buff, size, bytes);
+				for (uint64_t i = 0; i < size; i++) {
+					expected_bytes[(uint8_t)buff[i]]++;
+				}
+				if ( 0 != memcmp(bytes, expected_bytes, sizeof(bytes)) ) {
+					fprintf(stderr, "Error: byte histogram: pattern %u, %lu bytes: mismatch\n", pattern, size);
+					failures++;
+				}
+			}
+		}
+	}
+	printf("Counting kernels: %s\n", (failures == 0) ? "ok" : "FAILED");
+	
+	// the content hash, against the reference vectors of XXH64, and incrementally at random splits
+	uint64_t hash_failures = 0;
+	const char *vectors[] = { "", "abc", "Nobody inspects the spammish repetition" };
+	const uint64_t expected_hashes[] = { 0xef46db3751d8e999ULL, 0x44bc2cf5ad770999ULL, 0xfbcea83c8a378bf1ULL };
+	for (unsigned int v = 0; v < sizeof(vectors) / sizeof(vectors[0]); v++) {
+		hash_failures += (pcc_hash_buffer(vectors[v], strlen(vectors[v])) != expected_hashes[v]);
+	}
+	fill_check_pattern(region, CHECK_MAX_SIZE, 0, &state);
+	for (unsigned int round = 0; round < CHECK_FUZZ_ROUNDS / 100; round++) {
+		uint64_t size = next_random(&state) % CHECK_MAX_SIZE;
+		struct pcc_hash hash;
+		pcc_hash_init(&hash);
+		for (uint64_t done = 0, step = 0; done < size; done += step) {
+			step = 1 + next_random(&state) % ((next_random(&state) & 1) ? 64 : size - done);
+			step = (step > size - done) ? size - done : step;
+			pcc_hash_update(&hash, region + done, step);
+		}
+		hash_failures += (pcc_hash_digest(&hash) != pcc_hash_buffer(region, size));
+	}
+	printf("Content hash: %s\n", (hash_failures == 0) ? "ok" : "FAILED");
+	failures += hash_failures;
+	
+	// the decoders of the protocol, over random bytes (which must be rejected or decoded, never read past), and round trips
+	uint64_t decoder_failures = 0;
+	for (unsigned int round = 0; round < CHECK_FUZZ_ROUNDS; round++) {
+		unsigned int buckets = 1 + next_random(&state) % PCC_HISTOGRAM_MAX_BUCKETS;
+		uint64_t hist[PCC_HISTOGRAM_MAX_BUCKETS], decoded[PCC_HISTOGRAM_MAX_BUCKETS];
+		
+		uint16_t size = next_random(&state) % (PCC_HISTOGRAM_MAX_SIZE + 1);
+		char *encoded = guard - size;
+		for (uint16_t i = 0; i < size; i++) {
+			encoded[i] = (char)next_random(&state);
+		}
+		if ( size >= PCC_HISTOGRAM_BITMAP_SIZE(buckets) ) {
+			pcc_decode_histogram(encoded, size, decoded, buckets);
+		}
+		
+		for (unsigned int i = 0; i < buckets; i++) { // sparse, and of every magnitude
+			uint64_t r = next_random(&state);
+			hist[i] = (r & 1) ? 0 : next_random(&state) >> (r >> 58);
+		}
+		size = pcc_encode_histogram(region, hist, buckets);
+		memmove(guard - size, region, size);
+		decoder_failures += (0 != pcc_decode_histogram(guard - size, size, decoded, buckets) || 0 != memcmp(hist, decoded, buckets * sizeof(uint64_t)));
+		
+		char header[PCC_FRAME_HEADER_SIZE];
+		struct pcc_frame_header frame = { .flags = (uint32_t)next_random(&state), .size = next_random(&state) }, frame_decoded;
+		pcc_encode_frame_header(header, &frame);
+		pcc_decode_frame_header(header, &frame_decoded);
+		decoder_failures += (frame.flags != frame_decoded.flags || frame.size != frame_decoded.size);
+	}
+	printf("Protocol decoders: %s\n", (decoder_failures == 0) ? "ok" : "FAILED");
+	failures += decoder_failures;
+	
+	free(pattern_buff);
+	munmap(region, region_size + page_size);
+	if ( failures > 0 ) {
+		exit(1);
+	}
+}
+
+static void fill_check_pattern(char buff[], uint64_t size, unsigned int pattern, uint64_t *state) {
+	static const uint8_t edges[] = { 0, 31, 32, 33, 125, 126, 127, 128, 159, 160, 254, 255 }; // either side of the printable range, and of the sign bit
+	
+	for (uint64_t i = 0; i < size; i++) {
+		uint64_t r = next_random(state);
+		switch ( pattern ) {
+			case 0: buff[i] = (char)r; break;                               // random bytes
+			case 1: buff[i] = (char)i; break;                               // every byte value in turn
+			case 2: buff[i] = (char)(0x80 | r); break;                      // only bytes >= 128, negative as chars
+			case 3: buff[i] = (char)(32 + r % 95); break;                   // only printable characters
+			case 4: buff[i] = (char)edges[r % sizeof(edges)]; break;        // only the edges of the ranges
+			default: buff[i] = ((r % 16) ? buff[(i > 0) ? i - 1 : 0] : (char)r); break; // long runs of a byte
+		}
+	}
+}
+
+static void bench_conform(void) {
+	uint64_t state = seed;
+	uint64_t failures = 0;
+	char *payload = malloc(CONFORM_BODY_SIZE);
+	char headers[2 * PCC_MAX_HEADERS_SIZE];
+	uint64_t reply = 0;
+	if ( NULL == payload ) {
+		print_err("Error: Couldn't allocate the payload of the conformance suite", true);
+	}
+	fill_payload(payload, CONFORM_BODY_SIZE, &state);
+	
+	// every case breaks a connection in its own way, and the server must go on serving the next one right
+	#define CONFORM_CASE(name, passed) do { \
+		bool ok = (passed) && conform_sane(payload); \
+		printf("%s: %s\n", (name), ok ? "ok" : "FAILED"); \
+		failures += !ok; \
+	} while (0)
+	
+	uint64_t size_n = htobe64(CONFORM_BODY_SIZE);
+	uint64_t magic_n = pcc_session_magic_n(PCC_PROTOCOL_VERSION);
+	uint64_t huge_n = htobe64(UINT64_MAX / 2);
+	uint64_t other_version_n = pcc_session_magic_n(255);
+	
+	CONFORM_CASE("truncated size header", conform_send(headers, 0, &size_n, 3, NULL, 0, NULL) == CONFORM_CLOSED);
+	CONFORM_CASE("early close in the body", conform_send(headers, 0, &size_n, sizeof(uint64_t), payload, CONFORM_BODY_SIZE / 2, NULL) == CONFORM_CLOSED);
+	CONFORM_CASE("huge declared size", conform_send(headers, 0, &huge_n, sizeof(uint64_t), payload, CONFORM_BODY_SIZE / 2, &reply) == CONFORM_CLOSED ||
+	                                   (reply == PCC_REPLY_SHED));
+	CONFORM_CASE("huge declared size behind a held upload", conform_budget_overflow(payload));
+	CONFORM_CASE("session of an unknown version", conform_send(headers, 0, &other_version_n, sizeof(uint64_t), NULL, 0, NULL) == CONFORM_CLOSED);
+	
+	// frames whose headers are cut short, or invalid, are never replied to
+	uint64_t size = conform_frame(headers, 0, CONFORM_BODY_SIZE, 0);
+	CONFORM_CASE("truncated frame header", conform_send(headers, PCC_FRAME_HEADER_SIZE - 5, &magic_n, sizeof(uint64_t), NULL, 0, NULL) == CONFORM_CLOSED);
+	CONFORM_CASE("early close in a frame", conform_send(headers, size, &magic_n, sizeof(uint64_t), payload, CONFORM_BODY_SIZE / 2, NULL) == CONFORM_CLOSED);
+	size = conform_frame(headers, PCC_FRAME_PART, CONFORM_BODY_SIZE, 0);
+	CONFORM_CASE("truncated part header", conform_send(headers, size - 5, &magic_n, sizeof(uint64_t), NULL, 0, NULL) == CONFORM_CLOSED);
+	size = conform_frame(headers, 1U << 31, CONFORM_BODY_SIZE, 0);
+	CONFORM_CASE("unknown frame flags", conform_send(headers, size, &magic_n, sizeof(uint64_t), NULL, 0, NULL) == CONFORM_CLOSED);
+	size = conform_frame(headers, PCC_FRAME_CLASSES | PCC_FRAME_CLASS_TABLE, CONFORM_BODY_SIZE, 0);
+	CONFORM_CASE("two class sets", conform_send(headers, size, &magic_n, sizeof(uint64_t), NULL, 0, NULL) == CONFORM_CLOSED);
+	size = conform_frame(headers, PCC_FRAME_HASH | PCC_FRAME_PART, CONFORM_BODY_SIZE, 0);
+	CONFORM_CASE("hashed part", conform_send(headers, size, &magic_n, sizeof(uint64_t), NULL, 0, NULL) == CONFORM_CLOSED);
+	size = conform_frame(headers, PCC_FRAME_LOOKUP, CONFORM_BODY_SIZE, 0);
+	CONFORM_CASE("lookup without a hash", conform_send(headers, size, &magic_n, sizeof(uint64_t), NULL, 0, NULL) == CONFORM_CLOSED);
+	size = conform_frame(headers, PCC_FRAME_COMMIT, CONFORM_BODY_SIZE, 0);
+	CONFORM_CASE("commit with a body", conform_send(headers, size, &magic_n, sizeof(uint64_t), payload, CONFORM_BODY_SIZE, NULL) == CONFORM_CLOSED);
+	
+	// and frames that are valid, if unusual, are replied to right
+	uint64_t zero_n = 0;
+	CONFORM_CASE("empty upload", conform_send(headers, 0, &zero_n, sizeof(uint64_t), NULL, 0, &reply) == CONFORM_REPLIED && reply == 0);
+	size = conform_frame(headers, 0, 0, 0);
+	CONFORM_CASE("empty frame", conform_send(headers, size, &magic_n, sizeof(uint64_t), NULL, 0, &reply) == CONFORM_REPLIED && reply == 0);
+	size = conform_frame(headers, PCC_FRAME_HASH | PCC_FRAME_LOOKUP, UINT64_MAX / 2, next_random(&state));
+	CONFORM_CASE("lookup of a huge body", conform_send(headers, size, &magic_n, sizeof(uint64_t), NULL, 0, &reply) == CONFORM_REPLIED && reply == PCC_REPLY_MISS);
+	
+	// the frames before one that breaks the protocol are replied to (and counted) all the same, whatever the mode
+	CONFORM_CASE("valid frames, then an invalid header", conform_broken_session(payload));
+	
+	// a body sent with a hash it doesn't have is counted, but never replied to a lookup of that hash
+	uint64_t pcc[PCC_CHARS_RANGE] = {0};
+	uint64_t expected = kernel(payload, CONFORM_BODY_SIZE, pcc);
+	uint64_t lie = pcc_hash_buffer(payload, CONFORM_BODY_SIZE) ^ next_random(&state);
+	size = conform_frame(headers, PCC_FRAME_HASH, CONFORM_BODY_SIZE, lie);
+	size += conform_frame(headers + size, PCC_FRAME_HASH | PCC_FRAME_LOOKUP, CONFORM_BODY_SIZE, lie);
+	CONFORM_CASE("body of another hash", conform_lookup(headers, size, payload, expected) == PCC_REPLY_MISS);
+	
+	// and a body sent with its own hash is replied to its lookups, unless the server keeps no cache (`-d`)
+	uint64_t hash = pcc_hash_buffer(payload, CONFORM_BODY_SIZE);
+	size = conform_frame(headers, PCC_FRAME_HASH, CONFORM_BODY_SIZE, hash);
+	size += conform_frame(headers + size, PCC_FRAME_HASH | PCC_FRAME_LOOKUP, CONFORM_BODY_SIZE, hash);
+	reply = conform_lookup(headers, size, payload, expected);
+	CONFORM_CASE("body of its hash", reply == expected || reply == PCC_REPLY_MISS);
+	
+	// frame headers of random flags and sizes, with random bytes flipped, cut short anywhere
+	uint64_t fuzz_failures = 0;
+	for (unsigned int round = 0; round < CONFORM_FUZZ_ROUNDS; round++) {
+		uint32_t flags = next_random(&state) & (PCC_FRAME_KNOWN_FLAGS | ((next_random(&state) % 8) ? 0 : UINT32_MAX));
+		uint64_t frame_size = next_random(&state) >> (next_random(&state) % 64);
+		size = conform_frame(headers, flags, frame_size, next_random(&state));
+		for (unsigned int flips = next_random(&state) % 4; flips > 0; flips--) {
+			headers[next_random(&state) % size] ^= (char)(1 << (next_random(&state) % 8));
+		}
+		size -= (next_random(&state) % 2) ? next_random(&state) % (size + 1) : 0;
+		
+		// the server replies, refuses, or closes the connection, but never hangs on it once it was closed
+		uint64_t body_size = next_random(&state) % (CONFORM_BODY_SIZE + 1);
+		enum conform_result result = conform_send(headers, size, &magic_n, sizeof(uint64_t), payload, (next_random(&state) % 2) ? body_size : 0, NULL);
+		if ( result == CONFORM_TIMEOUT || ((round + 1) % CONFORM_SANE_EVERY == 0 && !conform_sane(payload)) ) {
+			fprintf(stderr, "Error: fuzzed frame %u (flags %#x, %lu bytes of headers): %s\n", round, flags, size,
+			        (result == CONFORM_TIMEOUT) ? "the server neither replied nor closed the connection" : "the server stopped serving right");
+			fuzz_failures++;
+		}
+	}
+	CONFORM_CASE("fuzzed frame headers", fuzz_failures == 0);
+	#undef CONFORM_CASE
+	
+	free(payload);
+	if ( failures > 0 ) {
+		exit(1);
+	}
+}
+
+static uint64_t conform_frame(char headers[], uint32_t flags, uint64_t size, uint64_t hash) {
+	struct pcc_frame_header frame = { .flags = flags, .size = size };
+	uint64_t headers_size = pcc_frame_headers_size(flags & PCC_FRAME_KNOWN_FLAGS);
+	
+	memset(headers, 0, headers_size);
+	pcc_encode_frame_header(headers, &frame);
+	if ( (flags & PCC_FRAME_HASH) && headers_size == PCC_FRAME_HEADER_SIZE + PCC_HASH_HEADER_SIZE ) {
+		pcc_encode_hash_header(headers + PCC_FRAME_HEADER_SIZE, hash);
+	}
+	return headers_size;
+}
+
+static enum conform_result conform_send(const char headers[], uint64_t size, const void *opening, uint64_t opening_size, const char body[], uint64_t body_size, uint64_t *reply) {
+	struct timeval timeout = { .tv_sec = CONFORM_WAIT_SECONDS };
+	int sockfd = -1;
+	
+	if ( 0 > (sockfd = socket(AF_INET, SOCK_STREAM, 0)) || 0 != setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ) {
+		print_err("Error: Couldn't create a socket", true);
+	}
+	if ( 0 > connect(sockfd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) ) {
+		print_err("Error: Couldn't connect to server", true);
+	}
+	
+	// whatever the server doesn't read may be refused, but the server closing the connection isn't an error here
+	if ( !conform_write(sockfd, opening, opening_size) || !conform_write(sockfd, headers, size) ||
+	     !conform_write(sockfd, body, body_size) ) {
+		close(sockfd);
+		return CONFORM_CLOSED;
+	}
+	shutdown(sockfd, SHUT_WR);
+	
+	// a reply, or the end of the connection (every reply is drained, so closing it doesn't reset it)
+	enum conform_result result = CONFORM_CLOSED;
+	uint64_t reply_n = 0;
+	char drained[4096];
+	ssize_t nread = 0;
+	uint64_t received = 0;
+	while ( 0 < (nread = read(sockfd, drained, sizeof(drained))) || (nread < 0 && errno == EINTR) ) {
+		if ( received < PCC_REPLY_SIZE && nread > 0 ) {
+			memcpy((char*)&reply_n + received, drained, (nread < (ssize_t)(PCC_REPLY_SIZE - received)) ? (uint64_t)nread : PCC_REPLY_SIZE - received);
+		}
+		received += (nread > 0) ? nread : 0;
+	}
+	if ( nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) {
+		result = CONFORM_TIMEOUT;
+	} else if ( received >= PCC_REPLY_SIZE ) {
+		result = CONFORM_REPLIED;
+	}
+	if ( NULL != reply ) {
+		*reply = be64toh(reply_n);
+	}
+	
+	close(sockfd);
+	return result;
+}
+
+static bool conform_write(int sockfd, const void *buff, uint64_t size) {
+	ssize_t nsent = 0;
+	
+	for (uint64_t totalsent = 0; totalsent < size; totalsent += nsent) {
+		if ( 0 > (nsent = send(sockfd, (const char*)buff + totalsent, size - totalsent, MSG_NOSIGNAL)) ) {
+			if ( errno == EINTR ) {
+				nsent = 0;
+				continue;
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+static uint64_t conform_lookup(const char headers[], uint64_t size, const char payload[], uint64_t expected) {
+	uint64_t first_size = pcc_frame_headers_size(PCC_FRAME_HASH);
+	uint64_t replies_n[2] = {0};
+	
+	// the body, then the lookup, in a session of their own
+	int sockfd = connect_server(true);
+	send_data(sockfd, headers, first_size);
+	send_data(sockfd, payload, CONFORM_BODY_SIZE);
+	send_data(sockfd, headers + first_size, size - first_size);
+	shutdown(sockfd, SHUT_WR);
+	recv_data(sockfd, replies_n, sizeof(replies_n));
+	close(sockfd);
+	
+	return (be64toh(replies_n[0]) == expected) ? be64toh(replies_n[1]) : expected + 1; // the body must be counted right either way
+}
+
+static bool conform_broken_session(const char payload[]) {
+	char stream[CONFORM_BROKEN_FRAMES * (PCC_FRAME_HEADER_SIZE + CONFORM_SANE_SIZE) + PCC_FRAME_HEADER_SIZE];
+	uint64_t replies_n[CONFORM_BROKEN_FRAMES + 1] = {0};
+	uint64_t pcc[PCC_CHARS_RANGE] = {0};
+	uint64_t expected = kernel((char*)payload, CONFORM_SANE_SIZE, pcc);
+	struct timeval timeout = { .tv_sec = CONFORM_WAIT_SECONDS };
+	uint64_t size = 0, received = 0;
+	ssize_t nread = 0;
+	
+	// the whole session is sent at once, so the server finds the broken header right behind the frames
+	for (unsigned int i = 0; i < CONFORM_BROKEN_FRAMES; i++) {
+		size += conform_frame(stream + size, 0, CONFORM_SANE_SIZE, 0);
+		memcpy(stream + size, payload, CONFORM_SANE_SIZE);
+		size += CONFORM_SANE_SIZE;
+	}
+	size += conform_frame(stream + size, 1U << 31, 0, 0);
+	
+	int sockfd = connect_server(true);
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	send_data(sockfd, stream, size);
+	shutdown(sockfd, SHUT_WR);
+	while ( received < sizeof(replies_n) && (0 < (nread = read(sockfd, (char*)replies_n + received, sizeof(replies_n) - received)) || (nread < 0 && errno == EINTR)) ) {
+		received += (nread > 0) ? nread : 0;
+	}
+	close(sockfd);
+	
+	bool replied = (nread == 0 && received == CONFORM_BROKEN_FRAMES * PCC_REPLY_SIZE);
+	for (unsigned int i = 0; i < CONFORM_BROKEN_FRAMES; i++) {
+		replied = replied && be64toh(replies_n[i]) == expected;
+	}
+	return replied;
+}
+
+static bool conform_budget_overflow(const char payload[]) {
+	uint64_t size_n = htobe64(CONFORM_BODY_SIZE);
+	uint64_t huge_n = htobe64(UINT64_MAX / 2);
+	uint64_t largest_n = htobe64(UINT64_MAX);
+	uint64_t huge_reply = 0, largest_reply = 0;
+	
+	// the held upload is admitted (when there's a budget) before the others arrive
+	int sockfd = connect_server(false);
+	send_data(sockfd, &size_n, sizeof(uint64_t));
+	send_data(sockfd, payload, CONFORM_BODY_SIZE / 2);
+	usleep(CONFORM_SETTLE_MS * 1000);
+	
+	enum conform_result huge = conform_send(NULL, 0, &huge_n, sizeof(uint64_t), NULL, 0, &huge_reply);
+	bool refused = (huge == CONFORM_REPLIED && huge_reply == PCC_REPLY_SHED);
+	bool passed = (huge == CONFORM_TIMEOUT) || !refused ||
+	              (conform_send(NULL, 0, &largest_n, sizeof(uint64_t), NULL, 0, &largest_reply) == CONFORM_REPLIED && largest_reply == PCC_REPLY_SHED);
+	close(sockfd);
+	return passed;
+}
+
+static bool conform_sane(const char payload[]) {
+	uint64_t pcc[PCC_CHARS_RANGE] = {0};
+	uint64_t expected = kernel((char*)payload, CONFORM_SANE_SIZE, pcc);
+	uint64_t size_n = htobe64(CONFORM_SANE_SIZE);
+	uint64_t reply_n = 0;
+	
+	int sockfd = connect_server(false);
+	send_data(sockfd, &size_n, PCC_SIZE_HEADER_SIZE);
+	send_data(sockfd, payload, CONFORM_SANE_SIZE);
+	recv_data(sockfd, &reply_n, PCC_REPLY_SIZE);
+	close(sockfd);
+	
+	return be64toh(reply_n) == expected;
+}
+
+static int connect_server(bool session) {
+	int sockfd = -1;
+
+	if ( 0 > (sockfd = socket(AF_INET, SOCK_STREAM, 0)) ) {
+		print_err("Error: Couldn't create a socket", true);
+	}
+	if ( 0 > connect(sockfd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) ) {
+		print_err("Error: Couldn't connect to server", true);
+	}
+
+	// every upload waits for its reply before the next one, so the tail of a body mustn't wait for an ACK
+	int option_value = 1;
+	if ( 0 != setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &option_value, sizeof(int)) ) {
+		print_err("Error: Couldn't set socket options", true);
+	}
+	if ( session ) {
+		uint64_t magic_n = pcc_session_magic_n(PCC_PROTOCOL_VERSION);
+		send_data(sockfd, &magic_n, PCC_SIZE_HEADER_SIZE);
+	}
+
+	return sockfd;
+}
+
+static void send_data(int sockfd, const void *buff, uint64_t size) {
+	ssize_t nsent = 0;
+	uint64_t totalsent = 0;
+
+	while ( totalsent < size ) {
+		if ( 0 > (nsent = send(sockfd, (const char*)buff + totalsent, size - totalsent, MSG_NOSIGNAL)) ) {
+			if ( errno == EINTR ) continue;
+			print_err("Error: Couldn't send data through socket", true);
+		}
+		totalsent += nsent;
+	}
+}
+
+static void recv_data(int sockfd, void *buff, uint64_t size) {
+	ssize_t nread = 0;
+	uint64_t totalread = 0;
+
+	while ( totalread < size ) {
+		if ( 0 > (nread = read(sockfd, (char*)buff + totalread, size - totalread)) ) {
+			if ( errno == EINTR ) continue;
+			print_err("Error: Couldn't read from socket", true);
+		} else if ( nread == 0 ) { // the server closed the connection before replying
+			errno = ECONNRESET;
+			print_err("Error: Server closed the connection", true);
+		}
+		totalread += nread;
+	}
+}
+
+static int compare_latencies(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+/************************************************************/
+
+
+
+
+
+/*************** MAIN ******************/
+int main(int argc, char *argv[]) {
+
+	// parse options
+	int opt;
+	char *colon = NULL;
+	while ( -1 != (opt = getopt(argc, argv, "c:n:s:p:f:S:")) ) {
+		switch (opt) {
+			case 'c': // the amount of threads uploading at once
+				if ( 0 >= (concurrency = atoi(optarg)) ) {
+					errno = EINVAL;
+					print_err("Error: The concurrency passed to `-c` must be positive", true);
+				}
+				break;
+			case 'n': // the amount of uploads of each thread
+				uploads_per_thread = strtoull(optarg, NULL, 10);
+				break;
+			case 's': // the size of the files, or the range of their sizes
+				min_size = max_size = strtoull(optarg, &colon, 10);
+				if ( *colon == ':' ) {
+					max_size = strtoull(colon + 1, NULL, 10);
+				}
+				if ( max_size < min_size || max_size == 0 ) {
+					errno = EINVAL;
+					print_err("Error: The sizes passed to `-s` must be min[:max], with max positive and no less than min", true);
+				}
+				break;
+			case 'p': // the share of printable bytes
+				printable_ratio = atof(optarg);
+				if ( printable_ratio < 0 || printable_ratio > 1 ) {
+					errno = EINVAL;
+					print_err("Error: The ratio passed to `-p` must be between 0 and 1", true);
+				}
+				break;
+			case 'f': // the frames of each connection
+				if ( 0 == (frames_per_connection = strtoull(optarg, NULL, 10)) ) {
+					errno = EINVAL;
+					print_err("Error: The frames passed to `-f` must be positive", true);
+				}
+				break;
+			case 'S': // the seed of the synthetic files
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				errno = EINVAL;
+				print_err("Error: Usage: bench [-s min[:max] size] [-p printable ratio] [-S seed] kernels\n"
+				          "       bench merge\n"
+				          "       bench [-S seed] check\n"
+				          "       bench [-S seed] conform <ip> <port>\n"
+				          "       bench [-c threads] [-n uploads per thread] [-s min[:max] size] [-p printable ratio] [-f frames per connection] [-S seed] load <ip> <port>", true);
+		}
+	}
+	seed = seed ? seed : 1; // the generator never leaves a zero state
+	kernel = select_pcc_kernel("auto");
+
+	// run the requested benchmark
+	if ( argc - optind == 1 && 0 == strcmp(argv[optind], "kernels") ) {
+		bench_kernels();
+
+	} else if ( argc - optind == 1 && 0 == strcmp(argv[optind], "merge") ) {
+		bench_merge();
+
+	} else if ( argc - optind == 1 && 0 == strcmp(argv[optind], "check") ) {
+		bench_check();
+
+	} else if ( argc - optind == 3 && (0 == strcmp(argv[optind], "load") || 0 == strcmp(argv[optind], "conform")) ) {
+		memset(&serv_addr, 0, sizeof(serv_addr));
+		serv_addr.sin_family = AF_INET;
+		serv_addr.sin_port = htons(atoi(argv[optind + 2]));
+		serv_addr.sin_addr.s_addr = inet_addr(argv[optind + 1]);
+		if ( 0 == strcmp(argv[optind], "load") ) {
+			bench_load();
+		} else {
+			bench_conform();
+		}
+
+	} else {
+		errno = EINVAL;
+		print_err("Error: Expected `kernels`, `merge`, `check`, `load <ip> <port>` or `conform <ip> <port>`", true);
+	}
+
+	exit(0);
+}
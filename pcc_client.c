@@ -12,6 +12,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <string.h>
@@ -24,10 +25,145 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <endian.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <zlib.h>
+#include "pcc_protocol.h"
+#include "pcc_count.h"
+#include "pcc_hash.h"
 
 #define bool int
 #define true 1
 #define false 0
+#define DATA_BUFF_SIZE 1000000 // the size of the buffer used by the copying upload (1MB)
+#define SESSION_WINDOW 64 // the amount of frames a session sends ahead of their replies
+#define COUNT_CHUNK_MIN_SIZE (1 << 20) // a mapped file is split between counting threads in chunks of at least 1MB
+#define DEFLATE_BLOCK_SIZE (256 * 1024) // the most compressed bytes sent in a block of a compressed frame
+#define PART_ATTEMPTS 3 // the times a part of a parallel upload is sent, over a new connection each time, before giving up
+#define BATCH_MAX_EVENTS 64 // the most events of the connections of the batch mode handled per epoll_wait
+
+/* the way the contents of the file are uploaded */
+enum upload_method {
+	UPLOAD_AUTO,     // sendfile, falling back to splice, and to copying for non-regular files (default)
+	UPLOAD_SENDFILE, // sendfile(2) straight from the file to the socket
+	UPLOAD_SPLICE,   // splice(2) from the file to the socket through a pipe
+	UPLOAD_COPY      // read(2) into a userspace buffer, then write(2) it to the socket
+};
+
+/* the local count of a file, as counted by the server's kernels (`-v` and `-d`): its printable characters,
+ * or its bytes for other class sets than the printable one (see `local_histogram`) */
+struct local_count {
+	uint64_t printable_chars;
+	uint64_t hist[PCC_BYTE_VALUES];
+};
+
+/* a chunk of a mapped file, counted by its own thread */
+struct count_chunk {
+	pthread_t thread;
+	char *data;
+	uint64_t size;
+	struct local_count count;
+};
+
+
+
+/* a file of a session that looks its files up by their content hash first (`-D`) */
+struct dedup_file {
+	uint64_t hash;  // the content hash of the file
+	uint64_t size;  // and its size
+	bool looked_up; // whether it was looked up, rather than sent whole (only regular files are hashed)
+};
+
+
+
+/* a range of a file uploaded over its own connection, as a part of a transfer (`-P`) */
+struct part_stream {
+	pthread_t thread;
+	int file_fd;
+	struct sockaddr_in *serv_addr;
+	struct pcc_part_header part;
+	uint64_t size;            // the size of the range
+	uint64_t printable_chars; // the amount of printable characters the server replied with
+	bool acked;               // whether the server replied to the part
+};
+
+
+
+/* the stage of the upload of a file by a connection of the batch mode */
+enum batch_state {
+	BATCH_SEND_HEADERS, // sending the session magic (once per connection) and the size, or the headers of the frame
+	BATCH_SEND_BODY,    // sending the contents of the file, with sendfile(2)
+	BATCH_RECV_REPLY    // receiving the reply, and the histogram after it if it was asked for
+};
+
+/* what came of advancing the upload of a connection of the batch mode */
+enum batch_result {
+	BATCH_BLOCKED, // the socket would block, the upload goes on upon its next event
+	BATCH_DONE,    // the reply arrived
+	BATCH_REFUSED, // the server refused the upload (see `PCC_REPLY_SHED`)
+	BATCH_MISSED,  // the server doesn't know the file that was looked up, which is to be sent (see `PCC_REPLY_MISS`)
+	BATCH_FAILED   // the connection failed on the way
+};
+
+/* a connection of the batch mode (`-c`), uploading a file at a time over a non-blocking socket */
+struct batch_conn {
+	int sockfd;               // -1 while the connection isn't open
+	bool session;             // whether the session was opened over the connection
+	int file_index;           // the file uploaded, or -1 while the connection is idle
+	int file_fd;
+	uint64_t file_size;
+	off_t file_offset;        // how much of the file was sent
+	bool lookup;              // whether only the hash of the file is sent, for now (`-D`)
+	uint64_t hash;            // the content hash of the file, when looking it up
+	enum batch_state state;
+	char out[2 * sizeof(uint64_t) + PCC_MAX_HEADERS_SIZE]; // the headers being sent
+	uint64_t out_size, out_sent;
+	char in[PCC_REPLY_SIZE + sizeof(uint16_t) + PCC_HISTOGRAM_MAX_SIZE]; // the reply being received
+	uint64_t in_size;         // how much of the reply was received
+	struct local_count local; // the local count of the file, when verifying
+};
+
+/* the files of the batch mode, and its results so far */
+struct batch {
+	int epfd;
+	struct sockaddr_in *serv_addr;
+	char **file_paths;
+	int nfiles;
+	int next;               // the next file to hand to an idle connection
+	uint64_t total_bytes;   // the amount of bytes of the files replied to
+	uint64_t total_count;   // the count of all of the files replied to, in the class set
+	uint64_t hist_total[PCC_MAX_BUCKETS];
+	int nreplied;           // the amount of files replied to
+	int nfailed;            // the amount of files that couldn't be uploaded, or were refused
+};
+
+
+
+/*************** GLOBAL VARIABLES ******************/
+enum upload_method upload_method = UPLOAD_AUTO; // the way the file is uploaded (`-u`)
+bool report_throughput = false; // whether to print the throughput achieved (`-r`)
+bool force_session = false; // whether to open a session even for a single file (`-s`)
+bool request_histogram = false; // whether to ask for, and print, the histogram of each file (`-H`)
+bool verify = false; // whether to count each file locally, upload it from its mapping and check the reply (`-v`)
+bool dry_run = false; // whether to only count the files locally, without uploading them (`-d`)
+int count_threads = 0; // the amount of threads counting a mapped file (`-j`), one per CPU by default
+pcc_kernel kernel = NULL; // the counting kernel of the local counts, the same as the server's
+int mismatches = 0; // the amount of replies that didn't match the local count
+int parallel_streams = 1; // the amount of connections a single file is uploaded over at once (`-P`)
+bool compress_frames = false; // whether to compress the frames of a session (`-z`)
+z_stream *deflater = NULL; // the compressor of the frames, created upon the first of them
+struct pcc_class_set classes = { .id = PCC_CLASSES_PRINTABLE, .buckets = PCC_CHARS_RANGE }; // the class set the files are counted in (`-x`)
+uint8_t class_table[PCC_CLASS_TABLE_SIZE]; // the table of a custom class set, as sent over the wire
+int batch_connections = 0; // the amount of uploads the batch mode keeps in flight (`-c`), 0 outside of it
+bool dedup = false; // whether to look each file up by its content hash, and send it only if the server doesn't know it (`-D`)
+uint64_t dedup_hits = 0; // the amount of files the server knew
+uint64_t dedup_saved = 0; // and the amount of bytes they spared
+/***************************************************/
 
 
 
@@ -38,7 +174,8 @@ static void print_err(char* error_message, bool terminate);
 
 /* This function receives an already connected socket with its file descriptor
  * of <sockfd>, the amount of bytes to receive named <size>, and the buffer
- * to save the sent bytes into named <buff> */
+ * to save the sent bytes into named <buff>. Terminates if the server closes
+ * the connection before all of them arrived */
 static void recv_data(int sockfd, void *buff, uint64_t size);
 
 /* This function receives an already connected socket with its file descriptor
@@ -47,11 +184,163 @@ static void recv_data(int sockfd, void *buff, uint64_t size);
  * other end */
 static void send_data(int sockfd, void *buff, uint64_t size);
 
+/* Same as `recv_data` and `send_data`, but return <false> upon any error (or an early EOF) instead of terminating */
+static bool try_recv_data(int sockfd, void *buff, uint64_t size);
+static bool try_send_data(int sockfd, const void *buff, uint64_t size);
+
+/* Receives the 8-byte count of a reply from the socket <sockfd>, and returns it. Terminates
+ * if the server refused the upload instead (see `PCC_REPLY_SHED`) */
+static uint64_t recv_reply(int sockfd);
+
+/* Returns a socket connected to the server at <serv_addr>, or -1 (after printing the error) if it failed */
+static int connect_server(struct sockaddr_in *serv_addr);
+
 /* This function receives an already connected socket with its file descriptor
  * of <sockfd>, and a file descriptor named <file_fd> of the file we want to send
  * over the socket, and sends all of the contents of the file at <file_fd> over
- * the socket */
-static uint64_t send_file(int sockfd, int file_fd);
+ * the socket. If <local> isn't NULL, the file is counted into it too */
+static uint64_t send_file(int sockfd, int file_fd, struct local_count *local);
+
+/* Same as `send_file`, but sends the file as a frame of a session: the frame header, then the contents */
+static uint64_t send_frame(int sockfd, int file_fd, struct local_count *local);
+
+/* Encodes the headers of a frame of <size> bytes into <header>, flagged as the options ask for:
+ * the frame header, then the class header or table of another class set than the printable one.
+ * <hash_flags> flags the frame with `PCC_FRAME_HASH` (and `PCC_FRAME_LOOKUP`), the hash header then
+ * holding the content hash <hash>. Return the size of the headers */
+static uint64_t encode_frame_headers(char header[], uint64_t size, uint32_t hash_flags, uint64_t hash);
+
+/* Returns the content hash of the <size> bytes of the regular file at <file_fd> (see pcc_hash.h), hashed
+ * from its mapping, which it's counted from into <local> too unless it's NULL */
+static uint64_t hash_file(int file_fd, uint64_t size, struct local_count *local);
+
+/* Sends the file at <file_fd> as the first frame of a session for it (`-D`): a regular file is hashed
+ * (and counted into <local>, unless it's NULL) and looked up, anything else is sent as usual. What was
+ * sent is stored in <file>. Return the file size */
+static uint64_t send_lookup(int sockfd, int file_fd, struct dedup_file *file, struct local_count *local);
+
+/* Sends the regular file at <file_fd> as a frame flagged with its content hash <hash>, once the
+ * server missed its lookup. Return the file size */
+static uint64_t send_hashed_frame(int sockfd, int file_fd, uint64_t hash);
+
+/* This function sends the <size> bytes of the contents of the file at <file_fd> over the socket
+ * <sockfd>, in the way chosen by `upload_method`. <is_regular> tells whether it's a regular file.
+ * If <local> isn't NULL, the file is counted into it first, and uploaded from the same mapping
+ * (or counted as it's copied, if it can't be mapped). A negative <sockfd> only counts the file */
+static void send_file_contents(int sockfd, int file_fd, uint64_t size, bool is_regular, struct local_count *local);
+
+/* Counts the <size> bytes of the mapped file <data> into <local>, splitting it between up to
+ * `count_threads` threads, with the same kernel as the server */
+static void count_mapping(char *data, uint64_t size, struct local_count *local);
+
+/* Counts the <size> bytes of <data> into <local>, in the class set `classes` */
+static void count_local(char data[], uint64_t size, struct local_count *local);
+
+/* Writes the histogram of the complete local count <local> in the class set `classes` into <hist>
+ * (classes.buckets counts). Return the count of the file in the class set */
+static uint64_t local_histogram(struct local_count *local, uint64_t hist[]);
+
+/* Reads the custom class set `-x` names from the file at <path>: the bucket of each of the
+ * PCC_CLASS_TABLE_SIZE byte values, as a byte, or 0xff for a byte value it doesn't count */
+static void read_class_table(const char *path);
+
+/* Returns what the class set `classes` counts, as printed along with the counts */
+static const char *count_label(void);
+
+/* The entry point of a thread counting the chunk <arg> of a mapped file */
+static void *count_chunk_main(void *arg);
+
+/* Checks the reply of the server for the file at <file_path> against its local count <local>:
+ * the amount of printable characters <printable_chars>, and the histogram <hist> unless it's NULL.
+ * Prints any mismatch, and counts it in `mismatches` */
+static void check_reply(const char *file_path, uint64_t printable_chars, uint64_t hist[], struct local_count *local);
+
+/* Counts the <nfiles> files at <file_paths> locally, without uploading them, and prints the amount
+ * of printable characters in each of them, in all of them, and the throughput of the counting */
+static void count_files(char *file_paths[], int nfiles);
+
+/* Returns the files that the paths <paths> (<npaths> of them) stand for: a regular file stands
+ * for itself, a directory for the regular files right under it (or anywhere beneath it, if <recursive>),
+ * and "-" for the paths read from the standard input, one per line. Their amount is stored in <nfiles> */
+static char **collect_files(char *paths[], int npaths, bool recursive, int *nfiles);
+
+/* Adds the files that the path <path> stands for (see `collect_files`) to <*files>, which holds <*nfiles>
+ * files and has room for <*capacity> */
+static void collect_path(char *path, bool recursive, char ***files, int *nfiles, int *capacity);
+
+/* Uploads the <nfiles> files at <file_paths> as frames of a single session over the connected
+ * socket <sockfd>, sending up to SESSION_WINDOW frames ahead of their replies, and prints the
+ * amount of printable characters in each of them, and in all of them. With `dedup`, each file is
+ * looked up first, and the files the server misses are sent after the lookups, as their misses arrive.
+ *
+ * Return the amount of bytes uploaded */
+static uint64_t upload_session(int sockfd, char *file_paths[], int nfiles);
+
+/* Uploads the regular file <file_fd> (at <file_path>) to the server at <serv_addr> as a transfer: its
+ * ranges are sent as parts over `parallel_streams` connections at once, each retried over a new connection
+ * up to PART_ATTEMPTS times, then a new connection commits the transfer, and the amount of printable
+ * characters in the whole file is printed.
+ *
+ * Return the size of the file */
+static uint64_t upload_parallel(struct sockaddr_in *serv_addr, int file_fd, const char *file_path);
+
+/* Uploads the <nfiles> files at <file_paths> to the server at <serv_addr>, keeping `batch_connections`
+ * of them in flight at once, each over a non-blocking connection of its own that either uploads a single
+ * file, or (with `force_session`) file after file in a session. Prints the count of each file as its
+ * reply arrives, then the count of all of them and the throughput of the batch. The files are read
+ * sequentially and dropped from the page cache once sent, so a large dataset doesn't thrash it.
+ *
+ * Return the amount of files that couldn't be uploaded */
+static int upload_batch(struct sockaddr_in *serv_addr, char *file_paths[], int nfiles);
+
+/* Hands the next file of the batch <b> to its idle connection <conn>, connecting it if it isn't connected:
+ * opens the file and encodes the headers of its upload. Files that can't be opened (or connected for) are
+ * reported and counted as failed, and the connection is left idle once no file is left */
+static void batch_next(struct batch *b, struct batch_conn *conn);
+
+/* Advances the upload of the connection <conn> as far as its non-blocking socket allows,
+ * and returns how it ended (see `enum batch_result`) */
+static enum batch_result batch_advance(struct batch_conn *conn);
+
+/* Returns the size of the reply that the connection <conn> receives, as far as the part of it received so far
+ * tells: the count, then the size of the histogram and the histogram itself if it was asked for (unless the
+ * upload was refused) */
+static uint64_t batch_reply_size(struct batch_conn *conn);
+
+/* Drives the connection <conn> of the batch <b>: advances its uploads, reporting each of them once it ended
+ * and handing the connection the next file, until its socket would block or no file is left */
+static void batch_drive(struct batch *b, struct batch_conn *conn);
+
+/* Closes the connection <conn> of the batch mode, which leaves its session too */
+static void batch_close(struct batch_conn *conn);
+
+/* The entry point of a thread uploading the part <arg> of a parallel upload */
+static void *part_stream_main(void *arg);
+
+/* Sends the part <stream> over the connected socket <sockfd> in a session of its own, and receives its reply.
+ * Return <false> if the connection failed on the way */
+static bool send_part(int sockfd, struct part_stream *stream);
+
+/* Receives the histogram that follows the reply to a frame flagged with `PCC_FRAME_HISTOGRAM`
+ * over the socket <sockfd>, decodes it into <hist> (classes.buckets counts) and adds
+ * it to <hist_total>. Terminates if the histogram is malformed */
+static void recv_histogram(int sockfd, uint64_t hist[], uint64_t hist_total[]);
+
+/* Prints the non-zero counts of the histogram <hist> in the class set `classes`, each line prefixed by <prefix> */
+static void print_histogram(const char *prefix, uint64_t hist[]);
+
+/* These functions send the next <size> bytes of the file at <file_fd> over the socket <sockfd>.
+ * `sendfile_data` and `splice_data` never copy the bytes through userspace, and return <false>
+ * if the kernel doesn't support them for these file descriptors (before anything was sent).
+ * `copy_data` reads the file into a buffer and writes it to the socket (unless <sockfd> is negative),
+ * counting it into <local> unless it's NULL, and works for any file */
+static bool sendfile_data(int sockfd, int file_fd, uint64_t size);
+static bool splice_data(int sockfd, int file_fd, uint64_t size);
+static void copy_data(int sockfd, int file_fd, uint64_t size, struct local_count *local);
+
+/* Same as `copy_data`, but compresses the bytes on their way to the socket, as a raw deflate
+ * stream split into blocks and ended by an empty block (see `PCC_FRAME_DEFLATE`) */
+static void deflate_data(int sockfd, int file_fd, uint64_t size, struct local_count *local);
 /**************************************************/
 
 
@@ -71,13 +360,16 @@ static void print_err(char* error_message, bool terminate) {
 
 static void recv_data(int sockfd, void *buff, uint64_t size) {
 	uint64_t notread = size;
-	uint64_t nread = 0;
+	ssize_t nread = 0;
 	uint64_t totalread = 0;
 	
 	while ( notread > 0 ) {
 	
 		if ( 0 > (nread = read(sockfd, buff + totalread, notread)) ) { // if an error occured reading data
 			print_err("Error: Couldn't read from socket", true);
+		} else if ( nread == 0 ) { // if the server closed the connection before replying
+			errno = ECONNRESET;
+			print_err("Error: Server closed the connection", true);
 		} else { // if no error occured when reading the data, advance
 			totalread += nread;
 			notread -= nread;
@@ -87,7 +379,7 @@ static void recv_data(int sockfd, void *buff, uint64_t size) {
 }
 
 static void send_data(int sockfd, void *buff, uint64_t size) {
-	uint64_t nsent = 0; // how much we've written in last write() call
+	ssize_t nsent = 0; // how much we've written in last write() call
 	uint64_t totalsent = 0; // how much we've written so far
 	uint64_t notwritten = size; // how much we have left to write
 	
@@ -104,7 +396,68 @@ static void send_data(int sockfd, void *buff, uint64_t size) {
 	}
 }
 
-static uint64_t send_file(int sockfd, int file_fd) {
+static bool try_recv_data(int sockfd, void *buff, uint64_t size) {
+	ssize_t nread = 0;
+	
+	for (uint64_t totalread = 0; totalread < size; totalread += nread) {
+		if ( 0 >= (nread = read(sockfd, buff + totalread, size - totalread)) ) {
+			if ( nread < 0 && errno == EINTR ) {
+				nread = 0;
+				continue;
+			}
+			errno = (nread == 0) ? ECONNRESET : errno;
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+static bool try_send_data(int sockfd, const void *buff, uint64_t size) {
+	ssize_t nsent = 0;
+	
+	for (uint64_t totalsent = 0; totalsent < size; totalsent += nsent) {
+		if ( 0 > (nsent = send(sockfd, buff + totalsent, size - totalsent, MSG_NOSIGNAL)) ) {
+			if ( errno == EINTR ) {
+				nsent = 0;
+				continue;
+			}
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+static uint64_t recv_reply(int sockfd) {
+	uint64_t printable_chars_n;
+	recv_data(sockfd, &printable_chars_n, PCC_REPLY_SIZE);
+	
+	if ( printable_chars_n == htobe64(PCC_REPLY_SHED) ) {
+		errno = EBUSY;
+		print_err("Error: The server refused the upload (too large, or overloaded)", true);
+	}
+	
+	return be64toh(printable_chars_n); // big endian to host
+}
+
+static int connect_server(struct sockaddr_in *serv_addr) {
+	int sockfd = -1;
+	
+	if( 0 > (sockfd = socket(AF_INET, SOCK_STREAM, 0)) ) {
+		print_err("Error: Couldn't create a socket", false);
+		return -1;
+	}
+	if( connect(sockfd, (struct sockaddr*) serv_addr, sizeof(struct sockaddr_in)) < 0)	{
+		print_err("Error: Couldn't connect to server", false);
+		close(sockfd);
+		return -1;
+	}
+	
+	return sockfd;
+}
+
+static uint64_t send_file(int sockfd, int file_fd, struct local_count *local) {
 	uint64_t number_bytes_send_h = -1; // the size of the file in bytes and host-endiann-ed
 
 	// send the amount of bytes that the file that we send holds
@@ -113,28 +466,1054 @@ static uint64_t send_file(int sockfd, int file_fd) {
 		print_err("Error: Couldn't `stat` the supplied file", true);
 	} else { // if the stat of the file succeeded, extract the file size, and send it over the connection
 		number_bytes_send_h = sb.st_size; // host-endiann-ed size
-		uint64_t number_bytes_send_n = be64toh(number_bytes_send_h); // big-endiann-ed size
+		uint64_t number_bytes_send_n = htobe64(number_bytes_send_h); // big-endiann-ed size
 		send_data(sockfd, &number_bytes_send_n, sizeof(uint64_t)); // sending the size
 	}
 	
-	// send the file in buffers to the server
-	char data_buff[1000000]; // 1MB buffer
-	uint64_t bytes_read_from_file = 0; // the amount of bytes we've currently read from the file
-	uint64_t file_notread = number_bytes_send_h; // the amount of bytes in the file that we still need to send 
+	// send the contents of the file
+	send_file_contents(sockfd, file_fd, number_bytes_send_h, S_ISREG(sb.st_mode), local);
+	
+	// return the file size
+	return number_bytes_send_h;
+}
+
+static uint64_t send_frame(int sockfd, int file_fd, struct local_count *local) {
+	char header[PCC_MAX_HEADERS_SIZE];
+	
+	// send the headers of the frame, holding the size of the file
+	struct stat sb;
+	if ( -1 == fstat(file_fd, &sb) ) { // if the stat of the file failed
+		print_err("Error: Couldn't `stat` the supplied file", true);
+	}
+	send_data(sockfd, header, encode_frame_headers(header, sb.st_size, 0, 0));
+	
+	// send the contents of the file, compressed if asked to (the header holds the size before compression)
+	if ( compress_frames ) {
+		if ( NULL != local ) {
+			memset(local, 0, sizeof(struct local_count));
+		}
+		deflate_data(sockfd, file_fd, sb.st_size, local);
+	} else {
+		send_file_contents(sockfd, file_fd, sb.st_size, S_ISREG(sb.st_mode), local);
+	}
+	
+	// return the file size
+	return sb.st_size;
+}
+
+static uint64_t encode_frame_headers(char header[], uint64_t size, uint32_t hash_flags, uint64_t hash) {
+	struct pcc_frame_header frame = { .flags = (request_histogram ? PCC_FRAME_HISTOGRAM : 0) | (compress_frames ? PCC_FRAME_DEFLATE : 0) | hash_flags, .size = size };
+	
+	// another class set than the printable one is named by its header, or sent as a table (never along with a hash)
+	if ( classes.id == PCC_CLASSES_CUSTOM ) {
+		frame.flags |= PCC_FRAME_CLASS_TABLE;
+		memcpy(header + PCC_FRAME_HEADER_SIZE, class_table, PCC_CLASS_TABLE_SIZE);
+	} else if ( classes.id != PCC_CLASSES_PRINTABLE ) {
+		frame.flags |= PCC_FRAME_CLASSES;
+		pcc_encode_classes_header(header + PCC_FRAME_HEADER_SIZE, classes.id);
+	} else if ( hash_flags & PCC_FRAME_HASH ) {
+		pcc_encode_hash_header(header + PCC_FRAME_HEADER_SIZE, hash);
+	}
+	
+	pcc_encode_frame_header(header, &frame);
+	return pcc_frame_headers_size(frame.flags);
+}
+
+static uint64_t hash_file(int file_fd, uint64_t size, struct local_count *local) {
+	if ( NULL != local ) {
+		memset(local, 0, sizeof(struct local_count));
+	}
+	if ( size == 0 ) { // nothing to map, or to count
+		return pcc_hash_buffer("", 0);
+	}
+	
+	char *data = mmap(NULL, size, PROT_READ, MAP_SHARED, file_fd, 0);
+	if ( MAP_FAILED == data ) {
+		print_err("Error: Couldn't map a file to hash it", true);
+	}
+	
+	madvise(data, size, MADV_SEQUENTIAL);
+	uint64_t hash = pcc_hash_buffer(data, size);
+	if ( NULL != local ) {
+		count_mapping(data, size, local);
+	}
+	
+	munmap(data, size);
+	return hash;
+}
+
+static uint64_t send_lookup(int sockfd, int file_fd, struct dedup_file *file, struct local_count *local) {
+	char header[PCC_MAX_HEADERS_SIZE];
+	
+	struct stat sb;
+	if ( -1 == fstat(file_fd, &sb) ) { // if the stat of the file failed
+		print_err("Error: Couldn't `stat` the supplied file", true);
+	}
+	file->looked_up = S_ISREG(sb.st_mode);
+	if ( !file->looked_up ) { // a pipe can't be read twice, so it's sent right away
+		return send_frame(sockfd, file_fd, local);
+	}
+	
+	// only the headers of the frame are sent, the body follows if the server misses it
+	file->hash = hash_file(file_fd, sb.st_size, local);
+	file->size = sb.st_size;
+	send_data(sockfd, header, encode_frame_headers(header, sb.st_size, PCC_FRAME_HASH | PCC_FRAME_LOOKUP, file->hash));
+	return sb.st_size;
+}
+
+static uint64_t send_hashed_frame(int sockfd, int file_fd, uint64_t hash) {
+	char header[PCC_MAX_HEADERS_SIZE];
+	
+	struct stat sb;
+	if ( -1 == fstat(file_fd, &sb) ) { // if the stat of the file failed
+		print_err("Error: Couldn't `stat` the supplied file", true);
+	}
+	send_data(sockfd, header, encode_frame_headers(header, sb.st_size, PCC_FRAME_HASH, hash));
+	send_file_contents(sockfd, file_fd, sb.st_size, true, NULL);
+	return sb.st_size;
+}
+
+static void send_file_contents(int sockfd, int file_fd, uint64_t size, bool is_regular, struct local_count *local) {
+	
+	// count the file locally, and upload it from the same mapping
+	if ( NULL != local ) {
+		memset(local, 0, sizeof(struct local_count));
+		char *data = (is_regular && size > 0) ? mmap(NULL, size, PROT_READ, MAP_SHARED, file_fd, 0) : MAP_FAILED;
+		if ( MAP_FAILED == data ) { // the file can't be mapped, count it while copying it
+			copy_data(sockfd, file_fd, size, local);
+			return;
+		}
+		
+		madvise(data, size, MADV_SEQUENTIAL);
+		madvise(data, size, MADV_HUGEPAGE); // only a hint, file mappings may not support it
+		count_mapping(data, size, local);
+		if ( sockfd >= 0 ) {
+			send_data(sockfd, data, size);
+		}
+		munmap(data, size);
+		return;
+	}
+	
+	// send the contents of the file, without copying them through userspace whenever the kernel allows it
+	bool sent = false;
+	bool zero_copy = is_regular && upload_method != UPLOAD_COPY;
+	
+	if ( zero_copy && (upload_method == UPLOAD_AUTO || upload_method == UPLOAD_SENDFILE) ) {
+		sent = sendfile_data(sockfd, file_fd, size);
+	}
+	if ( zero_copy && !sent && (upload_method == UPLOAD_AUTO || upload_method == UPLOAD_SPLICE) ) {
+		sent = splice_data(sockfd, file_fd, size);
+	}
+	if ( !sent ) {
+		copy_data(sockfd, file_fd, size, NULL);
+	}
+}
+
+static void count_mapping(char *data, uint64_t size, struct local_count *local) {
+	struct count_chunk chunks[count_threads];
+	
+	// splitting the file into page-aligned chunks of at least COUNT_CHUNK_MIN_SIZE bytes, one per thread
+	uint64_t chunk_size = (size + count_threads - 1) / count_threads;
+	chunk_size = (chunk_size < COUNT_CHUNK_MIN_SIZE) ? COUNT_CHUNK_MIN_SIZE : (chunk_size + 4095) & ~(uint64_t)4095;
+	int nchunks = 0;
+	for (uint64_t offset = 0; offset < size; offset += chunk_size, nchunks++) {
+		memset(&chunks[nchunks], 0, sizeof(struct count_chunk));
+		chunks[nchunks].data = data + offset;
+		chunks[nchunks].size = (size - offset < chunk_size) ? size - offset : chunk_size;
+	}
+	
+	// the first chunk is counted by the calling thread
+	for (int i = 1; i < nchunks; i++) {
+		if ( 0 != (errno = pthread_create(&chunks[i].thread, NULL, count_chunk_main, &chunks[i])) ) {
+			print_err("Error: Couldn't create a counting thread", true);
+		}
+	}
+	count_chunk_main(&chunks[0]);
+	
+	for (int i = 0; i < nchunks; i++) {
+		if ( i > 0 ) {
+			pthread_join(chunks[i].thread, NULL);
+		}
+		local->printable_chars += chunks[i].count.printable_chars;
+		for (unsigned int c = 0; c < PCC_BYTE_VALUES; c++) {
+			local->hist[c] += chunks[i].count.hist[c];
+		}
+	}
+}
+
+static void *count_chunk_main(void *arg) {
+	struct count_chunk *chunk = arg;
+	count_local(chunk->data, chunk->size, &chunk->count);
+	return NULL;
+}
+
+static void count_local(char data[], uint64_t size, struct local_count *local) {
+	if ( classes.id == PCC_CLASSES_PRINTABLE ) {
+		local->printable_chars += kernel(data, size, local->hist);
+	} else { // projected onto the class set once the file was counted
+		pcc_count_bytes(data, size, local->hist);
+	}
+}
+
+static uint64_t local_histogram(struct local_count *local, uint64_t hist[]) {
+	if ( classes.id == PCC_CLASSES_PRINTABLE ) {
+		memcpy(hist, local->hist, PCC_CHARS_RANGE * sizeof(uint64_t));
+		return local->printable_chars;
+	}
+	memset(hist, 0, classes.buckets * sizeof(uint64_t));
+	return pcc_project(&classes, local->hist, hist);
+}
+
+static void read_class_table(const char *path) {
+	int fd = -1;
+	if ( -1 == (fd = open(path, O_RDONLY)) ) {
+		print_err("Error: `-x` names no built-in class set (printable|bytes|lines|utf8), nor a table file", true);
+	}
+	for (ssize_t nread = 0, total = 0; total < PCC_CLASS_TABLE_SIZE; total += nread) {
+		if ( 0 >= (nread = read(fd, class_table + total, PCC_CLASS_TABLE_SIZE - total)) ) {
+			errno = (nread == 0) ? EINVAL : errno;
+			print_err("Error: The table file passed to `-x` must hold 256 bytes", true);
+		}
+	}
+	close(fd);
+	pcc_class_set_custom(&classes, class_table);
+}
+
+static const char *count_label(void) {
+	static const char *labels[] = { "printable characters", "bytes", "line feeds", "UTF-8 codepoints", "classified bytes" };
+	return labels[classes.id];
+}
+
+static void check_reply(const char *file_path, uint64_t count, uint64_t hist[], struct local_count *local) {
+	uint64_t local_hist[PCC_MAX_BUCKETS];
+	uint64_t local_count = local_histogram(local, local_hist);
+	bool match = (count == local_count);
+	if ( NULL != hist ) {
+		match = match && (0 == memcmp(hist, local_hist, classes.buckets * sizeof(uint64_t)));
+	}
+	
+	if ( !match ) {
+		fprintf(stderr, "Error: %s: the server counted %lu %s, but %lu were counted locally%s\n", file_path,
+		        count, count_label(), local_count, (NULL != hist && count == local_count) ? " (the histograms differ)" : "");
+		mismatches++;
+	}
+}
+
+static void count_files(char *file_paths[], int nfiles) {
+	struct local_count local;
+	uint64_t hist[PCC_MAX_BUCKETS]; // the histogram of the file, in the class set
+	uint64_t total_bytes = 0; // the amount of bytes counted
+	uint64_t total_count = 0; // the count of all of the files, in the class set
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	for (int i = 0; i < nfiles; i++) {
+		int file_fd = -1;
+		struct stat sb;
+		if ( -1 == (file_fd = open(file_paths[i], O_RDONLY)) || -1 == fstat(file_fd, &sb) ) {
+			print_err("Error: Couldn't open a file given as a parameter", true);
+		}
+		
+		send_file_contents(-1, file_fd, sb.st_size, S_ISREG(sb.st_mode), &local);
+		close(file_fd);
+		
+		uint64_t count = local_histogram(&local, hist);
+		total_bytes += sb.st_size;
+		total_count += count;
+		printf("%s: # of %s: %lu\n", file_paths[i], count_label(), count);
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Total # of %s: %lu (%d files)\n", count_label(), total_count, nfiles);
+	printf("Local throughput: %.3f GB/s (%lu bytes in %.6f sec, %d threads)\n", (elapsed > 0) ? total_bytes / elapsed / 1e9 : 0, total_bytes, elapsed, count_threads);
+}
+
+static char **collect_files(char *paths[], int npaths, bool recursive, int *nfiles) {
+	char **files = NULL;
+	int capacity = 0;
+	*nfiles = 0;
+	
+	for (int i = 0; i < npaths; i++) {
+		if ( 0 != strcmp(paths[i], "-") ) {
+			collect_path(paths[i], recursive, &files, nfiles, &capacity);
+			continue;
+		}
+		
+		// the paths are read from the standard input, one per line
+		char *line = NULL;
+		size_t line_capacity = 0;
+		ssize_t len = 0;
+		while ( -1 != (len = getline(&line, &line_capacity, stdin)) ) {
+			if ( len > 0 && line[len - 1] == '\n' ) {
+				line[--len] = '\0';
+			}
+			if ( len == 0 ) continue;
+			
+			char *path = NULL;
+			if ( NULL == (path = strdup(line)) ) {
+				print_err("Error: Couldn't allocate a path", true);
+			}
+			collect_path(path, recursive, &files, nfiles, &capacity);
+		}
+		free(line);
+	}
+	
+	return files;
+}
+
+static void collect_path(char *path, bool recursive, char ***files, int *nfiles, int *capacity) {
+	struct stat sb;
+	if ( -1 == stat(path, &sb) ) {
+		print_err("Error: Couldn't `stat` a path given as a parameter", true);
+	}
+	
+	// a directory stands for the regular files under it
+	DIR *dir = S_ISDIR(sb.st_mode) ? opendir(path) : NULL;
+	if ( S_ISDIR(sb.st_mode) && NULL == dir ) {
+		print_err("Error: Couldn't open a directory given as a parameter", true);
+	}
+	
+	struct dirent *entry = NULL;
+	while ( NULL == dir || NULL != (entry = readdir(dir)) ) {
+		char *file_path = path;
+		
+		if ( dir ) { // an entry of the directory, skip anything but regular files (and subdirectories, if recursive)
+			if ( 0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, "..") ) continue;
+			if ( -1 == asprintf(&file_path, "%s/%s", path, entry->d_name) ) {
+				print_err("Error: Couldn't allocate a path", true);
+			}
+			
+			// symbolic links to directories aren't followed, so a loop of them can't recurse forever
+			struct stat entry_sb;
+			if ( recursive && 0 == lstat(file_path, &entry_sb) && S_ISDIR(entry_sb.st_mode) ) {
+				collect_path(file_path, recursive, files, nfiles, capacity);
+				free(file_path);
+				continue;
+			}
+			if ( -1 == stat(file_path, &entry_sb) || !S_ISREG(entry_sb.st_mode) ) {
+				free(file_path);
+				continue;
+			}
+		}
+		
+		if ( *nfiles == *capacity ) {
+			*capacity = *capacity ? 2 * *capacity : 16;
+			if ( NULL == (*files = realloc(*files, *capacity * sizeof(char*))) ) {
+				print_err("Error: Couldn't allocate the list of files", true);
+			}
+		}
+		(*files)[(*nfiles)++] = file_path;
+		
+		if ( NULL == dir ) break; // a file stands for itself only
+	}
+	
+	if ( dir ) closedir(dir);
+}
+
+static uint64_t upload_session(int sockfd, char *file_paths[], int nfiles) {
+	uint64_t total_bytes = 0; // the amount of bytes uploaded
+	uint64_t total_count = 0; // the amount of printable characters (or the count in the class set) in all of the files
+	int nsent = 0; // the amount of frames sent
+	int nreplied = 0; // the amount of frames replied to
+	int nframes = nfiles; // the amount of frames to send: a frame per file, then a frame per file the server missed
+	bool ended = false; // whether the session was ended
+	uint64_t hist[PCC_MAX_BUCKETS]; // the histogram of the file replied to
+	uint64_t hist_total[PCC_MAX_BUCKETS] = {0}; // the histogram of all of the files
+	struct local_count *locals = NULL; // the local counts of the frames in flight (or of every file, once looked up), when verifying
+	int nlocals = dedup ? nfiles : SESSION_WINDOW;
+	if ( verify && NULL == (locals = calloc(nlocals, sizeof(struct local_count))) ) {
+		print_err("Error: Couldn't allocate the local counts", true);
+	}
+	struct dedup_file *files = NULL; // the hashes of the files looked up
+	int *frame_files = NULL; // the file of each frame, once there are more frames than files
+	if ( dedup && (NULL == (files = calloc(nfiles, sizeof(struct dedup_file))) || NULL == (frame_files = calloc(2 * nfiles, sizeof(int)))) ) {
+		print_err("Error: Couldn't allocate the hashes of the files", true);
+	}
+	for (int i = 0; dedup && i < nfiles; i++) {
+		frame_files[i] = i;
+	}
+	
+	// open the session
+	uint64_t magic_n = pcc_session_magic_n(PCC_PROTOCOL_VERSION);
+	send_data(sockfd, &magic_n, sizeof(uint64_t));
+	
+	while ( nreplied < nframes ) {
+		
+		// send frames as long as the window allows, then wait for the oldest reply
+		if ( nsent < nframes && nsent - nreplied < SESSION_WINDOW ) {
+			int file = dedup ? frame_files[nsent] : nsent;
+			int file_fd = -1;
+			if ( -1 == (file_fd = open(file_paths[file], O_RDONLY)) ) {
+				print_err("Error: Couldn't open a file given as a parameter", true);
+			}
+			struct local_count *local = verify ? &locals[file % nlocals] : NULL;
+			if ( !dedup ) {
+				total_bytes += send_frame(sockfd, file_fd, local);
+			} else if ( nsent < nfiles ) { // the lookup, or the file itself if it can't be hashed
+				total_bytes += send_lookup(sockfd, file_fd, &files[file], local);
+			} else { // the file the server missed
+				send_hashed_frame(sockfd, file_fd, files[file].hash);
+			}
+			close(file_fd);
+			nsent++;
+		}
+		
+		// once the last frame was sent, end the session (the replies still arrive), unless a lookup may still miss
+		if ( !ended && nsent == nframes && !(dedup && nreplied < nfiles) ) {
+			shutdown(sockfd, SHUT_WR);
+			ended = true;
+		}
+		if ( nsent < nframes && nsent - nreplied < SESSION_WINDOW ) {
+			continue;
+		}
+		
+		// read the amount of printable characters that the server recognized in the oldest file
+		int file = dedup ? frame_files[nreplied] : nreplied;
+		uint64_t printable_chars_h = recv_reply(sockfd);
+		if ( dedup && nreplied < nfiles && files[file].looked_up ) {
+			if ( printable_chars_h == PCC_REPLY_MISS ) { // the file is to be sent after all
+				frame_files[nframes++] = file;
+				nreplied++;
+				continue;
+			}
+			dedup_hits++;
+			dedup_saved += files[file].size;
+		}
+		total_count += printable_chars_h;
+		
+		printf("%s: # of %s: %lu\n", file_paths[file], count_label(), printable_chars_h);
+		if (request_histogram) {
+			recv_histogram(sockfd, hist, hist_total);
+			print_histogram(file_paths[file], hist);
+		}
+		if (verify) {
+			check_reply(file_paths[file], printable_chars_h, request_histogram ? hist : NULL, &locals[file % nlocals]);
+		}
+		nreplied++;
+	}
+	
+	printf("Total # of %s: %lu (%d files)\n", count_label(), total_count, nfiles);
+	if (request_histogram) {
+		print_histogram("Total", hist_total);
+	}
+	if (dedup) {
+		printf("Dedup: %lu of %d files known to the server (%lu bytes not sent)\n", dedup_hits, nfiles, dedup_saved);
+	}
+	free(frame_files);
+	free(files);
+	free(locals);
+	return total_bytes;
+}
+
+static uint64_t upload_parallel(struct sockaddr_in *serv_addr, int file_fd, const char *file_path) {
+	struct part_stream streams[parallel_streams];
+	struct local_count local; // the local count of the file, when verifying
+	uint64_t hist[PCC_MAX_BUCKETS]; // the histogram of the file
+	uint64_t hist_total[PCC_MAX_BUCKETS] = {0};
+	struct timespec now;
+	
+	struct stat sb;
+	if ( -1 == fstat(file_fd, &sb) ) {
+		print_err("Error: Couldn't `stat` the supplied file", true);
+	}
+	if ( verify ) {
+		send_file_contents(-1, file_fd, sb.st_size, true, &local);
+	}
+	signal(SIGPIPE, SIG_IGN); // a part whose connection broke is retried, rather than killing the client (sendfile has no MSG_NOSIGNAL)
+	
+	// the transfer is told apart from those of other clients by a random ID
+	clock_gettime(CLOCK_REALTIME, &now);
+	struct pcc_part_header transfer = { .transfer_id = ((uint64_t)getpid() << 32) ^ (uint64_t)now.tv_sec * 1000000000ULL ^ now.tv_nsec,
+	                                    .offset = 0, .total_size = sb.st_size };
+	
+	// splitting the file into page-aligned ranges, each uploaded by its own thread
+	uint64_t range_size = (transfer.total_size + parallel_streams - 1) / parallel_streams;
+	range_size = (range_size + 4095) & ~(uint64_t)4095;
+	int nstreams = 0;
+	for (uint64_t offset = 0; offset < transfer.total_size; offset += range_size, nstreams++) {
+		memset(&streams[nstreams], 0, sizeof(struct part_stream));
+		streams[nstreams].file_fd = file_fd;
+		streams[nstreams].serv_addr = serv_addr;
+		streams[nstreams].part = transfer;
+		streams[nstreams].part.offset = offset;
+		streams[nstreams].size = (transfer.total_size - offset < range_size) ? transfer.total_size - offset : range_size;
+		if ( 0 != (errno = pthread_create(&streams[nstreams].thread, NULL, part_stream_main, &streams[nstreams])) ) {
+			print_err("Error: Couldn't create an upload thread", true);
+		}
+	}
+	
+	// every part must be acknowledged before the transfer is committed
+	bool acked = true;
+	for (int i = 0; i < nstreams; i++) {
+		pthread_join(streams[i].thread, NULL);
+		acked = acked && streams[i].acked;
+	}
+	if ( !acked ) {
+		errno = EIO;
+		print_err("Error: A part of the file couldn't be uploaded", true);
+	}
+	
+	// committing the transfer over a new connection, which replies with the counts of the whole file
+	int sockfd = -1;
+	char headers[PCC_FRAME_HEADER_SIZE + PCC_PART_HEADER_SIZE];
+	struct pcc_frame_header frame = { .flags = PCC_FRAME_COMMIT | (request_histogram ? PCC_FRAME_HISTOGRAM : 0), .size = 0 };
+	uint64_t magic_n = pcc_session_magic_n(PCC_PROTOCOL_VERSION);
+	pcc_encode_frame_header(headers, &frame);
+	pcc_encode_part_header(headers + PCC_FRAME_HEADER_SIZE, &transfer);
+	if ( -1 == (sockfd = connect_server(serv_addr)) ) {
+		exit(1);
+	}
+	send_data(sockfd, &magic_n, sizeof(uint64_t));
+	send_data(sockfd, headers, sizeof(headers));
+	shutdown(sockfd, SHUT_WR);
+	
+	uint64_t printable_chars_h = recv_reply(sockfd);
+	printf("# of printable characters: %lu\n", printable_chars_h);
+	if (request_histogram) {
+		recv_histogram(sockfd, hist, hist_total);
+		print_histogram(file_path, hist);
+	}
+	if (verify) {
+		check_reply(file_path, printable_chars_h, request_histogram ? hist : NULL, &local);
+	}
+	close(sockfd);
+	
+	return transfer.total_size;
+}
+
+static int upload_batch(struct sockaddr_in *serv_addr, char *file_paths[], int nfiles) {
+	struct batch b = { .epfd = -1, .serv_addr = serv_addr, .file_paths = file_paths, .nfiles = nfiles };
+	struct epoll_event events[BATCH_MAX_EVENTS];
+	struct batch_conn *conns = NULL;
+	int nconns = (batch_connections < nfiles) ? batch_connections : nfiles;
+	
+	signal(SIGPIPE, SIG_IGN); // a connection that broke fails its upload, rather than killing the client (sendfile has no MSG_NOSIGNAL)
+	if ( -1 == (b.epfd = epoll_create1(0)) ) {
+		print_err("Error: Couldn't create an epoll instance", true);
+	}
+	if ( nconns > 0 && NULL == (conns = calloc(nconns, sizeof(struct batch_conn))) ) {
+		print_err("Error: Couldn't allocate the connections", true);
+	}
+	
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	// hand each connection its first file, then drive the connections as their sockets become ready
+	for (int i = 0; i < nconns; i++) {
+		conns[i].sockfd = -1;
+		conns[i].file_fd = -1;
+		batch_next(&b, &conns[i]);
+		batch_drive(&b, &conns[i]);
+	}
+	while ( b.nreplied + b.nfailed < nfiles ) {
+		int nevents = epoll_wait(b.epfd, events, BATCH_MAX_EVENTS, -1);
+		if ( nevents < 0 ) {
+			if ( errno == EINTR ) continue;
+			print_err("Error: Couldn't wait for the connections", true);
+		}
+		for (int i = 0; i < nevents; i++) {
+			batch_drive(&b, events[i].data.ptr);
+		}
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Total # of %s: %lu (%d files)\n", count_label(), b.total_count, b.nreplied);
+	if (request_histogram) {
+		print_histogram("Total", b.hist_total);
+	}
+	if (dedup) {
+		printf("Dedup: %lu of %d files known to the server (%lu bytes not sent)\n", dedup_hits, nfiles, dedup_saved);
+	}
+	if ( b.nfailed > 0 ) {
+		fprintf(stderr, "Error: %d of the %d files weren't uploaded\n", b.nfailed, nfiles);
+	}
+	printf("Batch throughput: %.3f MB/s, %.1f files/s (%lu bytes of %d files in %.6f sec, %d connections)\n",
+	       (elapsed > 0) ? b.total_bytes / elapsed / 1e6 : 0, (elapsed > 0) ? b.nreplied / elapsed : 0, b.total_bytes, b.nreplied, elapsed, nconns);
+	
+	free(conns);
+	close(b.epfd);
+	return b.nfailed;
+}
+
+static void batch_next(struct batch *b, struct batch_conn *conn) {
+	conn->file_index = -1;
+	
+	while ( b->next < b->nfiles ) {
+		int index = b->next++;
+		const char *file_path = b->file_paths[index];
+		struct stat sb;
+		
+		if ( -1 == (conn->file_fd = open(file_path, O_RDONLY)) || -1 == fstat(conn->file_fd, &sb) ) {
+			fprintf(stderr, "Error: %s: couldn't open the file: %s\n", file_path, strerror(errno));
+			goto failed;
+		}
+		if ( !S_ISREG(sb.st_mode) ) { // sent with sendfile only
+			fprintf(stderr, "Error: %s: not a regular file\n", file_path);
+			goto failed;
+		}
+		
+		// the file is read once, front to back (and counted from its mapping first, when verifying, or hashed from it to look it up)
+		posix_fadvise(conn->file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		if (dedup) {
+			conn->hash = hash_file(conn->file_fd, sb.st_size, verify ? &conn->local : NULL);
+		} else if (verify) {
+			send_file_contents(-1, conn->file_fd, sb.st_size, true, &conn->local);
+		}
+		
+		// a connection is opened for the file, unless the session of the connection carries on
+		if ( conn->sockfd == -1 ) {
+			if ( -1 == (conn->sockfd = connect_server(b->serv_addr)) ) {
+				fprintf(stderr, "Error: %s: couldn't connect to upload the file\n", file_path);
+				goto failed;
+			}
+			
+			// the tail of a file isn't held back until the previous one was acked, which a session waits on
+			// for every file otherwise, since the next file is only sent once the reply to the previous arrived
+			int nodelay = 1;
+			setsockopt(conn->sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+			struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = conn };
+			if ( -1 == fcntl(conn->sockfd, F_SETFL, O_NONBLOCK) || -1 == epoll_ctl(b->epfd, EPOLL_CTL_ADD, conn->sockfd, &event) ) {
+				print_err("Error: Couldn't watch a connection", true);
+			}
+			conn->session = false;
+		}
+		
+		// the session magic opens the session of the connection, then each file is a frame of it
+		conn->out_size = 0;
+		if (force_session) {
+			if ( !conn->session ) {
+				uint64_t magic_n = pcc_session_magic_n(PCC_PROTOCOL_VERSION);
+				memcpy(conn->out, &magic_n, sizeof(uint64_t));
+				conn->out_size = sizeof(uint64_t);
+				conn->session = true;
+			}
+			conn->out_size += encode_frame_headers(conn->out + conn->out_size, sb.st_size, dedup ? PCC_FRAME_HASH | PCC_FRAME_LOOKUP : 0, conn->hash);
+		} else {
+			uint64_t size_n = htobe64(sb.st_size);
+			memcpy(conn->out, &size_n, sizeof(uint64_t));
+			conn->out_size = sizeof(uint64_t);
+		}
+		
+		conn->file_index = index;
+		conn->file_size = sb.st_size;
+		conn->file_offset = 0;
+		conn->lookup = dedup;
+		conn->out_sent = 0;
+		conn->in_size = 0;
+		conn->state = BATCH_SEND_HEADERS;
+		return;
+	
+	failed:
+		if ( conn->file_fd != -1 ) {
+			close(conn->file_fd);
+			conn->file_fd = -1;
+		}
+		b->nfailed++;
+	}
+}
+
+static enum batch_result batch_advance(struct batch_conn *conn) {
+	ssize_t n = 0;
+	
+	// the headers of the upload
+	while ( conn->state == BATCH_SEND_HEADERS && conn->out_sent < conn->out_size ) {
+		int more = (conn->file_size > 0 && !conn->lookup) ? MSG_MORE : 0; // the headers go out along with the first bytes of the file
+		if ( 0 > (n = send(conn->sockfd, conn->out + conn->out_sent, conn->out_size - conn->out_sent, MSG_NOSIGNAL | more)) ) {
+			if ( errno == EINTR ) continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? BATCH_BLOCKED : BATCH_FAILED;
+		}
+		conn->out_sent += n;
+	}
+	if ( conn->state == BATCH_SEND_HEADERS ) { // a lookup waits for its reply, the file only follows if the server missed it
+		conn->state = conn->lookup ? BATCH_RECV_REPLY : BATCH_SEND_BODY;
+	}
+	
+	// the contents of the file, straight from the page cache
+	while ( conn->state == BATCH_SEND_BODY && (uint64_t)conn->file_offset < conn->file_size ) {
+		if ( 0 >= (n = sendfile(conn->sockfd, conn->file_fd, &conn->file_offset, conn->file_size - conn->file_offset)) ) {
+			if ( n < 0 && errno == EINTR ) continue;
+			if ( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) return BATCH_BLOCKED;
+			if ( n == 0 ) { // the file is shorter than it was when we sent its size
+				errno = EIO;
+			}
+			return BATCH_FAILED;
+		}
+	}
+	if ( conn->state == BATCH_SEND_BODY ) {
+		// the file won't be read again, so its pages leave the page cache rather than evicting hotter ones
+		posix_fadvise(conn->file_fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(conn->file_fd);
+		conn->file_fd = -1;
+		conn->state = BATCH_RECV_REPLY;
+	}
+	
+	// the reply, as much of it as its received part tells
+	uint64_t reply_size = 0;
+	while ( conn->in_size < (reply_size = batch_reply_size(conn)) ) {
+		if ( reply_size > sizeof(conn->in) ) {
+			errno = EPROTO;
+			return BATCH_FAILED;
+		}
+		if ( 0 >= (n = recv(conn->sockfd, conn->in + conn->in_size, reply_size - conn->in_size, 0)) ) {
+			if ( n < 0 && errno == EINTR ) continue;
+			if ( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) return BATCH_BLOCKED;
+			if ( n == 0 ) { // the server closed the connection before replying
+				errno = ECONNRESET;
+			}
+			return BATCH_FAILED;
+		}
+		conn->in_size += n;
+	}
+	
+	uint64_t printable_chars_n;
+	memcpy(&printable_chars_n, conn->in, sizeof(uint64_t));
+	if ( conn->lookup && printable_chars_n == htobe64(PCC_REPLY_MISS) ) {
+		return BATCH_MISSED;
+	}
+	return (printable_chars_n == htobe64(PCC_REPLY_SHED)) ? BATCH_REFUSED : BATCH_DONE;
+}
+
+static uint64_t batch_reply_size(struct batch_conn *conn) {
+	uint64_t printable_chars_n;
+	uint16_t size_n;
+	
+	if ( !request_histogram || conn->in_size < PCC_REPLY_SIZE ) {
+		return PCC_REPLY_SIZE;
+	}
+	memcpy(&printable_chars_n, conn->in, sizeof(uint64_t));
+	if ( printable_chars_n == htobe64(PCC_REPLY_SHED) || (conn->lookup && printable_chars_n == htobe64(PCC_REPLY_MISS)) ) {
+		return PCC_REPLY_SIZE;
+	}
+	if ( conn->in_size < PCC_REPLY_SIZE + sizeof(uint16_t) ) {
+		return PCC_REPLY_SIZE + sizeof(uint16_t);
+	}
+	memcpy(&size_n, conn->in + PCC_REPLY_SIZE, sizeof(uint16_t));
+	return PCC_REPLY_SIZE + sizeof(uint16_t) + be16toh(size_n);
+}
+
+static void batch_drive(struct batch *b, struct batch_conn *conn) {
+	uint64_t hist[PCC_MAX_BUCKETS]; // the histogram of the file replied to
+	
+	while ( conn->file_index != -1 ) {
+		enum batch_result result = batch_advance(conn);
+		if ( result == BATCH_BLOCKED ) return;
+		
+		// a file the server missed is sent over the same session, flagged with its hash this time
+		if ( result == BATCH_MISSED ) {
+			conn->out_size = encode_frame_headers(conn->out, conn->file_size, PCC_FRAME_HASH, conn->hash);
+			conn->out_sent = 0;
+			conn->in_size = 0;
+			conn->lookup = false;
+			conn->state = BATCH_SEND_HEADERS;
+			continue;
+		}
+		
+		const char *file_path = b->file_paths[conn->file_index];
+		if ( result == BATCH_DONE && conn->lookup ) { // known to the server, so never read
+			dedup_hits++;
+			dedup_saved += conn->file_size;
+			close(conn->file_fd);
+			conn->file_fd = -1;
+		}
+		if ( result == BATCH_DONE ) {
+			uint64_t printable_chars_n;
+			memcpy(&printable_chars_n, conn->in, sizeof(uint64_t));
+			uint64_t printable_chars_h = be64toh(printable_chars_n);
+			b->total_count += printable_chars_h;
+			b->total_bytes += conn->file_size;
+			b->nreplied++;
+			
+			printf("%s: # of %s: %lu\n", file_path, count_label(), printable_chars_h);
+			if (request_histogram) {
+				uint64_t header_size = PCC_REPLY_SIZE + sizeof(uint16_t);
+				if ( 0 != pcc_decode_histogram(conn->in + header_size, conn->in_size - header_size, hist, classes.buckets) ) {
+					errno = EPROTO;
+					print_err("Error: The server sent a malformed histogram", true);
+				}
+				for (unsigned int i = 0; i < classes.buckets; i++) {
+					b->hist_total[i] += hist[i];
+				}
+				print_histogram(file_path, hist);
+			}
+			if (verify) {
+				check_reply(file_path, printable_chars_h, request_histogram ? hist : NULL, &conn->local);
+			}
+		} else {
+			fprintf(stderr, "Error: %s: %s\n", file_path, (result == BATCH_REFUSED) ? "the server refused the upload (too large, or overloaded)" : strerror(errno));
+			b->nfailed++;
+		}
+		
+		// only a session that's still sound carries the next file, anything else takes a new connection
+		if ( !force_session || result != BATCH_DONE ) {
+			batch_close(conn);
+		}
+		batch_next(b, conn);
+	}
+	
+	// no file is left for the connection
+	batch_close(conn);
+}
+
+static void batch_close(struct batch_conn *conn) {
+	if ( conn->file_fd != -1 ) {
+		close(conn->file_fd);
+		conn->file_fd = -1;
+	}
+	if ( conn->sockfd != -1 ) {
+		close(conn->sockfd); // which removes it from the epoll instance too
+		conn->sockfd = -1;
+	}
+	conn->session = false;
+}
+
+static void *part_stream_main(void *arg) {
+	struct part_stream *stream = arg;
+	
+	for (int attempt = 0; attempt < PART_ATTEMPTS && !stream->acked; attempt++) {
+		int sockfd = -1;
+		if ( -1 != (sockfd = connect_server(stream->serv_addr)) ) {
+			stream->acked = send_part(sockfd, stream);
+			close(sockfd);
+		}
+	}
+	
+	return NULL;
+}
+
+static bool send_part(int sockfd, struct part_stream *stream) {
+	char headers[PCC_FRAME_HEADER_SIZE + PCC_PART_HEADER_SIZE];
+	struct pcc_frame_header frame = { .flags = PCC_FRAME_PART, .size = stream->size };
+	uint64_t magic_n = pcc_session_magic_n(PCC_PROTOCOL_VERSION);
+	off_t offset = stream->part.offset;
+	ssize_t nsent = 0;
+	
+	// the session, then the headers of its only frame
+	pcc_encode_frame_header(headers, &frame);
+	pcc_encode_part_header(headers + PCC_FRAME_HEADER_SIZE, &stream->part);
+	if ( !try_send_data(sockfd, &magic_n, sizeof(uint64_t)) || !try_send_data(sockfd, headers, sizeof(headers)) ) {
+		goto error;
+	}
+	
+	// the range of the file, straight from the page cache
+	for (uint64_t notsent = stream->size; notsent > 0; notsent -= nsent) {
+		if ( 0 >= (nsent = sendfile(sockfd, stream->file_fd, &offset, notsent)) ) {
+			if ( nsent < 0 && errno == EINTR ) {
+				nsent = 0;
+				continue;
+			}
+			errno = (nsent == 0) ? EIO : errno; // the file was truncated while sending it
+			goto error;
+		}
+	}
+	shutdown(sockfd, SHUT_WR);
+	
+	// the reply acknowledges the part
+	uint64_t printable_chars_n;
+	if ( !try_recv_data(sockfd, &printable_chars_n, PCC_REPLY_SIZE) ) {
+		goto error;
+	} else if ( printable_chars_n == htobe64(PCC_REPLY_SHED) ) { // the server refused it, for now
+		errno = EBUSY;
+		goto error;
+	}
+	stream->printable_chars = be64toh(printable_chars_n);
+	return true;
+	
+error:
+	print_err("Error: Couldn't upload a part of the file, retrying", false);
+	return false;
+}
+
+static void recv_histogram(int sockfd, uint64_t hist[], uint64_t hist_total[]) {
+	char buff[PCC_HISTOGRAM_MAX_SIZE];
+	uint16_t size_n;
+	
+	// the size of the encoded histogram, then the histogram itself
+	recv_data(sockfd, &size_n, sizeof(uint16_t));
+	uint16_t size_h = be16toh(size_n);
+	if ( size_h > PCC_HISTOGRAM_MAX_SIZE ) {
+		errno = EPROTO;
+		print_err("Error: The server sent a histogram too large", true);
+	}
+	recv_data(sockfd, buff, size_h);
+	
+	if ( 0 != pcc_decode_histogram(buff, size_h, hist, classes.buckets) ) {
+		errno = EPROTO;
+		print_err("Error: The server sent a malformed histogram", true);
+	}
+	for (unsigned int i = 0; i < classes.buckets; i++) {
+		hist_total[i] += hist[i];
+	}
+}
+
+static void print_histogram(const char *prefix, uint64_t hist[]) {
+	for (unsigned int i = 0; i < classes.buckets; i++) {
+		if ( hist[i] == 0 ) continue;
+		
+		// each bucket as what it stands for in the class set
+		if ( classes.id == PCC_CLASSES_PRINTABLE ) {
+			printf("%s: char '%c' : %lu times\n", prefix, i + 32, hist[i]);
+		} else if ( classes.id == PCC_CLASSES_BYTES ) {
+			printf("%s: byte 0x%02x : %lu times\n", prefix, i, hist[i]);
+		} else if ( classes.id == PCC_CLASSES_LINES ) {
+			printf("%s: lines : %lu\n", prefix, hist[i]);
+		} else if ( classes.id == PCC_CLASSES_UTF8 ) {
+			printf("%s: %u-byte codepoints : %lu\n", prefix, i + 1, hist[i]);
+		} else {
+			printf("%s: class %u : %lu times\n", prefix, i, hist[i]);
+		}
+	}
+}
+
+static bool sendfile_data(int sockfd, int file_fd, uint64_t size) {
+	ssize_t nsent = 0; // how much we've sent in last sendfile() call
+	uint64_t notsent = size; // how much we have left to send
+	
+	while ( notsent > 0 ) {
+	
+		if ( 0 >= (nsent = sendfile(sockfd, file_fd, NULL, notsent)) ) {
+			if ( (nsent < 0) && errno == EINTR ) {
+				continue;
+			} else if ( (nsent < 0) && notsent == size && (errno == EINVAL || errno == ENOSYS) ) { // not supported for this file
+				return false;
+			} else if ( nsent == 0 ) { // the file is shorter than it was when we sent its size
+				errno = EIO;
+				print_err("Error: The file was truncated while sending it", true);
+			} else {
+				print_err("Error: Couldn't send the file through socket", true);
+			}
+		}
+		
+		notsent -= nsent;
+	}
+	
+	return true;
+}
+
+static bool splice_data(int sockfd, int file_fd, uint64_t size) {
+	int pipefd[2]; // the pipe that the pages of the file move through on their way to the socket
+	ssize_t nspliced = 0; // how much we've moved in last splice() call
+	uint64_t notsent = size; // how much we have left to send
+	
+	if ( -1 == pipe(pipefd) ) {
+		print_err("Error: Couldn't create a pipe", true);
+	}
+	
+	while ( notsent > 0 ) {
+	
+		// moving the next part of the file into the pipe
+		if ( 0 >= (nspliced = splice(file_fd, NULL, pipefd[1], NULL, notsent, SPLICE_F_MOVE | SPLICE_F_MORE)) ) {
+			if ( (nspliced < 0) && errno == EINTR ) {
+				continue;
+			} else if ( (nspliced < 0) && notsent == size && (errno == EINVAL || errno == ENOSYS) ) { // not supported for this file
+				close(pipefd[0]);
+				close(pipefd[1]);
+				return false;
+			} else if ( nspliced == 0 ) { // the file is shorter than it was when we sent its size
+				errno = EIO;
+				print_err("Error: The file was truncated while sending it", true);
+			} else {
+				print_err("Error: Couldn't read from file", true);
+			}
+		}
+		notsent -= nspliced;
+		
+		// draining the pipe into the socket
+		while ( nspliced > 0 ) {
+			ssize_t nsent = splice(pipefd[0], NULL, sockfd, NULL, nspliced, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if ( nsent < 0 && errno == EINTR ) {
+				continue;
+			} else if ( nsent <= 0 ) {
+				print_err("Error: Couldn't send the file through socket", true);
+			}
+			nspliced -= nsent;
+		}
+	}
+	
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return true;
+}
+
+static void copy_data(int sockfd, int file_fd, uint64_t size, struct local_count *local) {
+	char data_buff[DATA_BUFF_SIZE]; // 1MB buffer
+	ssize_t bytes_read_from_file = 0; // the amount of bytes we've currently read from the file
+	uint64_t file_notread = size; // the amount of bytes in the file that we still need to send 
 	
 	while ( file_notread > 0 ) {
 		
-		bytes_read_from_file = read(file_fd, data_buff, 1000000); // read the next 1MB
-		if ( bytes_read_from_file < 0 ) { // if the read failed
+		bytes_read_from_file = read(file_fd, data_buff, (file_notread >= DATA_BUFF_SIZE) ? DATA_BUFF_SIZE : file_notread); // read the next 1MB
+		if ( bytes_read_from_file < 0 && errno == EINTR ) {
+			continue;
+		} else if ( bytes_read_from_file < 0 ) { // if the read failed
 			print_err("Error: Couldn't read from file", true);
+		} else if ( bytes_read_from_file == 0 ) { // the file is shorter than it was when we sent its size
+			errno = EIO;
+			print_err("Error: The file was truncated while sending it", true);
 		} else { // if the read succeeded, send the 1MB buffer and advance
-			send_data(sockfd, data_buff, bytes_read_from_file);		
+			if ( NULL != local ) {
+				count_local(data_buff, bytes_read_from_file, local);
+			}
+			if ( sockfd >= 0 ) {
+				send_data(sockfd, data_buff, bytes_read_from_file);
+			}
 			file_notread -= bytes_read_from_file;
 		}
 	}
+}
+
+static void deflate_data(int sockfd, int file_fd, uint64_t size, struct local_count *local) {
+	char data_buff[DATA_BUFF_SIZE]; // 1MB buffer
+	char block[PCC_BLOCK_HEADER_SIZE + DEFLATE_BLOCK_SIZE]; // the length of the next block, then its compressed bytes
+	ssize_t bytes_read_from_file = 0; // the amount of bytes we've currently read from the file
+	uint64_t file_notread = size; // the amount of bytes in the file that we still need to compress
+	int ret = Z_OK;
 	
-	// return the file size
-	return number_bytes_send_h;
+	// the compressor favors speed, since it runs on the way to the socket
+	if ( NULL == deflater ) {
+		if ( NULL == (deflater = calloc(1, sizeof(z_stream))) || Z_OK != deflateInit2(deflater, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) ) {
+			print_err("Error: Couldn't allocate a compressor", true);
+		}
+	} else {
+		deflateReset(deflater);
+	}
+	
+	do {
+		// reading the next 1MB once the previous one was compressed
+		if ( deflater->avail_in == 0 && file_notread > 0 ) {
+			bytes_read_from_file = read(file_fd, data_buff, (file_notread >= DATA_BUFF_SIZE) ? DATA_BUFF_SIZE : file_notread);
+			if ( bytes_read_from_file < 0 && errno == EINTR ) {
+				continue;
+			} else if ( bytes_read_from_file < 0 ) { // if the read failed
+				print_err("Error: Couldn't read from file", true);
+			} else if ( bytes_read_from_file == 0 ) { // the file is shorter than it was when we sent its size
+				errno = EIO;
+				print_err("Error: The file was truncated while sending it", true);
+			}
+			if ( NULL != local ) {
+				count_local(data_buff, bytes_read_from_file, local);
+			}
+			deflater->next_in = (Bytef*)data_buff;
+			deflater->avail_in = bytes_read_from_file;
+			file_notread -= bytes_read_from_file;
+		}
+		
+		// compressing into the next block, and sending it unless it's empty
+		deflater->next_out = (Bytef*)(block + PCC_BLOCK_HEADER_SIZE);
+		deflater->avail_out = DEFLATE_BLOCK_SIZE;
+		ret = deflate(deflater, (file_notread == 0) ? Z_FINISH : Z_NO_FLUSH);
+		uint32_t block_size = DEFLATE_BLOCK_SIZE - deflater->avail_out;
+		if ( block_size > 0 ) {
+			uint32_t block_size_n = htobe32(block_size);
+			memcpy(block, &block_size_n, PCC_BLOCK_HEADER_SIZE);
+			send_data(sockfd, block, PCC_BLOCK_HEADER_SIZE + block_size);
+		}
+	} while ( ret != Z_STREAM_END );
+	
+	// the empty block ends the body
+	uint32_t end_n = 0;
+	send_data(sockfd, &end_n, PCC_BLOCK_HEADER_SIZE);
 }
 /************************************************************/
 
@@ -150,55 +1529,191 @@ int main(int argc, char *argv[]) {
 	int file_fd = -1; // our file fd
 	struct sockaddr_in serv_addr; // where we Want to get to
 	
-	// validating the arguments amount
-	if (argc != 4) {
+	// parse options
+	int opt;
+	while ( -1 != (opt = getopt(argc, argv, "u:rsHvdj:P:zx:c:D")) ) {
+		switch (opt) {
+			case 'u': // the way the file is uploaded
+				if (0 == strcmp(optarg, "auto")) {
+					upload_method = UPLOAD_AUTO;
+				} else if (0 == strcmp(optarg, "sendfile")) {
+					upload_method = UPLOAD_SENDFILE;
+				} else if (0 == strcmp(optarg, "splice")) {
+					upload_method = UPLOAD_SPLICE;
+				} else if (0 == strcmp(optarg, "copy")) {
+					upload_method = UPLOAD_COPY;
+				} else {
+					errno = EINVAL;
+					print_err("Error: Unknown method passed to `-u` (expected auto|sendfile|splice|copy)", true);
+				}
+				break;
+			case 'r': // report the throughput achieved
+				report_throughput = true;
+				break;
+			case 's': // open a session even for a single file
+				force_session = true;
+				break;
+			case 'H': // ask for the histogram of each file, which takes a session
+				request_histogram = true;
+				force_session = true;
+				break;
+			case 'v': // count each file locally, and check the reply against it
+				verify = true;
+				break;
+			case 'd': // only count the files locally
+				dry_run = true;
+				break;
+			case 'j': // the amount of threads counting a mapped file
+				if ( 0 >= (count_threads = atoi(optarg)) ) {
+					errno = EINVAL;
+					print_err("Error: The amount of threads passed to `-j` must be positive", true);
+				}
+				break;
+			case 'P': // the amount of connections a single file is uploaded over at once
+				if ( 0 >= (parallel_streams = atoi(optarg)) ) {
+					errno = EINVAL;
+					print_err("Error: The amount of connections passed to `-P` must be positive", true);
+				}
+				break;
+			case 'z': // compress the frames, which takes a session
+				compress_frames = true;
+				force_session = true;
+				break;
+			case 'x': // count the files in another class set, named or read from a table file, which takes a session
+				if ( -1 == pcc_class_set_by_name(&classes, optarg) ) {
+					read_class_table(optarg);
+				}
+				force_session = true;
+				break;
+			case 'c': // upload the files as a batch, keeping this amount of them in flight at once
+				if ( 0 >= (batch_connections = atoi(optarg)) ) {
+					errno = EINVAL;
+					print_err("Error: The amount of connections passed to `-c` must be positive", true);
+				}
+				break;
+			case 'D': // look each file up by its content hash first, which takes a session
+				dedup = true;
+				force_session = true;
+				break;
+			default:
+				errno = EINVAL;
+				print_err("Error: Usage: client [-u auto|sendfile|splice|copy] [-r] [-s] [-H] [-v] [-z] [-x class set] [-D] [-j threads] [-P connections] <ip> <port> <file|directory|->...\n"
+				          "       client -c connections [-s] [-H] [-v] [-x class set] [-D] [-j threads] <ip> <port> <file|directory|->...\n"
+				          "       client -d [-j threads] [-x class set] <file|directory|->...", true);
+		}
+	}
+	if ( classes.id != PCC_CLASSES_PRINTABLE && parallel_streams > 1 ) {
 		errno = EINVAL;
-		print_err("Error: Not enough arguments passed", true);
+		print_err("Error: A file uploaded over several connections (`-P`) is only counted in printable characters (`-x`)", true);
 	}
-
-	// parse arguments
-	char* ip_addr = argv[1];
-	uint16_t port = atoi(argv[2]); // transfer to 16 bit
-	char* file_path = argv[3]; // try opening the file and return an error accordingly 
-
-	// open dedicated file
-	if ( -1 == (file_fd = open(file_path, O_RDONLY)) ) {
-		print_err("Error: Couldn't open the file given as a parameter", true);
+	if ( dedup && (compress_frames || classes.id != PCC_CLASSES_PRINTABLE || parallel_streams > 1) ) {
+		errno = EINVAL;
+		print_err("Error: Files looked up by their hash (`-D`) are sent whole, and counted in printable characters (no `-z`, `-x` or `-P`)", true);
+	}
+	if ( batch_connections > 0 && (compress_frames || parallel_streams > 1 || (upload_method != UPLOAD_AUTO && upload_method != UPLOAD_SENDFILE)) ) {
+		errno = EINVAL;
+		print_err("Error: The batch mode (`-c`) sends each file whole with sendfile (no `-z`, `-P` or `-u splice|copy`)", true);
+	}
+	
+	// the local counts use the same kernel as the server, split between a thread per CPU by default
+	kernel = select_pcc_kernel("auto");
+	if ( count_threads == 0 && 0 >= (count_threads = sysconf(_SC_NPROCESSORS_ONLN)) ) {
+		count_threads = 1;
+	}
+	
+	// a dry run only counts the files, without any server
+	if ( dry_run ) {
+		if ( argc - optind < 1 ) {
+			errno = EINVAL;
+			print_err("Error: Not enough arguments passed", true);
+		}
+		int nfiles = 0;
+		char **file_paths = collect_files(argv + optind, argc - optind, false, &nfiles);
+		count_files(file_paths, nfiles);
+		exit(0);
 	}
 
-	// create tcp connection to server on port
-	if( 0 > (sockfd = socket(AF_INET, SOCK_STREAM, 0)) ) {
-		print_err("Error: Couldn't create a socket", true);
+	// validating the arguments amount
+	if (argc - optind < 3) {
+		errno = EINVAL;
+		print_err("Error: Not enough arguments passed", true);
 	}
 
+	// parse arguments
+	char* ip_addr = argv[optind];
+	uint16_t port = atoi(argv[optind + 1]); // transfer to 16 bit
+	char* file_path = argv[optind + 2]; // try opening the file and return an error accordingly 
+	
 	// configuring the address of our listening socket
 	memset(&serv_addr, 0, sizeof(serv_addr));
 	serv_addr.sin_family = AF_INET;
 	serv_addr.sin_port = htons(port); // htons for endiannes
 	serv_addr.sin_addr.s_addr = inet_addr(ip_addr); // hardcoded...
 	
-	// connect socket to the target address
-	if( connect(sockfd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) < 0)	{
-		print_err("Error: Couldn't connect to server", true);
+	// a batch walks the directories down to their last subdirectory, and uploads the files over connections of its own
+	if ( batch_connections > 0 ) {
+		int nfiles = 0;
+		char **file_paths = collect_files(argv + optind + 2, argc - optind - 2, true, &nfiles);
+		int nfailed = upload_batch(&serv_addr, file_paths, nfiles);
+		exit(mismatches > 0 || nfailed > 0);
+	}
+	
+	// several files, or a directory, are uploaded over a single session, and a single regular file may be split between several connections
+	struct stat sb;
+	bool found = (0 == stat(file_path, &sb));
+	bool is_dir = found && S_ISDIR(sb.st_mode);
+	bool parallel = (parallel_streams > 1) && (argc - optind == 3) && found && S_ISREG(sb.st_mode);
+	bool session = !parallel && (force_session || (argc - optind > 3) || is_dir || 0 == strcmp(file_path, "-"));
+	int nfiles = 0;
+	char **file_paths = session ? collect_files(argv + optind + 2, argc - optind - 2, false, &nfiles) : NULL;
+
+	// open dedicated file
+	if ( !session && -1 == (file_fd = open(file_path, O_RDONLY)) ) {
+		print_err("Error: Couldn't open the file given as a parameter", true);
+	}
+
+	// create tcp connection to server on port (a parallel upload opens its own connections)
+	if( !parallel && -1 == (sockfd = connect_server(&serv_addr)) ) {
+		exit(1);
 	}
 	
 	// send the bytes from the file
-	if ( send_file(sockfd, file_fd) > 0 ) { // if the file size is larger than zero the server should respond
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint64_t file_size = 0;
+	struct local_count local; // the local count of the file, when verifying
+	if ( parallel ) { // send ranges of the file over several connections at once, then commit them
+		file_size = upload_parallel(&serv_addr, file_fd, file_path);
+		
+	} else if ( session ) { // send the bytes from all of the files, each in its own frame
+		file_size = upload_session(sockfd, file_paths, nfiles);
+	
+	} else if ( (file_size = send_file(sockfd, file_fd, verify ? &local : NULL)) > 0 ) { // if the file size is larger than zero the server should respond
 
 		// read the amount of printable characters that the server recognized in the file
-		uint64_t printable_chars_n;
-		recv_data(sockfd, &printable_chars_n, sizeof(uint64_t));
-		uint64_t printable_chars_h = be64toh(printable_chars_n); // big endian to host
+		uint64_t printable_chars_h = recv_reply(sockfd);
 	
 		// print the amount of printable characters in the supplied file
 		printf("# of printable characters: %lu\n", printable_chars_h);
+		if (verify) {
+			check_reply(file_path, printable_chars_h, NULL, &local);
+		}
 		
 	} else { // if the file size is zero, nothing was sent, hence 0 printable characters
 		// print the amount of printable characters in the supplied file
 		printf("# of printable characters: %lu\n", (uint64_t)0);
 	}
+	
+	// report the throughput achieved, from sending the size until the reply arrived
+	if (report_throughput) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("Throughput: %.0f bytes/sec (%lu bytes in %.6f sec)\n", (elapsed > 0) ? file_size / elapsed : 0, file_size, elapsed);
+	}
 		
-	// close socket and exit
-	close(sockfd);
-	exit(0);
+	// close socket and exit, failing if any reply didn't match its local count
+	if ( sockfd >= 0 ) {
+		close(sockfd);
+	}
+	exit(mismatches > 0);
 }
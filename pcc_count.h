@@ -0,0 +1,389 @@
+/* Submitter: Adam
+ * Operating Systems 2022A
+ * Tel Aviv University
+ ==============================================
+ * The counting kernels shared by the server, the client and the benchmark
+ *
+ * A kernel counts the printable characters (32 to 126) of a buffer: it returns their
+ * amount, and increments the index (character - 32) of each of them in a histogram of
+ * `PCC_CHARS_RANGE` counts. Every kernel returns bit-identical counts to the scalar one.
+ *
+ * Other class sets than the printable characters (see `PCC_CLASS_SETS`) are counted by
+ * a byte histogram, projected onto their buckets once the whole buffer was counted.
+ *
+ * The counts of many threads are merged into shards (see `struct pcc_shard`), one per
+ * thread, and only summed when they're read.
+ */
+
+#ifndef PCC_COUNT_H
+#define PCC_COUNT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#define PCC_CHARS_RANGE 95
+#define PCC_IS_PRINTABLE(x) ((x <= 126) && (x >= 32))
+#define PCC_TABLES 4 // interleaved histograms used by the vectorized kernels, so repeated characters don't serialize on one counter
+#define PCC_KERNEL_MIN_SIZE 64 // buffers shorter than this are counted by the scalar kernel
+#define PCC_CACHE_LINE_SIZE 64 // the shards of different threads never share a cache line of this size
+
+/* a counting kernel: counts the <size> bytes of <file_data_buff> into <pcc_current> */
+typedef uint64_t (*pcc_kernel)(char file_data_buff[], uint64_t size, uint64_t pcc_current[]);
+
+/* The reference kernel: a byte-at-a-time loop */
+static inline uint64_t update_pcc_current_scalar(char file_data_buff[], uint64_t size, uint64_t pcc_current[]) {
+	uint64_t printable_chars = 0; // the amount of printable characters in <file_data_buff>
+
+	// inserting the statistics of the printable characters in the given buffer into <pcc_current>
+	for (uint64_t i = 0; i < size; i++) {
+		if (PCC_IS_PRINTABLE(file_data_buff[i])) { // if a printable character was found
+			printable_chars++;
+			pcc_current[(int)file_data_buff[i] - 32]++;
+		}
+	}
+
+	// returning the amount of printable characters in the given buffer
+	return printable_chars;
+}
+
+#ifdef HAVE_X86_KERNELS
+/* Kernels classifying 16 (SSE4.2) or 32 (AVX2) bytes at once: a range mask over the block
+ * gives the printable count through popcount, and only the printable positions of the mask
+ * are counted, spread over `PCC_TABLES` interleaved histograms merged at the end */
+
+/* Counts the printable characters of the <block_size>-byte block <block> whose positions are set
+ * in <mask>, spreading consecutive positions over the interleaved histograms <tables> */
+static inline void count_printable_mask(uint64_t tables[][PCC_CHARS_RANGE], const char *block, uint32_t mask, unsigned int block_size) {
+	if ( mask == (uint32_t)((1ULL << block_size) - 1) ) { // an all-printable block needs no bit scanning (unrolled over the 4 tables)
+		for (unsigned int i = 0; i < block_size; i += PCC_TABLES) {
+			tables[0][block[i] - 32]++;
+			tables[1][block[i + 1] - 32]++;
+			tables[2][block[i + 2] - 32]++;
+			tables[3][block[i + 3] - 32]++;
+		}
+		return;
+	}
+
+	while ( mask ) {
+		int i = __builtin_ctz(mask);
+		tables[i & (PCC_TABLES - 1)][block[i] - 32]++;
+		mask &= mask - 1; // clear the lowest set position
+	}
+}
+
+/* Merges the interleaved histograms <tables> into <pcc_current> */
+static inline void merge_pcc_tables(uint64_t tables[][PCC_CHARS_RANGE], uint64_t pcc_current[]) {
+	for (unsigned int t = 0; t < PCC_TABLES; t++) {
+		for (unsigned int i = 0; i < PCC_CHARS_RANGE; i++) {
+			pcc_current[i] += tables[t][i];
+		}
+	}
+}
+
+__attribute__((target("sse4.2,popcnt")))
+static inline uint64_t update_pcc_current_sse42(char file_data_buff[], uint64_t size, uint64_t pcc_current[]) {
+	if ( size < PCC_KERNEL_MIN_SIZE ) {
+		return update_pcc_current_scalar(file_data_buff, size, pcc_current);
+	}
+
+	uint64_t tables[PCC_TABLES][PCC_CHARS_RANGE] = {{0}};
+	uint64_t printable_chars = 0;
+	const __m128i below = _mm_set1_epi8(31); // bytes are compared as signed, so anything >= 128 is below it too
+	const __m128i above = _mm_set1_epi8(127);
+	uint64_t i = 0;
+
+	for (; i + 16 <= size; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(file_data_buff + i));
+		__m128i printable = _mm_and_si128(_mm_cmpgt_epi8(block, below), _mm_cmplt_epi8(block, above));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(printable);
+
+		printable_chars += __builtin_popcount(mask);
+		count_printable_mask(tables, file_data_buff + i, mask, 16);
+	}
+
+	// the tail which doesn't fill a whole block
+	merge_pcc_tables(tables, pcc_current);
+	return printable_chars + update_pcc_current_scalar(file_data_buff + i, size - i, pcc_current);
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline uint64_t update_pcc_current_avx2(char file_data_buff[], uint64_t size, uint64_t pcc_current[]) {
+	if ( size < PCC_KERNEL_MIN_SIZE ) {
+		return update_pcc_current_scalar(file_data_buff, size, pcc_current);
+	}
+
+	uint64_t tables[PCC_TABLES][PCC_CHARS_RANGE] = {{0}};
+	uint64_t printable_chars = 0;
+	const __m256i below = _mm256_set1_epi8(31); // bytes are compared as signed, so anything >= 128 is below it too
+	const __m256i above = _mm256_set1_epi8(127);
+	uint64_t i = 0;
+
+	for (; i + 32 <= size; i += 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i*)(file_data_buff + i));
+		__m256i printable = _mm256_and_si256(_mm256_cmpgt_epi8(block, below), _mm256_cmpgt_epi8(above, block));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(printable);
+
+		printable_chars += __builtin_popcount(mask);
+		count_printable_mask(tables, file_data_buff + i, mask, 32);
+	}
+
+	// the tail which doesn't fill a whole block
+	merge_pcc_tables(tables, pcc_current);
+	return printable_chars + update_pcc_current_scalar(file_data_buff + i, size - i, pcc_current);
+}
+#endif
+
+/* The engine behind every other class set: a class set maps each byte value to one of its buckets
+ * (or to none), and a body counted in it only has its bytes counted by `pcc_count_bytes`, a single
+ * branch-free kernel whatever the class set. Once the body is complete, its byte histogram is projected
+ * onto the buckets of the class set by `pcc_project`: the built-in class sets below are each projected
+ * by a function generated from their classifier, and custom class sets through their table */
+
+#define PCC_BYTE_VALUES 256
+#define PCC_MAX_BUCKETS 256 // the most buckets of a class set (the bytes class set)
+#define PCC_UNCOUNTED 0xffff // the bucket of a byte value that a class set doesn't count
+#define PCC_BYTES_TABLES_MIN_SIZE 4096 // buffers shorter than this are counted into a single byte histogram
+
+/* The classifiers of the built-in class sets: the bucket of the byte value <b>, or PCC_UNCOUNTED */
+#define PCC_CLASSIFY_PRINTABLE(b) ((PCC_IS_PRINTABLE(b)) ? (b) - 32 : PCC_UNCOUNTED)
+#define PCC_CLASSIFY_BYTES(b) (b)
+#define PCC_CLASSIFY_LINES(b) (((b) == '\n') ? 0 : PCC_UNCOUNTED)
+#define PCC_CLASSIFY_UTF8(b) (((b) < 0x80) ? 0 : ((b) < 0xc2) ? PCC_UNCOUNTED : ((b) < 0xe0) ? 1 : ((b) < 0xf0) ? 2 : ((b) < 0xf5) ? 3 : PCC_UNCOUNTED)
+
+/* The built-in class sets, as X(ID, name, buckets), in the order of their IDs (which go over the wire):
+ * - printable: the printable characters, 32 to 126 (the server's statistics)
+ * - bytes: every byte value
+ * - lines: the line feeds, i.e. the lines of a text
+ * - utf8: the UTF-8 codepoints, by the length of their encoding (the lead bytes of 1 to 4 bytes,
+ *   continuation bytes and bytes that never appear in UTF-8 aren't counted) */
+#define PCC_CLASS_SETS(X) \
+	X(PRINTABLE, printable, PCC_CHARS_RANGE) \
+	X(BYTES, bytes, PCC_BYTE_VALUES) \
+	X(LINES, lines, 1) \
+	X(UTF8, utf8, 4)
+
+enum pcc_class_set_id {
+#define PCC_CLASS_SET_ID(ID, name, buckets) PCC_CLASSES_##ID,
+	PCC_CLASS_SETS(PCC_CLASS_SET_ID)
+#undef PCC_CLASS_SET_ID
+	PCC_BUILTIN_CLASS_SETS, // the amount of built-in class sets
+	PCC_CLASSES_CUSTOM = PCC_BUILTIN_CLASS_SETS // a class set of its own table
+};
+
+/* a class set, built-in or custom */
+struct pcc_class_set {
+	enum pcc_class_set_id id;
+	unsigned int buckets;
+	uint16_t table[PCC_BYTE_VALUES]; // the bucket of each byte value, or PCC_UNCOUNTED (custom class sets only)
+};
+
+/* Counts every byte of the <size> bytes of <buff> into the byte histogram <bytes> (PCC_BYTE_VALUES counts).
+ * Long buffers are spread over PCC_TABLES interleaved histograms, so runs of a byte don't serialize on one counter */
+static inline void pcc_count_bytes(const char buff[], uint64_t size, uint64_t bytes[]) {
+	const uint8_t *data = (const uint8_t*)buff;
+	uint64_t i = 0;
+	
+	if ( size >= PCC_BYTES_TABLES_MIN_SIZE ) {
+		uint32_t tables[PCC_TABLES][PCC_BYTE_VALUES] = {{0}}; // flushed before they could overflow
+		while ( i + PCC_TABLES <= size ) {
+			uint64_t end = (size - i > UINT32_MAX) ? i + UINT32_MAX - (UINT32_MAX % PCC_TABLES) : size - (size - i) % PCC_TABLES;
+			for (; i < end; i += PCC_TABLES) {
+				tables[0][data[i]]++;
+				tables[1][data[i + 1]]++;
+				tables[2][data[i + 2]]++;
+				tables[3][data[i + 3]]++;
+			}
+			for (unsigned int t = 0; t < PCC_TABLES; t++) {
+				for (unsigned int b = 0; b < PCC_BYTE_VALUES; b++) {
+					bytes[b] += tables[t][b];
+					tables[t][b] = 0;
+				}
+			}
+		}
+	}
+	
+	// the tail, or a short buffer
+	for (; i < size; i++) {
+		bytes[data[i]]++;
+	}
+}
+
+/* The projections of the built-in class sets, one per class set with its classifier inlined:
+ * pcc_project_<name>(bytes, hist) adds the byte histogram <bytes> to the buckets of <hist>,
+ * and returns the amount of bytes counted in any of them */
+#define PCC_DEFINE_PROJECTION(ID, name, buckets) \
+	static inline uint64_t pcc_project_##name(const uint64_t bytes[], uint64_t hist[]) { \
+		uint64_t counted = 0; \
+		for (unsigned int b = 0; b < PCC_BYTE_VALUES; b++) { \
+			unsigned int bucket = PCC_CLASSIFY_##ID(b); \
+			if ( bucket != PCC_UNCOUNTED ) { \
+				hist[bucket] += bytes[b]; \
+				counted += bytes[b]; \
+			} \
+		} \
+		return counted; \
+	}
+PCC_CLASS_SETS(PCC_DEFINE_PROJECTION)
+#undef PCC_DEFINE_PROJECTION
+
+/* Adds the byte histogram <bytes> to the buckets of <hist>, through the table of the class set <classes>.
+ * Return the amount of bytes counted in any bucket */
+static inline uint64_t pcc_project_table(const struct pcc_class_set *classes, const uint64_t bytes[], uint64_t hist[]) {
+	uint64_t counted = 0;
+	for (unsigned int b = 0; b < PCC_BYTE_VALUES; b++) {
+		if ( classes->table[b] != PCC_UNCOUNTED ) {
+			hist[classes->table[b]] += bytes[b];
+			counted += bytes[b];
+		}
+	}
+	return counted;
+}
+
+/* Adds the byte histogram <bytes> (see `pcc_count_bytes`) to <hist>, the <classes->buckets> counts of the class set
+ * <classes>. Return the amount of bytes counted in any bucket */
+static inline uint64_t pcc_project(const struct pcc_class_set *classes, const uint64_t bytes[], uint64_t hist[]) {
+	switch ( classes->id ) {
+#define PCC_PROJECTION_CASE(ID, name, buckets) case PCC_CLASSES_##ID: return pcc_project_##name(bytes, hist);
+		PCC_CLASS_SETS(PCC_PROJECTION_CASE)
+#undef PCC_PROJECTION_CASE
+		default: return pcc_project_table(classes, bytes, hist);
+	}
+}
+
+/* Readies <classes> as the built-in class set <id>. Return -1 if there's no such class set */
+static inline int pcc_class_set_builtin(struct pcc_class_set *classes, uint32_t id) {
+	static const unsigned int buckets[] = {
+#define PCC_CLASS_SET_BUCKETS(ID, name, buckets) buckets,
+		PCC_CLASS_SETS(PCC_CLASS_SET_BUCKETS)
+#undef PCC_CLASS_SET_BUCKETS
+	};
+	if ( id >= PCC_BUILTIN_CLASS_SETS ) return -1;
+	
+	classes->id = (enum pcc_class_set_id)id;
+	classes->buckets = buckets[id];
+	return 0;
+}
+
+/* Readies <classes> as a custom class set, whose table <table> holds the bucket of each of the PCC_BYTE_VALUES
+ * byte values (up to PCC_MAX_BUCKETS - 1), or 0xff for a byte value it doesn't count. It has as many buckets
+ * as its highest bucket + 1 */
+static inline void pcc_class_set_custom(struct pcc_class_set *classes, const uint8_t table[]) {
+	classes->id = PCC_CLASSES_CUSTOM;
+	classes->buckets = 0;
+	for (unsigned int b = 0; b < PCC_BYTE_VALUES; b++) {
+		classes->table[b] = (table[b] == 0xff) ? PCC_UNCOUNTED : table[b];
+		if ( table[b] != 0xff && table[b] + 1U > classes->buckets ) {
+			classes->buckets = table[b] + 1U;
+		}
+	}
+}
+
+/* Readies <classes> as the built-in class set named <name> (printable|bytes|lines|utf8).
+ * Return -1 if there's no such class set */
+static inline int pcc_class_set_by_name(struct pcc_class_set *classes, const char *name) {
+	static const char *names[] = {
+#define PCC_CLASS_SET_NAME(ID, name, buckets) #name,
+		PCC_CLASS_SETS(PCC_CLASS_SET_NAME)
+#undef PCC_CLASS_SET_NAME
+	};
+	for (unsigned int id = 0; id < PCC_BUILTIN_CLASS_SETS; id++) {
+		if ( 0 == strcmp(name, names[id]) ) {
+			return pcc_class_set_builtin(classes, id);
+		}
+	}
+	return -1;
+}
+
+/* The table-driven kernel: counts every byte of the buffer (see `pcc_count_bytes`), then projects
+ * them onto the printable characters. It has no branches on the bytes, however they're distributed */
+static inline uint64_t update_pcc_current_bytes(char file_data_buff[], uint64_t size, uint64_t pcc_current[]) {
+	uint64_t bytes[PCC_BYTE_VALUES] = {0};
+	pcc_count_bytes(file_data_buff, size, bytes);
+	return pcc_project_printable(bytes, pcc_current);
+}
+
+/* Returns the kernel named <name> (scalar|sse4.2|avx2|bytes), or the fastest kernel
+ * the CPU supports if <name> is "auto". Returns NULL if the kernel is unknown,
+ * or not supported by the CPU */
+static inline pcc_kernel select_pcc_kernel(const char *name) {
+	int is_auto = (0 == strcmp(name, "auto"));
+
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if ( (is_auto || 0 == strcmp(name, "avx2")) && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") ) {
+		return update_pcc_current_avx2;
+	}
+	if ( (is_auto || 0 == strcmp(name, "sse4.2")) && __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt") ) {
+		return update_pcc_current_sse42;
+	}
+#endif
+
+	if ( is_auto || 0 == strcmp(name, "scalar") ) {
+		return update_pcc_current_scalar;
+	}
+	if ( 0 == strcmp(name, "bytes") ) {
+		return update_pcc_current_bytes;
+	}
+
+	return NULL;
+}
+
+
+/* A thread's share of the counts merged by many threads at once. A single thread writes each
+ * shard, and readers sum the shards of all of them. Each shard starts a cache line of its own,
+ * so writers never pull a line away from each other, and its writer adds with plain relaxed loads
+ * and stores rather than read-modify-write instructions: merging costs the same however many
+ * threads merge at once. Readers copy a shard as long as <seq> shows that no update was in
+ * progress (a sequence lock: the writer never waits for readers) */
+struct pcc_shard {
+	_Alignas(PCC_CACHE_LINE_SIZE) atomic_uint seq; // odd while the writer updates the shard
+	atomic_uint_least64_t pcc[PCC_CHARS_RANGE];    // the histogram of the printable characters counted
+	atomic_uint_least64_t files;                   // how many files (or frames of a session) were counted
+	atomic_uint_least64_t bytes;                   // how many bytes those files hold
+};
+
+/* Adds <n> to the counter <counter> of a shard. Only the writer of the shard may call it */
+static inline void pcc_shard_count(atomic_uint_least64_t *counter, uint64_t n) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/* Adds the histogram <pcc> of <files> files holding <bytes> bytes to <shard>. Only the writer of the shard may call it */
+static inline void pcc_shard_add(struct pcc_shard *shard, const uint64_t pcc[], uint64_t files, uint64_t bytes) {
+	unsigned int seq = atomic_load_explicit(&shard->seq, memory_order_relaxed);
+
+	// readers retry while the sequence is odd, or if it changed while they copied
+	atomic_store_explicit(&shard->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	for (unsigned int i = 0; i < PCC_CHARS_RANGE; i++) {
+		pcc_shard_count(&shard->pcc[i], pcc[i]);
+	}
+	pcc_shard_count(&shard->files, files);
+	pcc_shard_count(&shard->bytes, bytes);
+
+	atomic_store_explicit(&shard->seq, seq + 2, memory_order_release);
+}
+
+/* Copies <shard> into <pcc>, <files> and <bytes> while its writer keeps adding to it:
+ * every addition is either fully in the copy or not at all */
+static inline void pcc_shard_read(struct pcc_shard *shard, uint64_t pcc[], uint64_t *files, uint64_t *bytes) {
+	unsigned int seq_before, seq_after;
+	do {
+		seq_before = atomic_load_explicit(&shard->seq, memory_order_acquire);
+		for (unsigned int i = 0; i < PCC_CHARS_RANGE; i++) {
+			pcc[i] = atomic_load_explicit(&shard->pcc[i], memory_order_relaxed);
+		}
+		*files = atomic_load_explicit(&shard->files, memory_order_relaxed);
+		*bytes = atomic_load_explicit(&shard->bytes, memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+		seq_after = atomic_load_explicit(&shard->seq, memory_order_relaxed);
+	} while ( (seq_before & 1) || seq_before != seq_after );
+}
+
+
+#endif
@@ -0,0 +1,128 @@
+/* Submitter: Adam
+ * Operating Systems 2022A
+ * Tel Aviv University
+ ==============================================
+ * A libFuzzer harness for the state machine the event loops of the server drive each connection through
+ *
+ * Each input is what a client sent on one connection: its first byte caps the size of every read (0 for
+ * FUZZ_BUFF_SIZE), as a socket may cut them anywhere, and the rest is fed through `conn_want` and
+ * `conn_consume` the way `conn_advance` feeds what it receives. The client reads every reply once the queue
+ * of replies is full, and closes its side at the end of the input. The state machine must neither stall
+ * nor overrun its buffers (built with AddressSanitizer, see `compile fuzz`).
+ *
+ * The state machine reaches into the transfers, the dedup cache and the admission of the server, which
+ * are all private to its translation unit, so the harness is built over that translation unit as a whole,
+ * with the server's entry point renamed. Built with PCC_FUZZ_STANDALONE (without libFuzzer), it runs
+ * the harness over each file passed to it instead, such as a crash libFuzzer found.
+ */
+#define main pcc_server_main
+#include "pcc_server.c"
+#undef main
+
+#define FUZZ_BUFF_SIZE 65536 // the most bytes read at once, as the receive buffers of the event loops
+#define FUZZ_CACHE_CAPACITY 64 // the bodies the dedup cache remembers, so lookups may hit
+
+
+/*************** DECLARATIONS ******************/
+/* Sets up what the state machine needs of the server, once: the counting kernel, the transfers and the dedup cache */
+static void fuzz_start(void);
+
+/* Feeds the <size> bytes of <data> into the state machine of a new connection. Returns 0, as libFuzzer expects */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+/**************************************************/
+
+
+
+static struct worker fuzz_worker; // the worker whose share the bodies replied to are counted into
+
+static void fuzz_start(void) {
+	static bool started = false;
+	
+	if ( started ) {
+		return;
+	}
+	started = true;
+	
+	if ( NULL == (pcc_kernel_impl = select_pcc_kernel("auto")) ) {
+		print_err("Error: Couldn't select a counting kernel", true);
+	}
+	transfers_start();
+	cache_capacity = FUZZ_CACHE_CAPACITY;
+	cache_start();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static char buff[FUZZ_BUFF_SIZE];
+	
+	if ( size == 0 ) {
+		return 0;
+	}
+	fuzz_start();
+	uint64_t read_size = (data[0] > 0) ? data[0] : FUZZ_BUFF_SIZE;
+	data++;
+	size--;
+	
+	struct conn *conn = calloc(1, sizeof(struct conn));
+	if ( NULL == conn ) {
+		print_err("Error: Couldn't allocate a connection", true);
+	}
+	conn->fd = -1;
+	conn->state = CONN_READ_HEADER;
+	
+	// receiving as `conn_advance` does, and sending every queued reply once no other fits
+	bool valid = true;
+	while ( valid && size > 0 && conn_reading(conn) ) {
+		uint64_t want = conn_want(conn, read_size);
+		if ( want == 0 ) {
+			assert(conn->out_sent < conn->out_len); // otherwise the connection would never be read again
+			conn_sent(&fuzz_worker, conn, conn->out_len - conn->out_sent);
+			continue;
+		}
+		
+		want = (want < size) ? want : size;
+		memcpy(buff, data, want);
+		valid = conn_consume(conn, buff, want);
+		assert(conn->out_len <= CONN_OUT_SIZE);
+		data += want;
+		size -= want;
+	}
+	
+	// the client closes its side, then reads the rest of the replies
+	if ( valid && size == 0 && conn_reading(conn) ) {
+		conn_eof(conn);
+	}
+	if ( conn->out_sent < conn->out_len ) {
+		conn_sent(&fuzz_worker, conn, conn->out_len - conn->out_sent);
+	}
+	
+	release_upload(conn->admitted);
+	inflater_free(&conn->inflater);
+	free(conn);
+	return 0;
+}
+
+#ifdef PCC_FUZZ_STANDALONE
+int main(int argc, char *argv[]) {
+	for (int i = 1; i < argc; i++) {
+		FILE *file = fopen(argv[i], "rb");
+		if ( NULL == file ) {
+			print_err("Error: Couldn't open an input", true);
+		}
+		
+		// the whole input at once, as libFuzzer passes it
+		uint8_t *input = NULL;
+		size_t size = 0, capacity = 0, nread = 0;
+		do {
+			if ( size == capacity && NULL == (input = realloc(input, (capacity = 2 * capacity + FUZZ_BUFF_SIZE))) ) {
+				print_err("Error: Couldn't allocate an input", true);
+			}
+			size += (nread = fread(input + size, 1, capacity - size, file));
+		} while ( nread > 0 );
+		fclose(file);
+		
+		LLVMFuzzerTestOneInput(input, size);
+		free(input);
+	}
+	return 0;
+}
+#endif
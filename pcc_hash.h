@@ -0,0 +1,160 @@
+/* Submitter: Adam
+ * Operating Systems 2022A
+ * Tel Aviv University
+ ==============================================
+ * The content hash shared by the server and the client (see `PCC_FRAME_HASH`)
+ *
+ * The hash is XXH64 with a seed of 0, so it matches the reference implementation of xxHash bit
+ * for bit. It's computed a buffer at a time into a `struct pcc_hash`, so a body may be hashed
+ * as it's received, whatever the sizes of its reads. It isn't cryptographic: the server only
+ * trusts a hash it computed itself from a body, never the one a client claims for it.
+ */
+
+#ifndef PCC_HASH_H
+#define PCC_HASH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define PCC_HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define PCC_HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PCC_HASH_PRIME3 0x165667B19E3779F9ULL
+#define PCC_HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define PCC_HASH_PRIME5 0x27D4EB2F165667C5ULL
+#define PCC_HASH_STRIPE_SIZE 32 // the bytes consumed at once by the 4 lanes of the hash
+
+/* the state of a hash being computed */
+struct pcc_hash {
+	uint64_t total_size;                 // how many bytes were hashed so far
+	uint64_t lanes[4];                   // the accumulators of the stripes consumed so far
+	uint8_t stripe[PCC_HASH_STRIPE_SIZE]; // the bytes of the stripe not consumed yet
+	uint32_t stripe_size;                // how many of them there are
+};
+
+static inline uint64_t pcc_hash_rotl(uint64_t x, unsigned int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+/* Reads the 8 (or 4) bytes at <p> as a little-endian word, whatever their alignment */
+static inline uint64_t pcc_hash_read64(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+static inline uint64_t pcc_hash_read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static inline uint64_t pcc_hash_round(uint64_t acc, uint64_t input) {
+	acc += input * PCC_HASH_PRIME2;
+	return pcc_hash_rotl(acc, 31) * PCC_HASH_PRIME1;
+}
+
+static inline uint64_t pcc_hash_merge_round(uint64_t acc, uint64_t lane) {
+	acc ^= pcc_hash_round(0, lane);
+	return acc * PCC_HASH_PRIME1 + PCC_HASH_PRIME4;
+}
+
+/* Consumes the <nstripes> stripes at <p> into the lanes <lanes> */
+static inline void pcc_hash_stripes(uint64_t lanes[], const uint8_t *p, uint64_t nstripes) {
+	uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3]; // kept in registers through the loop
+
+	for (uint64_t i = 0; i < nstripes; i++, p += PCC_HASH_STRIPE_SIZE) {
+		v1 = pcc_hash_round(v1, pcc_hash_read64(p));
+		v2 = pcc_hash_round(v2, pcc_hash_read64(p + 8));
+		v3 = pcc_hash_round(v3, pcc_hash_read64(p + 16));
+		v4 = pcc_hash_round(v4, pcc_hash_read64(p + 24));
+	}
+
+	lanes[0] = v1, lanes[1] = v2, lanes[2] = v3, lanes[3] = v4;
+}
+
+/* Readies <hash> for a new hash */
+static inline void pcc_hash_init(struct pcc_hash *hash) {
+	memset(hash, 0, sizeof(struct pcc_hash));
+	hash->lanes[0] = PCC_HASH_PRIME1 + PCC_HASH_PRIME2;
+	hash->lanes[1] = PCC_HASH_PRIME2;
+	hash->lanes[2] = 0;
+	hash->lanes[3] = -PCC_HASH_PRIME1;
+}
+
+/* Hashes the <size> bytes of <buff> into <hash>, following the bytes hashed into it before */
+static inline void pcc_hash_update(struct pcc_hash *hash, const char buff[], uint64_t size) {
+	const uint8_t *p = (const uint8_t *)buff;
+	hash->total_size += size;
+
+	// completing the stripe left over by the previous bytes first
+	if ( hash->stripe_size > 0 ) {
+		uint64_t n = PCC_HASH_STRIPE_SIZE - hash->stripe_size;
+		n = (size < n) ? size : n;
+		memcpy(hash->stripe + hash->stripe_size, p, n);
+		hash->stripe_size += n;
+		p += n;
+		size -= n;
+		if ( hash->stripe_size < PCC_HASH_STRIPE_SIZE ) {
+			return;
+		}
+		pcc_hash_stripes(hash->lanes, hash->stripe, 1);
+		hash->stripe_size = 0;
+	}
+
+	// then the whole stripes straight from the buffer, keeping the rest for later
+	pcc_hash_stripes(hash->lanes, p, size / PCC_HASH_STRIPE_SIZE);
+	p += size - size % PCC_HASH_STRIPE_SIZE;
+	memcpy(hash->stripe, p, size % PCC_HASH_STRIPE_SIZE);
+	hash->stripe_size = size % PCC_HASH_STRIPE_SIZE;
+}
+
+/* Returns the hash of every byte hashed into <hash> so far, which may still take more of them */
+static inline uint64_t pcc_hash_digest(const struct pcc_hash *hash) {
+	const uint64_t *v = hash->lanes;
+	const uint8_t *p = hash->stripe;
+	const uint8_t *end = hash->stripe + hash->stripe_size;
+	uint64_t h = 0;
+
+	if ( hash->total_size >= PCC_HASH_STRIPE_SIZE ) {
+		h = pcc_hash_rotl(v[0], 1) + pcc_hash_rotl(v[1], 7) + pcc_hash_rotl(v[2], 12) + pcc_hash_rotl(v[3], 18);
+		for (unsigned int i = 0; i < 4; i++) {
+			h = pcc_hash_merge_round(h, v[i]);
+		}
+	} else { // no stripe was consumed
+		h = PCC_HASH_PRIME5;
+	}
+	h += hash->total_size;
+
+	// the last bytes, 8, 4 and 1 at a time
+	for (; p + 8 <= end; p += 8) {
+		h ^= pcc_hash_round(0, pcc_hash_read64(p));
+		h = pcc_hash_rotl(h, 27) * PCC_HASH_PRIME1 + PCC_HASH_PRIME4;
+	}
+	if ( p + 4 <= end ) {
+		h ^= pcc_hash_read32(p) * PCC_HASH_PRIME1;
+		h = pcc_hash_rotl(h, 23) * PCC_HASH_PRIME2 + PCC_HASH_PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * PCC_HASH_PRIME5;
+		h = pcc_hash_rotl(h, 11) * PCC_HASH_PRIME1;
+	}
+
+	// the final avalanche
+	h ^= h >> 33;
+	h *= PCC_HASH_PRIME2;
+	h ^= h >> 29;
+	h *= PCC_HASH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+/* Returns the hash of the <size> bytes of <buff> */
+static inline uint64_t pcc_hash_buffer(const char buff[], uint64_t size) {
+	struct pcc_hash hash;
+	pcc_hash_init(&hash);
+	pcc_hash_update(&hash, buff, size);
+	return pcc_hash_digest(&hash);
+}
+
+#endif
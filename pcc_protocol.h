@@ -0,0 +1,251 @@
+/* Submitter: Adam
+ * Operating Systems 2022A
+ * Tel Aviv University
+ ==============================================
+ * The wire protocol shared by the client and the server
+ *
+ * A single-shot upload: the client sends the size of the file (8 bytes, big-endian),
+ * then the file, and the server replies with the amount of printable characters
+ * in it (8 bytes, big-endian) and closes the connection.
+ *
+ * A session: instead of a size, the client sends `PCC_SESSION_MAGIC` with the version
+ * of the protocol in its last byte. A single-shot client never sends it, since it
+ * stands for a file of over 5 exabytes. Any amount of frames follow, each made of
+ * a `PCC_FRAME_HEADER_SIZE` header (4 bytes of flags, 4 reserved bytes and 8 bytes
+ * of size, all big-endian) and the body. The server replies to every frame in order,
+ * with the same reply as a single-shot upload, so the client may send frames ahead
+ * of their replies. The client ends the session by closing (or shutting down) its
+ * side of the connection right after a frame.
+ *
+ * A frame flagged with `PCC_FRAME_HISTOGRAM` is replied to with the histogram of its
+ * printable characters too: the 8-byte count is followed by the 2-byte (big-endian)
+ * length of the encoded histogram, and by the histogram itself. It's encoded as a
+ * `PCC_HISTOGRAM_BITMAP_SIZE` bitmap of the non-zero buckets (bit i of byte i / 8 stands
+ * for the character i + 32), followed by the count of each non-zero bucket in order,
+ * as an LEB128 varint.
+ *
+ * A file may be uploaded over several sessions at once, as a transfer: its ranges are
+ * sent as frames flagged with `PCC_FRAME_PART`, each followed (before the body) by a
+ * `PCC_PART_HEADER_SIZE` header holding the ID of the transfer (chosen by the client),
+ * the offset of the range and the size of the whole file (8 bytes each, big-endian).
+ * Each part is replied to with its own counts, and is only acknowledged: a part sent
+ * again (e.g. over a new connection, after one failed) is ignored by the server, but
+ * parts overlapping differently break the protocol. Once every part was replied to,
+ * a frame flagged with `PCC_FRAME_COMMIT` (with the same header, and an empty body)
+ * is replied to with the counts of the whole file, which the server counts as one.
+ *
+ * The body of a frame flagged with `PCC_FRAME_DEFLATE` is compressed: the header still
+ * holds the size of the uncompressed body, and the body is a single raw deflate stream
+ * (RFC 1951) split into blocks, each made of its 4-byte (big-endian) length and its
+ * bytes, and ended by a block of length 0. The stream must end right at the last block,
+ * and inflate to exactly the size in the header. The reply is the same as if the body
+ * was sent uncompressed.
+ *
+ * A frame may be counted in another class set than the printable characters (see `PCC_CLASS_SETS`
+ * in pcc_count.h). A frame flagged with `PCC_FRAME_CLASSES` is followed (before the body) by a
+ * `PCC_CLASSES_HEADER_SIZE` header holding the ID of a built-in class set (4 bytes, big-endian, then
+ * 4 reserved bytes), and one flagged with `PCC_FRAME_CLASS_TABLE` by a `PCC_CLASS_TABLE_SIZE` table
+ * of its own class set: the bucket of each byte value, or 0xff if it isn't counted. Its reply holds
+ * the amount of bytes counted in any bucket, and the histogram (if asked for) has a count per bucket.
+ * Neither may be combined with the other, nor with a part or a commit. The server's statistics
+ * count the printable characters of every frame all the same.
+ *
+ * A body the server may have counted already needn't be sent again. A frame flagged with `PCC_FRAME_HASH`
+ * is followed (before the body) by a `PCC_HASH_HEADER_SIZE` header holding the content hash of the body
+ * (see pcc_hash.h, 8 bytes, big-endian, then 8 reserved bytes). Flagged with `PCC_FRAME_LOOKUP` too, it has
+ * no body at all: its size is the size of the body it stands for, and the server either replies as if the
+ * body was sent, or sends `PCC_REPLY_MISS` alone if it doesn't know it. The client then sends the body as a
+ * frame flagged with `PCC_FRAME_HASH` only, which the server counts as usual and remembers, once the body
+ * turns out to have the hash of its header. Neither may be combined with any other flag than the histogram.
+ *
+ * A server may refuse an upload (or a frame) once it read its headers, for being too large
+ * or for the server being saturated: instead of the reply, it sends `PCC_REPLY_SHED` alone
+ * (a count no real upload reaches), counts nothing, and discards whatever
+ * the client still sends until it closes the connection. Nothing else is replied to.
+ */
+
+#ifndef PCC_PROTOCOL_H
+#define PCC_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define PCC_SESSION_MAGIC 0x50434353455353ULL // "PCCSESS", followed by a byte holding the version
+#define PCC_PROTOCOL_VERSION 1 // the latest version of the session protocol
+#define PCC_SIZE_HEADER_SIZE 8 // the size sent by a single-shot upload, or the session magic
+#define PCC_FRAME_HEADER_SIZE 16
+#define PCC_REPLY_SIZE 8
+#define PCC_REPLY_SHED UINT64_MAX // replied instead of the counts, to an upload the server refused
+#define PCC_REPLY_MISS (UINT64_MAX - 1) // replied instead of the counts, to a lookup of a body the server doesn't know
+#define PCC_HISTOGRAM_BUCKETS 95 // the printable characters, 32 to 126
+#define PCC_HISTOGRAM_MAX_BUCKETS 256 // the most buckets of a class set
+#define PCC_HISTOGRAM_BITMAP_SIZE(buckets) (((buckets) + 7) / 8)
+#define PCC_HISTOGRAM_MAX_SIZE (PCC_HISTOGRAM_BITMAP_SIZE(PCC_HISTOGRAM_MAX_BUCKETS) + PCC_HISTOGRAM_MAX_BUCKETS * 10) // a varint of 64 bits takes up to 10 bytes
+#define PCC_MAX_REPLY_SIZE (PCC_REPLY_SIZE + 2 + PCC_HISTOGRAM_MAX_SIZE)
+
+#define PCC_PART_HEADER_SIZE 24
+#define PCC_BLOCK_HEADER_SIZE 4 // the length of a block of a compressed body
+#define PCC_CLASSES_HEADER_SIZE 8
+#define PCC_CLASS_TABLE_SIZE 256
+#define PCC_HASH_HEADER_SIZE 16
+#define PCC_MAX_HEADERS_SIZE (PCC_FRAME_HEADER_SIZE + PCC_PART_HEADER_SIZE + PCC_CLASSES_HEADER_SIZE + PCC_CLASS_TABLE_SIZE + \
+                              PCC_HASH_HEADER_SIZE) // the headers of a frame, whatever its flags
+
+#define PCC_FRAME_HISTOGRAM (1U << 0) // reply with the histogram of the frame too
+#define PCC_FRAME_PART (1U << 1)      // the body is a range of a transfer
+#define PCC_FRAME_COMMIT (1U << 2)    // ends a transfer, replied to with the counts of the whole file
+#define PCC_FRAME_DEFLATE (1U << 3)   // the body is compressed, in blocks of a raw deflate stream
+#define PCC_FRAME_CLASSES (1U << 4)   // count the body in a built-in class set
+#define PCC_FRAME_CLASS_TABLE (1U << 5) // count the body in a class set of its own
+#define PCC_FRAME_HASH (1U << 6)      // the content hash of the body comes along
+#define PCC_FRAME_LOOKUP (1U << 7)    // only the hash comes, the body is sent only if the server doesn't know it
+#define PCC_FRAME_KNOWN_FLAGS (PCC_FRAME_HISTOGRAM | PCC_FRAME_PART | PCC_FRAME_COMMIT | PCC_FRAME_DEFLATE | PCC_FRAME_CLASSES | \
+                               PCC_FRAME_CLASS_TABLE | PCC_FRAME_HASH | PCC_FRAME_LOOKUP) // the flags of a frame understood by this version of the protocol
+
+/* the header of a frame in a session */
+struct pcc_frame_header {
+	uint32_t flags;
+	uint64_t size; // the size of the body
+};
+
+/* the header following the frame header of a part, or of a commit */
+struct pcc_part_header {
+	uint64_t transfer_id;
+	uint64_t offset;     // where the part starts in the file
+	uint64_t total_size; // the size of the whole file
+};
+
+/* Returns the session magic announcing the version <version> of the protocol, as sent over the wire */
+static inline uint64_t pcc_session_magic_n(uint8_t version) {
+	return htobe64((PCC_SESSION_MAGIC << 8) | version);
+}
+
+/* Returns the version of the protocol if the 8-byte header <header_n> (as received over
+ * the wire) is the session magic, or 0 if it's the size of a single-shot upload */
+static inline uint8_t pcc_session_version(uint64_t header_n) {
+	uint64_t header_h = be64toh(header_n);
+	return ((header_h >> 8) == PCC_SESSION_MAGIC) ? (uint8_t)(header_h & 0xff) : 0;
+}
+
+/* Encodes the frame header <hdr> into its PCC_FRAME_HEADER_SIZE bytes over the wire, <buff> */
+static inline void pcc_encode_frame_header(char buff[], const struct pcc_frame_header *hdr) {
+	uint32_t flags_n = htobe32(hdr->flags);
+	uint32_t reserved_n = 0;
+	uint64_t size_n = htobe64(hdr->size);
+	memcpy(buff, &flags_n, 4);
+	memcpy(buff + 4, &reserved_n, 4);
+	memcpy(buff + 8, &size_n, 8);
+}
+
+/* Decodes the PCC_FRAME_HEADER_SIZE bytes of <buff>, as received over the wire, into <hdr> */
+static inline void pcc_decode_frame_header(const char buff[], struct pcc_frame_header *hdr) {
+	uint32_t flags_n;
+	uint64_t size_n;
+	memcpy(&flags_n, buff, 4);
+	memcpy(&size_n, buff + 8, 8);
+	hdr->flags = be32toh(flags_n);
+	hdr->size = be64toh(size_n);
+}
+
+/* Returns whether the flags <flags> of a frame are known, and may be combined */
+static inline int pcc_frame_flags_valid(uint32_t flags) {
+	uint32_t classes = flags & (PCC_FRAME_CLASSES | PCC_FRAME_CLASS_TABLE);
+	if ( flags & ~PCC_FRAME_KNOWN_FLAGS ) return 0;
+	if ( flags & (PCC_FRAME_HASH | PCC_FRAME_LOOKUP) ) return (flags & ~(PCC_FRAME_HASH | PCC_FRAME_LOOKUP | PCC_FRAME_HISTOGRAM)) == 0 && (flags & PCC_FRAME_HASH);
+	return classes == 0 || (classes != (PCC_FRAME_CLASSES | PCC_FRAME_CLASS_TABLE) && !(flags & (PCC_FRAME_PART | PCC_FRAME_COMMIT)));
+}
+
+/* Returns the size of the headers of a frame flagged with <flags>, before its body: the frame header,
+ * then the part header, the class set header, the class table and the hash header, for the frames that have them */
+static inline uint64_t pcc_frame_headers_size(uint32_t flags) {
+	return PCC_FRAME_HEADER_SIZE + ((flags & (PCC_FRAME_PART | PCC_FRAME_COMMIT)) ? PCC_PART_HEADER_SIZE : 0) +
+	       ((flags & PCC_FRAME_CLASSES) ? PCC_CLASSES_HEADER_SIZE : 0) + ((flags & PCC_FRAME_CLASS_TABLE) ? PCC_CLASS_TABLE_SIZE : 0) +
+	       ((flags & PCC_FRAME_HASH) ? PCC_HASH_HEADER_SIZE : 0);
+}
+
+/* Encodes the part header <part> into its PCC_PART_HEADER_SIZE bytes over the wire, <buff> */
+static inline void pcc_encode_part_header(char buff[], const struct pcc_part_header *part) {
+	uint64_t fields_n[3] = { htobe64(part->transfer_id), htobe64(part->offset), htobe64(part->total_size) };
+	memcpy(buff, fields_n, PCC_PART_HEADER_SIZE);
+}
+
+/* Decodes the PCC_PART_HEADER_SIZE bytes of <buff>, as received over the wire, into <part> */
+static inline void pcc_decode_part_header(const char buff[], struct pcc_part_header *part) {
+	uint64_t fields_n[3];
+	memcpy(fields_n, buff, PCC_PART_HEADER_SIZE);
+	part->transfer_id = be64toh(fields_n[0]);
+	part->offset = be64toh(fields_n[1]);
+	part->total_size = be64toh(fields_n[2]);
+}
+
+/* Encodes the class set ID <id> into its PCC_CLASSES_HEADER_SIZE bytes over the wire, <buff> */
+static inline void pcc_encode_classes_header(char buff[], uint32_t id) {
+	uint32_t fields_n[2] = { htobe32(id), 0 };
+	memcpy(buff, fields_n, PCC_CLASSES_HEADER_SIZE);
+}
+
+/* Returns the class set ID of the PCC_CLASSES_HEADER_SIZE bytes of <buff>, as received over the wire */
+static inline uint32_t pcc_decode_classes_header(const char buff[]) {
+	uint32_t id_n;
+	memcpy(&id_n, buff, 4);
+	return be32toh(id_n);
+}
+
+/* Encodes the content hash <hash> into its PCC_HASH_HEADER_SIZE bytes over the wire, <buff> */
+static inline void pcc_encode_hash_header(char buff[], uint64_t hash) {
+	uint64_t fields_n[2] = { htobe64(hash), 0 };
+	memcpy(buff, fields_n, PCC_HASH_HEADER_SIZE);
+}
+
+/* Returns the content hash of the PCC_HASH_HEADER_SIZE bytes of <buff>, as received over the wire */
+static inline uint64_t pcc_decode_hash_header(const char buff[]) {
+	uint64_t hash_n;
+	memcpy(&hash_n, buff, 8);
+	return be64toh(hash_n);
+}
+
+/* Encodes the histogram <hist> (<buckets> counts, up to PCC_HISTOGRAM_MAX_BUCKETS) into <buff>, which
+ * must hold PCC_HISTOGRAM_MAX_SIZE bytes. Return the size of the encoded histogram */
+static inline uint16_t pcc_encode_histogram(char buff[], const uint64_t hist[], unsigned int buckets) {
+	uint16_t size = PCC_HISTOGRAM_BITMAP_SIZE(buckets);
+	memset(buff, 0, PCC_HISTOGRAM_BITMAP_SIZE(buckets));
+	
+	for (unsigned int i = 0; i < buckets; i++) {
+		if ( hist[i] == 0 ) continue; // zero buckets only take their bit
+		
+		buff[i / 8] |= (char)(1 << (i % 8));
+		uint64_t count = hist[i];
+		do {
+			buff[size++] = (char)((count & 0x7f) | ((count > 0x7f) ? 0x80 : 0));
+			count >>= 7;
+		} while ( count > 0 );
+	}
+	
+	return size;
+}
+
+/* Decodes the histogram encoded in the <size> bytes of <buff> into <hist> (<buckets> counts).
+ * Return 0 on success, or -1 if the encoding is malformed */
+static inline int pcc_decode_histogram(const char buff[], uint16_t size, uint64_t hist[], unsigned int buckets) {
+	uint16_t pos = PCC_HISTOGRAM_BITMAP_SIZE(buckets);
+	if ( size < PCC_HISTOGRAM_BITMAP_SIZE(buckets) ) return -1;
+	
+	for (unsigned int i = 0; i < buckets; i++) {
+		hist[i] = 0;
+		if ( !(buff[i / 8] & (1 << (i % 8))) ) continue;
+		
+		unsigned int shift = 0;
+		uint8_t byte = 0;
+		do {
+			if ( pos >= size || shift > 63 ) return -1;
+			byte = (uint8_t)buff[pos++];
+			hist[i] |= (uint64_t)(byte & 0x7f) << shift;
+			shift += 7;
+		} while ( byte & 0x80 );
+	}
+	
+	return (pos == size) ? 0 : -1;
+}
+
+#endif
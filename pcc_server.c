@@ -9,6 +9,7 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,20 +21,427 @@
 #include <assert.h>
 #include <signal.h>
 #include <endian.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#include "pcc_protocol.h"
+#include "pcc_count.h"
+#include "pcc_hash.h"
 
 #define bool int
 #define true 1
 #define false 0
-#define CLIENT_TERMINATED -1
-#define CHARS_RANGE 95
-#define IS_PRINTABLE(x) ((x <= 126) && (x >= 32))
+#define CLIENT_TERMINATED ((uint64_t)-1)
+#define CHARS_RANGE PCC_CHARS_RANGE
+#define MAX_EPOLL_EVENTS 64
+#define FILE_BUFF_SIZE 1000000 // the size of each worker's receive buffer (1MB)
+#define STREAM_BUFF_SIZE (64 * 1024) // the default buffer size of the streaming receive, small enough to stay in cache
+#define PIPELINE_SLOTS 4 // the amount of rotating buffers in the pipelined receive, splitting the receive buffer between them
+#define PIPELINE_SLOT_SIZE (FILE_BUFF_SIZE / PIPELINE_SLOTS)
+#define CONN_OUT_SIZE 8192 // the replies an event loop queues per connection before it stops reading from it
+#define URING_ENTRIES 256 // the size of the submission queue of each worker's io_uring
+#define URING_BUFFERS 64 // the amount of receive buffers registered with each worker's io_uring
+#define URING_BUFF_SIZE (128 * 1024) // the size of each registered receive buffer
+#define URING_ACCEPT_TAG 1 // the user_data of the (multishot) accept, connections use their state's address
+#define URING_WAKE_TAG 2 // the user_data of the read on the wake-up eventfd
+#define URING_TIMER_TAG 3 // the user_data of the read on the timerfd of the timer wheel
+#define URING_LISTEN_TAG 4 // the user_data of the poll on the listening socket, which precedes a single-shot accept
+#define LATENCY_SUB_BITS 2 // each power of 2 of the latency histograms is split into 2^LATENCY_SUB_BITS buckets (under 25% error)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) // enough buckets for any amount of nanoseconds
+#define INFLATE_CHUNK_SIZE (16 * 1024) // a compressed body is inflated this much at a time, straight into the kernel while it's in cache
+#define POOL_SLAB_SIZE (2 * 1024 * 1024) // pools grow a slab of this size (a huge page) at a time
+#define BUFF_CLASSES 3 // the size classes of the buffer pools (see `buff_class_sizes`)
+#define TRANSFER_IDLE_TIMEOUT 300 // the seconds a transfer may go without any part or commit before it's dropped
+#define TRANSFER_SWEEP_INTERVAL 10 // the seconds between two sweeps of the transfers idle for too long, by the main thread
+#define TRANSFER_SHARDS 16 // the shards of the transfer table, each with its own lock (a power of 2)
+#define TRANSFER_BUCKETS 256 // the chains of transfers of each shard, by their ID (a power of 2)
+#define TRANSFER_MAX_OPEN 4096 // the most transfers in progress at once, a part starting another one is refused
+#define TRANSFER_MAX_RANGES 4096 // the most parts a transfer is received in, a part past them is refused
+#define TRANSFER_COMMITTED 64 // the commits each shard remembers, so a part retried after its commit is only acknowledged
+#define TIMER_TICK_MS 100 // the resolution of the timer wheels of the event loops
+#define TIMER_SLOTS 1024 // the slots of a timer wheel, one per tick (so a full turn is over 100 seconds)
+#define SHED_LINGER 5 // the seconds a refused upload is still read (and discarded) for, so the client gets to read the refusal
+#define SHED_DISCARD_MS 200 // the milliseconds a worker of the blocking mode discards a refused upload for, at most, since it's tied up meanwhile
+#define SHED_DISCARD_SIZE (1024 * 1024) // and the bytes it discards at most
+#define CHECKPOINT_MAGIC 0x5043434b50543031ULL // "PCCKPT01", the start of a valid slot of the checkpoint file
+#define CHECKPOINT_VERSION 1 // the layout of `struct checkpoint`
+#define CHECKPOINT_SLOT_SIZE 4096 // the checkpoint file holds two slots, a page each
+#define JOURNAL_MAGIC 0x50434a524e4c3031ULL // "PCJRNL01", the start of the header of the journal
+#define JOURNAL_HEADER_SIZE 16 // the magic, then the epoch of the journal
+#define JOURNAL_RECORD_MAX_SIZE (8 + 16 + PCC_HISTOGRAM_MAX_SIZE) // the size and checksum, the counts, then the encoded histogram
+#define JOURNAL_ROTATE_SIZE (16 * 1024 * 1024) // the size past which a checkpoint starts the journal over
+#define HANDOFF_MAGIC 0x5043434844463031ULL // "PCCHDF01", the start of the hello of a server handing over its listening sockets
+#define HANDOFF_MAX_FDS 253 // the most file descriptors a single SCM_RIGHTS message carries (SCM_MAX_FD)
+#define CACHE_SHARDS 16 // the shards of the dedup cache, each with its own lock and LRU list (a power of 2)
+
+/* the way connections are driven by the server */
+enum io_mode {
+	IO_MODE_BLOCKING, // one connection at a time, blocking syscalls (default)
+	IO_MODE_EPOLL,    // many connections at once, non-blocking sockets driven by an edge-triggered epoll loop
+	IO_MODE_URING     // many connections at once, batched receives into registered buffers driven by io_uring
+};
+
+/* the way the blocking mode receives and counts the body of a file */
+enum recv_strategy {
+	RECV_BATCH,     // receive each 1MB batch in full, then count it (default)
+	RECV_PIPELINED, // receive the next chunk while a helper thread counts the previous one
+	RECV_STREAMING  // count whatever each read() returned right away, from a small buffer
+};
+
+/* the phases of serving a file, each timed into its own latency histogram */
+enum phase {
+	PHASE_ACCEPT, // waiting in accept(2) for the next connection (blocking mode only)
+	PHASE_HEADER, // from the connection (or the previous frame) until its header was received
+	PHASE_BODY,   // receiving and counting the body
+	PHASE_REPLY,  // from the end of the body until its reply was fully sent (in the event loops, from the
+	              // oldest queued reply until every queued reply was sent, so once per flush of the queue)
+	PHASES
+};
+
+/* the counters of the instrumentation */
+enum counter {
+	COUNTER_CONNECTIONS, // connections accepted
+	COUNTER_ABORTED,     // connections terminated by the client, or by a protocol error
+	COUNTER_BYTES,       // bytes received from clients, headers included
+	COUNTER_SYSCALLS,    // I/O syscalls made by the workers
+	COUNTER_TIMEOUTS,    // connections closed for missing the idle or the transfer deadline (`-i`, `-T`)
+	COUNTER_SHED,        // uploads refused for being too large (`-M`) or for the server being saturated (`-b`)
+	COUNTER_CACHE_HITS,  // lookups replied to from the dedup cache (`-d`)
+	COUNTER_CACHE_MISSES, // lookups of bodies the dedup cache doesn't hold, which the client then sends
+	COUNTERS
+};
+
+/* what a complete frame of a session amounts to */
+enum frame_result {
+	FRAME_INVALID, // the frame broke the protocol
+	FRAME_PART,    // a part of a transfer, only acknowledged
+	FRAME_FILE,    // a file (or a committed transfer) to count
+	FRAME_SHED     // a part the transfer table has no room for, refused (see `PCC_REPLY_SHED`)
+};
+
+/* the stage a connection is at, when driven by an event loop */
+enum conn_state {
+	CONN_READ_HEADER,       // reading the 8-byte size header (or the session magic)
+	CONN_READ_FRAME_HEADER, // in a session, reading the header of the next frame (and its part header, if any)
+	CONN_READ_BODY,         // streaming the body of the file
+	CONN_READ_DEFLATED,     // streaming the compressed body of a frame, block by block
+	CONN_SHED,              // the upload was refused, discarding whatever is still received until the client closes
+	CONN_DRAIN,             // nothing left to read, sending the replies still queued
+	CONN_DONE               // every reply was fully sent
+};
+
+/* the state of a single connection, when driven by an event loop.
+ * Replies are queued in <out>, so a session keeps reading frames while the replies
+ * to the previous ones are being sent */
+struct conn {
+	int fd;
+	enum conn_state state;
+	bool session;              // whether the client opened a session
+	uint32_t frame_flags;      // the flags of the frame being received
+	char header[PCC_MAX_HEADERS_SIZE]; // the size header or frame headers being received
+	uint64_t header_read;      // how many bytes of the header were read so far
+	struct pcc_part_header part; // the part header of the frame being received, if it has one
+	struct pcc_class_set classes; // the class set the body being received is counted in
+	uint64_t frame_size;       // the size of the body being received (once inflated, if it's compressed)
+	z_stream *inflater;        // the inflater of compressed bodies, created upon the first of them
+	bool inflated_all;         // whether the compressed body being received reached the end of its stream
+	char block_header[PCC_BLOCK_HEADER_SIZE]; // the length of the block of the compressed body being received
+	uint64_t block_header_read; // how many bytes of it were read so far
+	uint64_t block_left;       // how many bytes of the block are left to read
+	uint64_t notread_from_file; // how many bytes of the body are left to read
+	uint64_t printable_chars;  // how many printable characters were found so far in the body
+	uint64_t pcc_current[PCC_BYTE_VALUES]; // the statistics of the body being received (its bytes, for other class sets than the printable one)
+	uint64_t pcc_unsent[CHARS_RANGE];  // the statistics of the bodies whose replies were not fully sent yet
+	uint64_t files_unsent;     // how many bodies they stand for
+	uint64_t bytes_unsent;     // and how many bytes those bodies hold
+	uint64_t phase_start;      // when the phase the connection is at started (see `instr_now`)
+	uint64_t reply_start;      // when the oldest of the queued replies was queued
+	char out[CONN_OUT_SIZE];   // the replies waiting to be sent
+	uint64_t out_len;          // how many bytes of replies are queued
+	uint64_t out_sent;         // how many of them were sent so far
+	int buff_index;            // the registered buffer of the read in flight (io_uring only)
+	bool sending;              // whether the operation in flight is a send (io_uring only)
+	struct conn *next;         // the next connection waiting for a free registered buffer (io_uring only)
+	uint64_t admitted;         // the bytes of the body being received, held in the in-flight budget (see `admit_upload`)
+	uint64_t last_active;      // when anything was last received or sent (see `instr_now`)
+	uint64_t transfer_start;   // when the upload being received started (or the upload was refused), 0 between frames
+	struct conn *timer_prev, *timer_next; // the neighbours of the connection in its slot of the timer wheel
+	uint64_t timer_tick;       // the tick of the slot it's in
+	bool timer_armed;          // whether it's in the timer wheel
+	bool timed_out;            // whether it was shut down for missing a deadline, and is closed once its operation completes (io_uring only)
+	int lowat;                 // the SO_RCVLOWAT of its socket (`-o rcvlowat`), 0 until it's first set
+	bool broken;               // whether the client broke the protocol, or ended the connection in the middle of a frame
+	char *error;               // how the client broke the protocol, when the blocking mode reports it otherwise than as an invalid header
+	struct pcc_hash hash;      // the hash of the body being received so far, if its frame is flagged with PCC_FRAME_HASH
+};
+
+/* a worker's timer wheel: the connections of its event loop, hashed by the tick of their next check.
+ * A connection is only checked once its tick comes, and is then either timed out or rescheduled, so
+ * its reads and sends never touch the wheel (see `timer_schedule`) */
+struct timer_wheel {
+	int fd;                  // a timerfd expiring every TIMER_TICK_MS
+	uint64_t tick;           // the last tick checked
+	uint64_t expirations;    // the value read from the timerfd
+	struct conn *slots[TIMER_SLOTS];
+};
+
+/* a worker's io_uring: the mapped rings and the registered receive buffers */
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sq_entries;
+	unsigned sqe_tail;    // the tail of the submission queue, published to the kernel upon `uring_enter`
+	unsigned to_submit;   // how many queued entries the kernel didn't consume yet
+	void *sq_ring, *cq_ring; // the mappings of the rings
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	char *buffs;          // URING_BUFFERS receive buffers, URING_BUFF_SIZE bytes each
+	bool fixed_buffs;     // whether the buffers were registered (otherwise plain reads are used)
+	bool multishot_accept; // whether one accept keeps producing connections (otherwise it's re-armed each time)
+	int free_buffs[URING_BUFFERS]; // a stack of the buffers not used by any read in flight
+	int nfree;
+	struct conn *waiting_head, *waiting_tail; // connections waiting for a free buffer
+	bool accept_armed;    // whether an accept, or the poll preceding it, is in flight
+	bool accept_reserved; // whether the (single-shot) accept in flight holds a place reserved in `open_connections`
+	uint64_t wake;        // the value read from the wake-up eventfd
+};
+
+/* a worker's pipeline: the receive buffer is split into PIPELINE_SLOTS rotating slots,
+ * filled in turn by the worker and counted in the same order by a helper thread */
+struct pipeline {
+	pthread_t counter;
+	sem_t filled;           // posted by the worker once a slot was received
+	sem_t empty;            // posted by the counter once a slot was counted
+	uint64_t sizes[PIPELINE_SLOTS]; // how many bytes each slot holds
+	uint64_t *pcc_current;  // the statistics of the connection being counted
+	const struct pcc_class_set *classes; // and the class set they're counted in
+	uint64_t printable_chars; // how many printable characters were counted for that connection
+	char *slots;            // the receive buffer of the worker
+	uint64_t received;      // how many chunks were received so far, the next one goes into slot (received % PIPELINE_SLOTS)
+	bool stop;              // tells the counter to exit
+};
+
+/* a sum of the statistics of every worker (see `struct pcc_shard`) */
+struct stats_snapshot {
+	uint64_t pcc[CHARS_RANGE];
+	uint64_t files;            // how many files (or frames of a session) were counted
+	uint64_t bytes;            // how many bytes those files hold
+};
+
+/* the first message of a server handing its listening sockets over to its successor, which come along with it
+ * (SCM_RIGHTS). Once the server drained, a `struct stats_snapshot` of its final statistics follows */
+struct handoff_hello {
+	uint64_t magic;            // HANDOFF_MAGIC
+	uint32_t nfds;             // how many listening sockets come along, one per worker
+	uint32_t reserved;
+};
+
+/* a worker's instruments. Only the worker writes them, one plain load and store at a
+ * time (see `instr_add`), so they cost no more than the counters of a single thread,
+ * and readers may sum them at any time without tearing a value */
+struct instruments {
+	atomic_uint_least64_t latency[PHASES][LATENCY_BUCKETS]; // log-linear histograms of nanoseconds
+	atomic_uint_least64_t counters[COUNTERS];
+};
+
+/* a sum of the instruments of every worker */
+struct instruments_snapshot {
+	uint64_t latency[PHASES][LATENCY_BUCKETS];
+	uint64_t counters[COUNTERS];
+};
+
+/* a range of a transfer, received as one part */
+struct transfer_range {
+	uint64_t offset;
+	uint64_t size;
+};
+
+/* a file uploaded over several sessions at once. Its parts may be received by any of
+ * the workers, so transfers are kept in a table shared by all of them (`transfer_shards`) */
+struct transfer {
+	uint64_t id;
+	uint64_t total_size;       // the size of the whole file
+	uint64_t received;         // how many bytes of it the parts received so far hold
+	uint64_t printable_chars;  // how many printable characters those parts hold
+	uint64_t pcc[CHARS_RANGE]; // and their statistics
+	struct transfer_range *ranges; // the ranges received so far, by their offset, telling a retried part apart from an overlapping one
+	uint64_t num_ranges;
+	uint64_t ranges_size;      // how many ranges <ranges> has room for
+	uint64_t last_active;      // when the last part was received (see `instr_now`)
+	struct transfer *next;     // the next transfer of its chain
+};
+
+/* a transfer committed lately, whose parts may still be retried by a client that missed their replies */
+struct transfer_commit {
+	uint64_t id;
+	uint64_t total_size;
+	uint64_t committed; // when it was committed (see `instr_now`), 0 for an unused slot
+};
+
+/* a shard of the transfer table, holding the transfers whose ID falls on it. Each shard has its
+ * own lock, so parts of different transfers rarely wait for each other */
+struct transfer_shard {
+	_Alignas(PCC_CACHE_LINE_SIZE) pthread_mutex_t lock;
+	struct transfer *buckets[TRANSFER_BUCKETS]; // the chains of transfers in progress, by their ID
+	struct transfer_commit commits[TRANSFER_COMMITTED]; // the latest commits, the oldest one is forgotten for a new one
+	uint64_t next_commit; // the slot of <commits> the next commit is remembered in
+};
+
+/* a slot of the checkpoint file. The file holds two of them, written in turn, so a write torn by a
+ * crash only ever damages the older one. Written in the byte order of the host, for the same host */
+struct checkpoint {
+	uint64_t magic;          // CHECKPOINT_MAGIC
+	uint32_t version;        // CHECKPOINT_VERSION
+	uint32_t checksum;       // the CRC-32 of the rest of the slot, from <generation> on
+	uint64_t generation;     // how many checkpoints were written before, the newest valid slot is restored
+	uint64_t journal_epoch;  // the epoch of the journal the slot goes with
+	uint64_t journal_offset; // how much of that journal the slot already holds
+	uint64_t files;
+	uint64_t bytes;
+	uint64_t pcc[CHARS_RANGE];
+};
+
+/* an entry of the dedup cache: the counts of a body, keyed by its content hash and its size */
+struct cache_entry {
+	uint64_t hash;             // the content hash of the body (see pcc_hash.h)
+	uint64_t size;             // and its size
+	uint64_t printable_chars;  // how many printable characters the body holds
+	uint64_t pcc[CHARS_RANGE]; // and their statistics
+	struct cache_entry *bucket_next; // the next entry of its bucket
+	struct cache_entry *lru_prev, *lru_next; // its neighbours in the LRU list of its shard, the most recently used first
+};
+
+/* a shard of the dedup cache, holding the entries whose hash falls on it. Each shard has its own lock,
+ * so workers looking up different bodies rarely wait for each other, and shards never share a cache line */
+struct cache_shard {
+	_Alignas(PCC_CACHE_LINE_SIZE) pthread_mutex_t lock;
+	struct cache_entry **buckets; // the chains of entries, by their hash
+	uint64_t nbuckets;            // a power of 2, at least <capacity>
+	struct cache_entry *lru_head, *lru_tail;
+	uint64_t entries;             // how many entries the shard holds
+	uint64_t capacity;            // the most it may hold, the least recently used one is evicted for a new one beyond that
+	uint64_t insertions;          // how many bodies were remembered
+	uint64_t evictions;           // how many entries were evicted for them
+	uint64_t rejections;          // how many bodies weren't remembered, for not having the hash of their header
+};
+
+/* a sum of the counts of every shard of the dedup cache */
+struct cache_snapshot {
+	uint64_t entries;
+	uint64_t capacity;
+	uint64_t memory;           // the bytes taken by the shards, their buckets and their entries
+	uint64_t insertions;
+	uint64_t evictions;
+	uint64_t rejections;
+};
+
+/* a pool of fixed-size objects, carved out of slabs that are never given back. Only its
+ * worker takes objects from it and returns them, so it needs no lock, and its counts
+ * are written the same way as the instruments (see `instr_add`) for the admin endpoint */
+struct pool {
+	uint64_t obj_size;
+	void *free_list;                  // the free objects, each holding the next one in its first bytes
+	atomic_uint_least64_t in_use;     // how many objects are taken
+	atomic_uint_least64_t high_water; // the most objects ever taken at once
+	atomic_uint_least64_t capacity;   // how many objects the slabs hold
+};
+
+/* a worker, serving connections on its own listening socket with its own receive buffer.
+ * Each worker only ever writes into its own shard of the statistics, so completed
+ * connections are merged without any lock, and the shards are summed upon printing.
+ * Workers are cache-line aligned (through their shard), so neighbours never share a line */
+struct worker {
+	pthread_t thread;
+	int listenfd;          // this worker's listening socket (SO_REUSEPORT when there are several workers)
+	int wakefd;            // an eventfd waking up this worker's event loop once the server drains (or, in the blocking mode, once it's no longer saturated)
+	atomic_int admission_waiting; // whether this worker of the blocking mode (or io_uring) waits on <wakefd> for the server to no longer be saturated
+	int cpu;               // the CPU this worker is pinned to, and its listening socket takes the connections of (`-o pin`)
+	int open_connections;  // the amount of connections currently driven by this worker's event loop
+	bool accept_paused;    // whether the event loop stopped accepting, until the server is no longer saturated
+	struct timer_wheel timers; // the deadlines of the connections driven by this worker's event loop
+	char *file_data_buff;  // this worker's receive buffer of the event loops and the pipeline, holding FILE_BUFF_SIZE bytes
+	struct pool conns;     // the states of the connections driven by this worker's event loop
+	struct pool buffs[BUFF_CLASSES]; // the receive buffers of this worker, by size class
+	z_stream *inflater;    // the inflater of the compressed bodies received by the blocking mode, created upon the first of them
+	struct pipeline *pipeline; // this worker's pipeline, when the blocking mode receives with RECV_PIPELINED
+	struct pcc_shard shard; // this worker's share of the statistics across all connections
+	struct instruments instr; // this worker's latency histograms and counters
+};
 
 /*************** GLOBAL VARIABLES ******************/
-char file_data_buff[1000000] = {0};
-uint64_t pcc_total[CHARS_RANGE] = {0};
-int finished = false;
+atomic_int finished = false; // whether the server drains: no connection is accepted anymore, the ones in flight are finished
 socklen_t addrsize = sizeof(struct sockaddr_in); // the size for sockaddr_in
-int connfd = -1; // stores the fd for the connected socket
+atomic_int open_connections = 0; // the amount of connections currently being processed, across all workers
+enum io_mode io_mode = IO_MODE_BLOCKING; // the way connections are driven (`-m`)
+enum recv_strategy recv_strategy = RECV_BATCH; // the way the blocking mode receives files (`-r`)
+uint64_t stream_buff_size = STREAM_BUFF_SIZE; // the buffer size of the streaming receive (`-s`)
+struct worker *workers = NULL; // the workers serving connections
+int num_workers = 1; // the amount of workers (`-t`)
+pcc_kernel pcc_kernel_impl = NULL; // the counting kernel behind `update_pcc_current` (`-k`), selected upon startup
+const struct pcc_class_set printable_classes = { .id = PCC_CLASSES_PRINTABLE, .buckets = CHARS_RANGE }; // the class set of single-shot uploads
+const char *admin_path = NULL; // the path of the admin endpoint's UNIX socket (`-a`), if any
+struct timespec start_time; // when the server started, for the throughput reported by the admin endpoint
+_Thread_local struct instruments *thread_instr = NULL; // the instruments of the worker running on this thread, if any
+struct transfer_shard transfer_shards[TRANSFER_SHARDS]; // the transfers in progress
+atomic_uint_least64_t num_transfers = 0; // how many transfers are in progress, TRANSFER_MAX_OPEN at most
+const uint64_t buff_class_sizes[BUFF_CLASSES] = { 4096, STREAM_BUFF_SIZE, FILE_BUFF_SIZE }; // the sizes of the receive buffers
+uint64_t idle_timeout = 0;     // the nanoseconds a connection may go without receiving or sending anything (`-i`), 0 for none
+uint64_t transfer_timeout = 0; // the nanoseconds receiving a single upload may take (`-T`), 0 for none
+uint64_t max_upload_size = 0;  // the largest upload admitted (`-M`), 0 for any
+uint64_t inflight_budget = 0;  // the bytes of the uploads being received at once that saturate the server (`-b`), 0 for none
+int max_connections = 0;       // the connections served at once that saturate the server (`-c`), 0 for none
+bool bounded = false;          // whether any of the above was set, so the event loops run their timer wheels
+atomic_uint_least64_t inflight_bytes = 0; // the bytes of the uploads being received, across all workers
+const char *checkpoint_path = NULL; // the path of the checkpoint file (`-C`), if any
+uint64_t checkpoint_interval_ms = 1000; // how often a checkpoint is written (`-I`)
+int64_t journal_sync_ms = -1; // how often the journal is synced (`-J`), 0 upon every record, or -1 for no journal
+struct checkpoint *checkpoint_slots = NULL; // the two mapped slots of the checkpoint file
+uint64_t checkpoint_generation = 0; // the generation of the newest slot, guarded by <checkpoint_lock>
+pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+int journal_fd = -1;        // the journal of the counted files since the last checkpoint, if any, guarded by <journal_lock> until the persistence thread starts
+uint64_t journal_epoch = 0; // the epoch of the journal, bumped each time it starts over, guarded by <journal_lock>
+uint64_t journal_size = 0;  // how many bytes the journal holds, guarded by <journal_lock>
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+int signal_fd = -1;            // a signalfd of SIGINT and SIGTERM, blocked in every thread and read by the main thread only
+int done_fd = -1;              // an eventfd waking up the main thread each time a worker is done
+atomic_int running_workers = 0; // how many workers are still serving connections
+uint64_t drain_timeout = 0;    // the nanoseconds the connections in flight may take once the server drains (`-D`), 0 for no limit
+uint64_t drain_deadline = 0;   // when the drain gives up on them, 0 for never (or before the server drains)
+const char *handoff_path = NULL; // the path of the UNIX socket servers hand their listening sockets over through (`-H`), if any
+int handoff_fd = -1;           // this server's socket listening at `handoff_path`, until a successor connects to it
+int successor_fd = -1;         // the connection to the server this one handed its listening sockets to, if any
+int predecessor_fd = -1;       // the connection to the server that handed its listening sockets to this one, until its statistics arrive
+ino_t handoff_ino = 0;         // the inode this server's socket was bound to at `handoff_path`
+ino_t admin_ino = 0;           // and at `admin_path`
+int listen_backlog = 0;        // the backlog of the listening sockets (`-o backlog`), 0 for the default of the mode
+int defer_accept = 0;          // the seconds a connection waits in the backlog for its first bytes (`-o defer_accept`, TCP_DEFER_ACCEPT), 0 for none
+int rcvbuf_size = 0;           // the receive buffer of the connections (`-o rcvbuf`, SO_RCVBUF), 0 for the kernel's autotuning
+int rcvlowat = 0;              // the bytes an event loop waits for before reading a connection (`-o rcvlowat`, SO_RCVLOWAT), less if it asks for less, 0 for 1
+int busy_poll_usec = 0;        // the microseconds a blocking read busy-polls the device for (`-o busy_poll`, SO_BUSY_POLL), 0 for none
+bool pin_workers = false;      // whether each worker is pinned to a CPU, and takes the connections arriving on it (`-o pin`)
+struct pcc_shard inherited;    // the statistics of the previous runs, restored from the checkpoint or handed over, written by the main thread only
+uint64_t cache_capacity = 0;   // the most bodies the dedup cache remembers (`-d`), 0 for no cache
+struct cache_shard *cache_shards = NULL; // the CACHE_SHARDS shards of the dedup cache, if any
+_Thread_local uint64_t thread_deadline = 0; // when the upload received by the calling thread in the blocking mode must be done by, 0 for never
+_Thread_local struct pcc_hash *thread_hash = NULL; // the hash of the body received by the calling thread in the blocking mode, while it's hashed
 /***************************************************/
 
 
@@ -50,14 +458,20 @@ static void print_err(char* error_message, bool terminate);
  * a syscall for receiving/sending data. Error messages are printed accordingly */
 static void handle_connection_termination(bool is_ret_zero);
 
+/* Reports a connection closed for missing its idle or transfer deadline, and counts it */
+static void handle_connection_timeout(void);
+
 /* close connection fd safely */
 static void close_safe(int sockfd);
 
-/* Sets the signal handler of SIGINT to be our `server_sigint` function */
-static void set_sigint_handler(void);
+/* Opens a UNIX stream socket listening at <path>, replacing a socket left behind there by a previous run
+ * (but nothing else), and stores the inode it was bound to into <ino>.
+ *
+ * Return the listening socket, or -1 (with errno set) if it couldn't be opened */
+static int listen_unix_socket(const char *path, ino_t *ino);
 
-/* Signal handler for SIGINT */
-static void server_sigint(int);
+/* Removes the UNIX socket at <path>, unless it's no longer the one bound to inode <ino> (a successor bound its own there) */
+static void unlink_unix_socket(const char *path, ino_t ino);
 
 
 /***************************************************************************
@@ -72,6 +486,13 @@ static void server_sigint(int);
  * Other errors may terminate the program as a whole */
 static uint64_t recv_data(int sockfd, void *buff, uint64_t size);
 
+/* Sets the SO_RCVLOWAT of the connected socket <sockfd>, currently <*lowat> (0 for the default), to `rcvlowat`, or
+ * to <size> if it's smaller: the socket is only reported readable once it holds the low-water mark, so it must never
+ * be more than what the client sends before awaiting a reply. Only the event loops use it, as a blocking read that
+ * already copied part of the mark is woken up by a whole mark of new bytes only (and may never be).
+ * Does nothing unless `-o rcvlowat` was passed */
+static void set_lowat(int sockfd, int *lowat, uint64_t size);
+
 /* This function receives an already connected socket with its file descriptor
  * of <sockfd>, the amount of bytes to send <size>, and the source of bytes
  * to send named <buff>, and sends all of the bytes to the server on the 
@@ -82,6 +503,28 @@ static uint64_t recv_data(int sockfd, void *buff, uint64_t size);
  * Other errors may terminate the program as a whole */
 static uint64_t send_data(int sockfd, void *buff, uint64_t size);
 
+/* This function receives the PCC_FRAME_HEADER_SIZE bytes of a frame header from the
+ * connected socket <sockfd> into <buff>, in a session.
+ *
+ * Return PCC_FRAME_HEADER_SIZE on success, 0 if the client ended the session (an EOF
+ * right where a frame should begin), or `CLIENT_TERMINATED` if client terminated.
+ * Other errors may terminate the program as a whole */
+static uint64_t recv_frame_header(int sockfd, char buff[]);
+
+/* Encodes the reply to a frame flagged with <frame_flags> into <buff>, which must hold
+ * PCC_MAX_REPLY_SIZE bytes: the count <count> (the amount of printable characters, or of bytes
+ * counted in the class set of the frame), followed by the encoded histogram <hist> of <buckets>
+ * counts if the frame asked for it.
+ *
+ * Return the size of the reply */
+static uint64_t encode_reply(char buff[], uint32_t frame_flags, uint64_t count, uint64_t hist[], unsigned int buckets);
+
+/* Reads the class set of a frame flagged with <flags> from its headers <headers> into <classes>:
+ * the printable characters, unless the frame names a built-in class set or has a table of its own.
+ *
+ * Return false if it names a class set that isn't built in */
+static bool decode_classes(uint32_t flags, const char headers[], struct pcc_class_set *classes);
+
 
 /**************************************************************************
 ************************* AUXILIARY FUNCTIONS *****************************
@@ -95,7 +538,50 @@ static uint64_t send_data(int sockfd, void *buff, uint64_t size);
  * Return the amount of printable characters read on success (>=0), or `CLIENT_TERMINATED`
  * if client terminated.
  * Other errors may terminate the program as a whole */
-static uint64_t receive_and_process_file(int sockfd, uint64_t file_size, uint64_t pcc_current[]);
+static uint64_t receive_and_process_file(struct worker *w, int sockfd, uint64_t file_size, uint64_t pcc_current[], const struct pcc_class_set *classes);
+
+/* Receives and processes the file the same as `receive_and_process_file`, but in the way
+ * chosen by `recv_strategy`: batch, pipelined or streaming. Each of them counts the file in the class set
+ * <classes> (see `update_pcc_current`) */
+static uint64_t receive_and_process_upload(struct worker *w, int sockfd, uint64_t file_size, uint64_t pcc_current[], const struct pcc_class_set *classes);
+
+/* Same as `receive_and_process_file`, but overlaps receiving with counting: the file is
+ * received in chunks into the rotating slots of the pipeline of the worker <w>, and each
+ * chunk is counted by the pipeline's helper thread while the next one is being received */
+static uint64_t receive_and_process_file_pipelined(struct worker *w, int sockfd, uint64_t file_size, uint64_t pcc_current[], const struct pcc_class_set *classes);
+
+/* Same as `receive_and_process_file`, but counts the bytes of every read() right away,
+ * whatever their amount, through a buffer of `stream_buff_size` bytes from the pools of the
+ * worker <w>, so the reply is sent as soon as the last byte of the file was seen */
+static uint64_t receive_and_process_file_streaming(struct worker *w, int sockfd, uint64_t file_size, uint64_t pcc_current[], const struct pcc_class_set *classes);
+
+/* Same as `receive_and_process_file`, but receives a compressed body (see `PCC_FRAME_DEFLATE`) of
+ * <file_size> bytes once inflated, each block being inflated and counted as it's received.
+ * A malformed body is reported, and returned as `CLIENT_TERMINATED` too */
+static uint64_t receive_and_process_deflated(struct worker *w, int sockfd, uint64_t file_size, uint64_t pcc_current[], const struct pcc_class_set *classes);
+
+/* Inflates the <size> compressed bytes of <buff> through <zs>, a chunk at a time, counting each chunk
+ * into <printable_chars> and <pcc_current> (in the class set <classes>) while it's in cache. <notinflated> holds how many bytes the
+ * body has left to inflate, and <inflated_all> is set once the stream ended.
+ *
+ * Return false if the bytes don't inflate, inflate past the end of the body, or follow the end of the stream */
+static bool inflate_and_count(z_stream *zs, char buff[], uint64_t size, uint64_t *notinflated, bool *inflated_all,
+                              uint64_t *printable_chars, uint64_t pcc_current[], const struct pcc_class_set *classes);
+
+/* Readies the inflater <*zs> for a new compressed body, creating it if it's NULL */
+static void inflater_reset(z_stream **zs);
+
+/* Frees the inflater <*zs>, if it was ever created */
+static void inflater_free(z_stream **zs);
+
+/* Starts the pipeline of the worker <w>, along with its counting helper thread */
+static void pipeline_start(struct worker *w);
+
+/* Stops the pipeline of the worker <w>, and waits for its helper thread to exit */
+static void pipeline_stop(struct worker *w);
+
+/* The entry point of the counting helper thread of the pipeline <arg> */
+static void *pipeline_counter_main(void *arg);
 
 /* Prints the printable characters' statistics stored in <pcc_stats>.
  * <pcc_total> stands for the statistics across all connecions.
@@ -103,20 +589,458 @@ static uint64_t receive_and_process_file(int sockfd, uint64_t file_size, uint64_
 static void print_stats(uint64_t pcc_stats[], bool terminate);
 
 /* Given an array of statistics holding the printable characters' info
- * for a specific connection named <pcc_current>, update the toatl array of
- * statistics holding the printable characters' info across all connecions */
-static void update_pcc_total(uint64_t pcc_current[]);
+ * for a specific connection named <pcc_current>, update the worker <w>'s share of
+ * the statistics holding the printable characters' info across all connecions.
+ * <files> files of <bytes> bytes in total stand behind <pcc_current> */
+static void update_pcc_total(struct worker *w, uint64_t pcc_current[], uint64_t files, uint64_t bytes);
+
+/* Sums the statistics of the previous runs and the shares of all workers into <total> while they keep serving connections:
+ * each share is copied once its worker isn't in the middle of updating it, so every
+ * file is either fully in the snapshot or not at all */
+static void snapshot_stats(struct stats_snapshot *total);
 
 /* returns the number of printable characters in <file_data_buff>, and increments each 
- * printable character's index equivalent in <pcc_current> */
-static uint64_t update_pcc_current(char file_data_buff[], uint64_t size, uint64_t pcc_current[]);
+ * printable character's index equivalent in <pcc_current>, through the kernel selected from "pcc_count.h".
+ * For other class sets <classes> than the printable one, only the bytes are counted into <pcc_current>
+ * (PCC_BYTE_VALUES counts), and 0 is returned, until `complete_classes` projects them */
+static uint64_t update_pcc_current(char file_data_buff[], uint64_t size, uint64_t pcc_current[], const struct pcc_class_set *classes);
+
+/* Completes the counts of a body counted in the class set <classes>: its histogram is written into <hist>
+ * (classes->buckets counts), and for other class sets than the printable one, the bytes counted into
+ * <pcc_current> are replaced with the statistics of their printable characters, and their amount is
+ * written into <printable_chars>, as the server's statistics keep them.
+ *
+ * Return the count of the body in the class set */
+static uint64_t complete_classes(const struct pcc_class_set *classes, uint64_t *printable_chars, uint64_t pcc_current[], uint64_t hist[]);
+
+
+/*********************************************************************
+************************* POOLS **************************************
+**********************************************************************/
+/* Initializes the empty pool <pool> of <obj_size>-byte objects, and carves its first slab */
+static void pool_init(struct pool *pool, uint64_t obj_size);
+
+/* Carves a new slab of free objects for <pool>: a POOL_SLAB_SIZE-aligned mapping (so it may be
+ * backed by a huge page), first touched by the calling worker (so it's local to its NUMA node) */
+static void pool_grow(struct pool *pool);
+
+/* Takes a free object from <pool>, growing it only if every object is taken. Return the object */
+static void *pool_get(struct pool *pool);
+
+/* Returns the object <obj> to <pool> */
+static void pool_put(struct pool *pool, void *obj);
+
+/* Returns the smallest size class of the buffer pools holding <size> bytes, or the largest one */
+static unsigned int buff_class(uint64_t size);
+
+/* Takes a receive buffer holding <size> bytes (up to FILE_BUFF_SIZE) from the pools of the worker <w>,
+ * and returns it to them, given the same <size> */
+static char *buff_get(struct worker *w, uint64_t size);
+static void buff_put(struct worker *w, char *buff, uint64_t size);
+
+
+/*********************************************************************
+************************* INSTRUMENTATION ****************************
+**********************************************************************/
+/* Returns a timestamp in nanoseconds, from the vDSO's CLOCK_MONOTONIC (no syscall) */
+static uint64_t instr_now(void);
+
+/* Adds <n> to the counter <counter> of the calling worker's instruments, if it's a worker */
+static void instr_count(enum counter counter, uint64_t n);
+
+/* Records the time since <start> (see `instr_now`) in the histogram of the phase <phase>
+ * of the calling worker's instruments. Return the current timestamp, the start of the next phase */
+static uint64_t instr_phase(enum phase phase, uint64_t start);
+
+/* Adds <n> to the counter <counter>, which only the calling thread writes */
+static void instr_add(atomic_uint_least64_t *counter, uint64_t n);
+
+/* Returns the bucket of the latency histograms that <nsec> nanoseconds fall into, and the
+ * highest latency a bucket <bucket> stands for */
+static unsigned int latency_bucket(uint64_t nsec);
+static uint64_t latency_bucket_max(unsigned int bucket);
+
+/* Sums the instruments of every worker into <total>, while they keep serving connections */
+static void snapshot_instruments(struct instruments_snapshot *total);
+
+/* Returns the latency under which <quantile> of the recorded latencies in <hist> fall
+ * (up to the resolution of the buckets), or 0 if none were recorded */
+static uint64_t latency_quantile(uint64_t hist[], double quantile);
+
+
+/*********************************************************************
+************************* TRANSFERS **********************************
+**********************************************************************/
+/* Completes a frame of a session flagged with <flags>, whose body of <size> bytes was counted into
+ * <printable_chars> and <pcc_current>: a part (with the part header <part>) is added to its transfer,
+ * and a commit replaces the counts with those of its whole transfer, and <size> with the size of the file.
+ *
+ * Return what the frame amounts to */
+static enum frame_result complete_frame(uint32_t flags, const struct pcc_part_header *part, uint64_t *size,
+                                        uint64_t *printable_chars, uint64_t pcc_current[]);
+
+/* Initializes the locks of the shards of the transfer table */
+static void transfers_start(void);
+
+/* Adds the counts of the <size>-byte part <part> to its transfer, starting the transfer upon its first part.
+ * A part with the very range of a previous one is a retry, and is ignored, and so is a part of a transfer
+ * committed lately. A part starting a transfer past TRANSFER_MAX_OPEN, or adding a range to a transfer
+ * past TRANSFER_MAX_RANGES, is refused.
+ *
+ * Return FRAME_PART, FRAME_SHED if the part was refused, or FRAME_INVALID if it overlaps a previous one
+ * otherwise, or lies past the end of the file */
+static enum frame_result transfer_add_part(const struct pcc_part_header *part, uint64_t size, uint64_t printable_chars, uint64_t pcc_current[]);
+
+/* Ends the transfer of the commit <part>, writing the counts of the whole file into <printable_chars>
+ * and <pcc_current>.
+ *
+ * Return false if the transfer is unknown, or if some of the file was never received */
+static bool transfer_commit(const struct pcc_part_header *part, uint64_t *printable_chars, uint64_t pcc_current[]);
+
+/* Returns the shard of the transfer table that the transfer <id> falls on, and writes the chain of the shard
+ * it falls on into <bucket> */
+static struct transfer_shard *transfer_shard_of(uint64_t id, struct transfer ***bucket);
+
+/* Returns the link to the transfer <id> in its chain <bucket>, pointing to NULL if it isn't in it.
+ * Must be called holding the lock of its shard */
+static struct transfer **transfer_find(struct transfer **bucket, uint64_t id);
+
+/* Unlinks the transfer <*link> from its chain, and frees it. Must be called holding the lock of its shard */
+static void transfer_free(struct transfer **link);
+
+/* Drops the transfers idle for over TRANSFER_IDLE_TIMEOUT seconds, whose clients gave up on them, locking
+ * a shard at a time. Run by the main thread every TRANSFER_SWEEP_INTERVAL seconds */
+static void transfers_sweep(void);
+
+
+/*********************************************************************
+************************* DEDUP CACHE ********************************
+**********************************************************************/
+/* Creates the shards of the dedup cache, splitting `cache_capacity` between them. Does nothing unless `-d` was passed */
+static void cache_start(void);
+
+/* Returns the shard of the dedup cache that the content hash <hash> falls on */
+static struct cache_shard *cache_shard_of(uint64_t hash);
+
+/* Looks up the body of <size> bytes whose content hash is <hash> in the dedup cache, counting the lookup as a hit
+ * or a miss. On a hit, the amount of printable characters of the body is written into <printable_chars> and their
+ * statistics into <pcc_current>, and its entry becomes the most recently used one of its shard.
+ *
+ * Return whether the body was found */
+static bool cache_lookup(uint64_t hash, uint64_t size, uint64_t *printable_chars, uint64_t pcc_current[]);
+
+/* Remembers the counts <printable_chars> and <pcc_current> of a body of <size> bytes, which its header claimed the
+ * content hash <hash> for, and which the server hashed into <computed>. A body that doesn't have the hash it claimed
+ * is only counted as a rejection, so a client can never have the counts of a body replied to the lookups of another.
+ * When the shard is full, its least recently used entry makes room */
+static void cache_insert(uint64_t hash, uint64_t computed, uint64_t size, uint64_t printable_chars, const uint64_t pcc_current[]);
+
+/* Sums the counts of every shard of the dedup cache into <total> */
+static void snapshot_cache(struct cache_snapshot *total);
+
+
+/*********************************************************************
+************************* ADMISSION AND DEADLINES ********************
+**********************************************************************/
+/* Admits an upload of <size> bytes into the in-flight budget, unless it's larger than `max_upload_size`, or
+ * the uploads already being received take up the budget (an upload alone is admitted whatever its size).
+ *
+ * Return false if the upload is refused */
+static bool admit_upload(uint64_t size);
+
+/* Releases the <size> bytes of an admitted upload from the in-flight budget, once it was received (or not) */
+static void release_upload(uint64_t size);
+
+/* Returns whether another connection may be accepted: the server is saturated while it serves
+ * `max_connections` connections, or while the in-flight budget is taken up */
+static bool accepting_allowed(void);
+
+/* Reserves the place of another connection in `open_connections`, before accepting it, unless the server is
+ * saturated (see `accepting_allowed`). The place is taken atomically, so workers accepting at once never overshoot
+ * `max_connections` together. It's given back by `release_connection`, once the connection is closed (or once
+ * none was accepted after all).
+ *
+ * Return false if the server is saturated */
+static bool reserve_connection(void);
+
+/* Gives back the place of a connection, and lets the workers waiting for one know (see `admission_wake`) */
+static void release_connection(void);
+
+/* Wakes up the workers of the blocking mode waiting on their `wakefd` for the server to no longer be saturated */
+static void admission_wake(void);
+
+/* Refuses the upload of the connected socket <connfd> in the blocking mode: replies with `PCC_REPLY_SHED` and shuts
+ * the sending side down, then discards whatever the client still sends, through a buffer from the pools of the
+ * worker <w>, until it closes, since closing with unread bytes would reset the connection before the client read
+ * the refusal. The worker serves no one else meanwhile, so it gives up after SHED_DISCARD_MS milliseconds or
+ * SHED_DISCARD_SIZE bytes, whichever comes first (the event loops linger for SHED_LINGER seconds instead) */
+static void shed_connection(struct worker *w, int connfd);
+
+/* Bounds every read and send on the connected socket <connfd> in the blocking mode by the
+ * idle timeout, or by the transfer timeout if there's no idle timeout */
+static void set_socket_timeouts(int connfd);
+
+/* Returns whether the upload received by the calling thread in the blocking mode missed
+ * `thread_deadline`, in which case the timeout is reported */
+static bool deadline_passed(void);
+
+/* Returns when the connection <conn> of an event loop is to be closed, unless it makes progress
+ * before then (see `instr_now`), or UINT64_MAX for never */
+static uint64_t conn_deadline(struct conn *conn);
+
+/* Admits the body the connection <conn> is about to receive (see `admit_upload`), or else refuses it:
+ * the refusal is queued, and whatever the client still sends is discarded (see `CONN_SHED`).
+ *
+ * Return false if the upload was refused */
+static bool conn_admit(struct conn *conn);
+
+/* Refuses the frame the connection <conn> is receiving (or just received): `PCC_REPLY_SHED` is queued,
+ * and whatever the client still sends is discarded (see `CONN_SHED`) */
+static void conn_shed(struct conn *conn);
+
+/* Queues `PCC_REPLY_MISS` on <conn> for a lookup of a body the dedup cache doesn't hold, and moves on to its next frame */
+static void conn_miss(struct conn *conn);
+
+/* Starts the timer wheel of the worker <w>, and the timerfd ticking it */
+static void timers_start(struct worker *w);
+
+/* Schedules the check of the connection <conn> in the timer wheel of the worker <w>, at its deadline
+ * but no later than the shortest timeout from <now>, so a deadline pushed back since is checked again */
+static void timer_schedule(struct worker *w, struct conn *conn, uint64_t now);
+
+/* Removes the connection <conn> from the timer wheel of the worker <w>, if it's in it */
+static void timer_cancel(struct worker *w, struct conn *conn);
+
+/* Checks the connections of the worker <w> whose ticks came since the last call. Those that missed their
+ * deadline are closed right away, or, if <shut_down> is true (io_uring), are only shut down, and are
+ * closed once their operation in flight completes */
+static void timers_advance(struct worker *w, bool shut_down);
+
+
+/*********************************************************************
+************************* ADMIN ENDPOINT *****************************
+**********************************************************************/
+/* Starts the admin endpoint: a helper thread answering every connection to the UNIX
+ * socket at `admin_path` with a snapshot of the statistics, then closing it */
+static void admin_start(void);
+
+/* The entry point of the admin thread, accepting connections on the listening socket <arg> */
+static void *admin_main(void *arg);
+
+/* Writes the report of a snapshot of the statistics and the instruments to the connected socket <connfd> */
+static void admin_report(int connfd);
+
+
+/*********************************************************************
+************************* PERSISTENCE ********************************
+**********************************************************************/
+/* Maps the two slots of the checkpoint file at `checkpoint_path` (creating it), and if <restore> is true, restores
+ * the newest valid one into `inherited`, along with the records the journal holds past it, if journaling.
+ * Otherwise (the statistics were handed over by a predecessor), the journal starts over in a new epoch, and the
+ * caller should write a checkpoint right away. Called by the main thread, which may be after the workers started */
+static void persistence_start(bool restore);
+
+/* The entry point of the persistence thread: syncs the journal every `journal_sync_ms`,
+ * and writes a checkpoint every `checkpoint_interval_ms` */
+static void *persistence_main(void *arg);
+
+/* Writes a snapshot of the statistics into the older slot of the checkpoint file, and syncs it, unless
+ * nothing was counted since the newest slot. Once the journal grew past JOURNAL_ROTATE_SIZE, it starts over */
+static void checkpoint_write(void);
+
+/* Returns whether the slot <slot> holds a valid checkpoint */
+static bool checkpoint_valid(const struct checkpoint *slot);
+
+/* Appends the statistics <pcc_current> of <files> files of <bytes> bytes to the journal, syncing it
+ * if `journal_sync_ms` is 0. Must be called holding `journal_lock` */
+static void journal_append(uint64_t pcc_current[], uint64_t files, uint64_t bytes);
+
+/* Adds the records of the journal from <offset> on into <shard>, and cuts off a record torn by a crash at its end */
+static void journal_replay(struct pcc_shard *shard, uint64_t offset);
+
+/* Starts the journal over, empty but for its header, as the epoch <epoch>. Must be called holding `journal_lock` */
+static void journal_reset(uint64_t epoch);
+
+
+/*********************************************************************
+************************* LIFECYCLE **********************************
+**********************************************************************/
+/* Blocks SIGINT and SIGTERM in the calling thread (and so in every thread it creates), and opens `signal_fd`
+ * to read them and `done_fd`. Called first thing by main */
+static void signals_start(void);
+
+/* Runs the lifecycle of the server on the main thread while the workers serve connections: the first SIGINT
+ * or SIGTERM, or a successor taking the listening sockets over, drains the server, and a second signal or
+ * `drain_deadline` abandons the connections still in flight. Meanwhile, it hands the listening sockets over to a
+ * successor connecting to `handoff_fd`, and takes in the statistics of the predecessor.
+ *
+ * Return <true> once every worker is done and the predecessor's statistics arrived, or <false> if the connections
+ * in flight were abandoned (in which case the workers still run) */
+static bool lifecycle_run(void);
+
+/* Drains the server: no connection is accepted anymore, and every worker is woken up to finish the ones in flight */
+static void drain_begin(void);
+
+/* Connects to the server listening at `handoff_path`, if any, and receives its listening sockets into <listenfds>
+ * (up to HANDOFF_MAX_FDS of them). The connection is kept as `predecessor_fd`, for its statistics to arrive on.
+ *
+ * Return the amount of listening sockets received, or 0 if no server listens at `handoff_path` */
+static int handoff_connect(int listenfds[]);
+
+/* Hands the listening sockets of the workers over to a successor connecting to `handoff_fd`, then drains */
+static void handoff_accept(void);
+
+/* Receives the final statistics of the predecessor into `inherited` (or restores them from the checkpoint
+ * file, if it exited without sending them), and starts persisting them, if `checkpoint_path` is set */
+static void handoff_receive_totals(void);
+
+/* Sends the final statistics <total> to the successor, if any */
+static void handoff_send_totals(const struct stats_snapshot *total);
+
+
+/*********************************************************************
+************************* EVENT LOOP HELPERS *************************
+**********************************************************************/
+/* Sets the file descriptor <fd> to be non-blocking */
+static void set_nonblocking(int fd);
+
+/* Returns whether the connection <conn> is still receiving */
+static bool conn_reading(struct conn *conn);
+
+/* Sets the SO_RCVLOWAT of the connection <conn> by the rest of the header or block it reads next (see `set_lowat`).
+ * Called before waiting for the connection to become readable */
+static void conn_set_lowat(struct conn *conn);
+
+/* Returns how many bytes the connection <conn> should read next (at most <buff_size>),
+ * so that a read never goes past a header or a body. Returns 0 while the queue of
+ * replies is full, until some of them are sent */
+static uint64_t conn_want(struct conn *conn, uint64_t buff_size);
+
+/* Feeds <size> bytes received on the connection <conn> (at most `conn_want` of them)
+ * from <buff> into its state machine: headers are assembled, the body is counted
+ * through `update_pcc_current`, and once the whole body was seen its reply is queued.
+ *
+ * Return <false> if the client broke the protocol (see `conn_protocol_error`) */
+static bool conn_consume(struct conn *conn, char buff[], uint64_t size);
+
+/* Reports how the client of the connection <conn> broke the protocol, as the blocking mode reports it */
+static void conn_protocol_error(struct conn *conn);
+
+/* Stops reading from the connection <conn>, whose client broke the protocol or ended the connection in the middle
+ * of a frame. The replies to its previous frames are still sent, and their bodies counted once they are, as the
+ * blocking mode replies to each frame and counts it before reading the next one. It's then closed as aborted */
+static void conn_break(struct conn *conn);
+
+/* Handles the client closing its side of the connection <conn>.
+ * Return <true> if it did so at the end of a session (the queued replies are still sent),
+ * or <false> if the connection terminated unexpectedly */
+static bool conn_eof(struct conn *conn);
+
+/* Marks <size> more bytes of the queued replies of the connection <conn> as sent. Once
+ * all of them were sent, the statistics of their bodies are added to the worker <w>'s share */
+static void conn_sent(struct worker *w, struct conn *conn, uint64_t size);
+
+/* Advances the state machine of the connection <conn> as far as its socket allows
+ * without blocking: reads the headers, streams the bodies through
+ * `update_pcc_current` and writes the replies.
+ *
+ * Return <true> if the connection should be closed (either done or terminated),
+ * or <false> if it should wait for more readiness events */
+static bool conn_advance(struct worker *w, struct conn *conn);
+
+/* Closes the connection <conn> of the worker <w>, counting it as aborted unless it was done (or refused) without breaking the protocol */
+static void conn_close(struct worker *w, struct conn *conn);
+
+/* Accepts every pending connection on the non-blocking listening socket of the worker <w>
+ * and registers each of them in the epoll instance <epfd> */
+static void accept_connections(struct worker *w, int epfd);
+
+
+/*********************************************************************
+************************* IO_URING HELPERS ***************************
+**********************************************************************/
+/* Sets up the io_uring <ring>: maps its queues and registers its receive buffers.
+ * Return <false> if the kernel doesn't support io_uring */
+static bool uring_setup(struct uring *ring);
+
+/* Unmaps and closes the io_uring <ring> */
+static void uring_teardown(struct uring *ring);
+
+/* Publishes every queued submission to the kernel, and waits for at least <min_complete>
+ * completions. Return the result of io_uring_enter(2) */
+static int uring_enter(struct uring *ring, unsigned min_complete);
+
+/* Returns a zeroed submission queue entry, handing queued entries to the kernel if the queue is full */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/* Queues an accept on the listening socket of the worker <w>: a multishot one, unless the server is saturated, or
+ * else a poll for the next connection, whose place is reserved once it arrives (see `uring_accept_reserved`).
+ *
+ * Return false if the server is saturated, in which case nothing was queued */
+static bool uring_submit_accept(struct worker *w, struct uring *ring);
+
+/* Reserves the place of the connection that arrived on the listening socket of the worker <w> (see
+ * `reserve_connection`), and queues a single-shot accept of it. The place is counted among the worker's open
+ * connections until the accept completes, and given back if it fails or is cancelled. While the other workers
+ * saturate the server, it waits on the wake-up eventfd instead, until one of them makes room (see `admission_wake`).
+ * A multishot accept can't reserve, so it's only used when the server has neither `max_connections` nor an
+ * in-flight budget */
+static void uring_accept_reserved(struct worker *w, struct uring *ring);
+
+/* Queues the next operation of the connection <conn>: sending the rest of the queued
+ * replies, or else a read into a free registered buffer (or waiting for one) */
+static void uring_submit_conn(struct uring *ring, struct conn *conn);
+
+/* Returns the registered buffer <index> to <ring>, and hands it to a connection waiting for one */
+static void uring_release_buff(struct uring *ring, int index);
+
+/* Handles the completion <res> of the operation in flight of the connection <conn> of the worker <w>.
+ * Return <true> if the connection should be closed (either done or terminated) */
+static bool uring_complete_conn(struct worker *w, struct uring *ring, struct conn *conn, int res);
 
 
 /*********************************************************************
 ************************* MAIN MECHANISM *****************************
 **********************************************************************/
-/* processes files sent over connected socket induced from the listening socket <listenfd> */
-static void process_connections(int listenfd);
+/* processes files sent over connected socket induced from the listening socket of the worker <w> */
+static void process_connections(struct worker *w);
+
+/* serves the session opened on the connected socket <connfd>: receives its frames, and replies
+ * to each of them, until the client ends the session or terminates (or a frame is refused). The header of its
+ * first frame is timed from <phase_start>.
+ *
+ * Return <false> if the client terminated or broke the protocol */
+static bool process_session(struct worker *w, int connfd, uint64_t phase_start);
+
+/* processes files sent over many connected sockets at once, induced from the
+ * listening socket of the worker <w>, using an edge-triggered epoll loop */
+static void process_connections_epoll(struct worker *w);
+
+/* processes files sent over many connected sockets at once, induced from the
+ * listening socket of the worker <w>, using io_uring.
+ *
+ * Return <false> if io_uring isn't available (before any connection was accepted),
+ * in which case the caller should fall back to another mode */
+static bool process_connections_uring(struct worker *w);
+
+/* The entry point of a worker <arg>: serves connections in the configured `io_mode` until the server drains,
+ * then lets the main thread know through `done_fd` */
+static void *worker_main(void *arg);
+
+/* Creates a socket listening on <port>. When <reuseport> is true, several such
+ * sockets may listen on the same port, and the kernel balances connections between them */
+static int open_listening_socket(uint16_t port, bool reuseport);
+
+/* Applies the socket knobs of `-o` to the socket <listenfd> (whose accepted connections inherit them), then
+ * listens on it with the configured backlog. Sockets handed over by a predecessor are tuned again this way */
+static void tune_listening_socket(int listenfd);
+
+/* Parses the socket knobs passed to `-o`: a comma-separated list of `knob=value` (or `pin`) */
+static void parse_socket_knobs(char *knobs);
+
+/* Pins each worker to a CPU the server may run on, round-robin, and lets its listening socket take the
+ * connections whose packets arrive on that CPU (SO_INCOMING_CPU), so each connection stays on one core */
+static void pin_workers_to_cpus(void);
 /**************************************************/
 
 
@@ -144,32 +1068,62 @@ static void handle_connection_termination(bool is_ret_zero) {
 	} else { // other errors
 		if (errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE) {
 			print_err("Error: Client connection terminated due to TCP errors", false); // don't terminate
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) { // a read or send outlasted the timeouts of the socket (blocking mode)
+			handle_connection_timeout(); // don't terminate
 		} else {
 			print_err("Error: unexpected error when receiving/sending data", true); // do terminate
 		}
 	}
 }
 
+static void handle_connection_timeout(void) {
+	errno = ETIMEDOUT;
+	print_err("Error: Client connection timed out", false); // don't terminate
+	instr_count(COUNTER_TIMEOUTS, 1);
+}
+
 static void close_safe(int sockfd) {
 	if (-1 == close(sockfd)) {
 		if (errno != EINTR) print_err("Error: Couldn't close a socket of a connection", true); 
 	}
 }
 
-static void set_sigint_handler(void) {
-	struct sigaction sa_int;
-	sa_int.sa_handler = server_sigint; // make the handling of SIGINT default again (I.E. terminate upon a SIGINT)
-	if ( 0 > sigaction(SIGINT, &sa_int, 0) ) {
-		print_err("Error: Couldn't set SIG_INT handler", true);
+static int listen_unix_socket(const char *path, ino_t *ino) {
+	int fd = -1;
+	struct sockaddr_un addr;
+	struct stat sb;
+	
+	if ( strlen(path) >= sizeof(addr.sun_path) ) {
+		errno = ENAMETOOLONG;
+		return -1;
 	}
+	if ( -1 == (fd = socket(AF_UNIX, SOCK_STREAM, 0)) ) {
+		return -1;
+	}
+	
+	// a socket left behind by a previous run is replaced, but nothing else is
+	if ( 0 == stat(path, &sb) && S_ISSOCK(sb.st_mode) ) {
+		unlink(path);
+	}
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ( 0 != bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || 0 != listen(fd, 10) || 0 != stat(path, &sb) ) {
+		int tmp_errno = errno;
+		close(fd);
+		errno = tmp_errno;
+		return -1;
+	}
+	*ino = sb.st_ino;
+	
+	return fd;
 }
 
-static void server_sigint(int sig) {
-
-	if (connfd == -1) { // if no client is currently being processed, simply terminate the program
-		print_stats(pcc_total, true);
-	} else { // if there is a client being processed, simply signal to the server to not accept any new connections
-		finished = true; 
+static void unlink_unix_socket(const char *path, ino_t ino) {
+	struct stat sb;
+	if ( 0 == stat(path, &sb) && sb.st_ino == ino ) {
+		unlink(path);
 	}
 }
 /*************************************************************************/
@@ -185,11 +1139,11 @@ static void server_sigint(int sig) {
 ****************************************************************************/
 static uint64_t recv_data(int sockfd, void *buff, uint64_t size) {
 	uint64_t notread = size; // how much we have left to read
-	uint64_t nread = 0; // how much we've read so far
-	uint64_t totalread = 0; // how much we've written in last read() call
+	ssize_t nread = 0; // how much we've read in last read() call (signed, so errors are not mistaken for progress)
+	uint64_t totalread = 0; // how much we've read so far
 	
 	while ( notread > 0 ) {
-
+		instr_count(COUNTER_SYSCALLS, 1);
 		if ( 0 >= (nread = read(sockfd, buff + totalread, notread)) ) {
 			if ( (nread < 0) && errno == EINTR) { // if the error is EINTR, simply ignore it (SIG_INT handler) and redo the reading
 				continue;
@@ -198,10 +1152,15 @@ static uint64_t recv_data(int sockfd, void *buff, uint64_t size) {
 				goto client_error; // this part is reached only if the error was a TCP error or an unexpected connection termination
 			}
 		} else { // if the reading succeeded, advance
+			instr_count(COUNTER_BYTES, nread);
 			totalread += nread;
 			notread -= nread;
 		}
 		
+		if ( deadline_passed() ) { // a client trickling its upload
+			goto client_error;
+		}
+		
 	}
 	
 	return totalread;
@@ -210,14 +1169,28 @@ client_error:
 	return CLIENT_TERMINATED;
 }
 
+static void set_lowat(int sockfd, int *lowat, uint64_t size) {
+	int value = (size < (uint64_t)rcvlowat) ? (int)size : rcvlowat;
+	if ( rcvlowat == 0 || size == 0 || value == (*lowat ? *lowat : 1) ) {
+		return;
+	}
+	
+	instr_count(COUNTER_SYSCALLS, 1);
+	if ( -1 == setsockopt(sockfd, SOL_SOCKET, SO_RCVLOWAT, &value, sizeof(int)) ) {
+		print_err("Error: Couldn't set the SO_RCVLOWAT of a connection", true);
+	}
+	*lowat = value;
+}
+
 static uint64_t send_data(int sockfd, void *buff, uint64_t size) {
-	uint64_t nsent = 0; // how much we've written in last write() call
+	ssize_t nsent = 0; // how much we've written in last write() call (signed, so errors are not mistaken for progress)
 	uint64_t totalsent = 0; // how much we've written so far
 	uint64_t notwritten = size; // how much we have left to write
 	
 	// start sending until no data left to send
 	while( notwritten > 0 ) {
 	
+		instr_count(COUNTER_SYSCALLS, 1);
 		if ( 0 >= (nsent = write(sockfd, buff + totalsent,	notwritten)) ) {
 			if ( (nsent < 0) && errno == EINTR) { // if the error is EINTR, simply ignore it (SIG_INT handler) and redo the sending
 				continue;
@@ -239,6 +1212,56 @@ static uint64_t send_data(int sockfd, void *buff, uint64_t size) {
 client_error:
 	return CLIENT_TERMINATED;
 }
+
+static uint64_t recv_frame_header(int sockfd, char buff[]) {
+	ssize_t nread = 0; // how much we've read in the first read() call
+	
+	// the first read tells apart the end of the session from the next frame
+	do {
+		instr_count(COUNTER_SYSCALLS, 1);
+	} while ( 0 > (nread = read(sockfd, buff, PCC_FRAME_HEADER_SIZE)) && errno == EINTR ); // SIG_INT handler, simply redo the reading
+	
+	if ( nread == 0 ) { // the client ended the session
+		return 0;
+	} else if ( nread < 0 ) {
+		handle_connection_termination(false); // terminate if not a TCP error
+		return CLIENT_TERMINATED;
+	}
+	instr_count(COUNTER_BYTES, nread);
+	
+	// the rest of the header
+	if ( CLIENT_TERMINATED == recv_data(sockfd, buff + nread, PCC_FRAME_HEADER_SIZE - nread) ) {
+		return CLIENT_TERMINATED;
+	}
+	
+	return PCC_FRAME_HEADER_SIZE;
+}
+
+static uint64_t encode_reply(char buff[], uint32_t frame_flags, uint64_t count, uint64_t hist[], unsigned int buckets) {
+	uint64_t count_n = htobe64(count);
+	memcpy(buff, &count_n, PCC_REPLY_SIZE);
+	
+	if ( !(frame_flags & PCC_FRAME_HISTOGRAM) ) {
+		return PCC_REPLY_SIZE;
+	}
+	
+	// the histogram follows, prefixed by its size
+	uint16_t histogram_size = pcc_encode_histogram(buff + PCC_REPLY_SIZE + 2, hist, buckets);
+	uint16_t histogram_size_n = htobe16(histogram_size);
+	memcpy(buff + PCC_REPLY_SIZE, &histogram_size_n, 2);
+	
+	return PCC_REPLY_SIZE + 2 + histogram_size;
+}
+
+static bool decode_classes(uint32_t flags, const char headers[], struct pcc_class_set *classes) {
+	uint64_t offset = pcc_frame_headers_size(flags & (PCC_FRAME_PART | PCC_FRAME_COMMIT)); // the class set header follows the part header, if any
+	
+	if ( flags & PCC_FRAME_CLASS_TABLE ) {
+		pcc_class_set_custom(classes, (const uint8_t*)headers + offset);
+		return true;
+	}
+	return 0 == pcc_class_set_builtin(classes, (flags & PCC_FRAME_CLASSES) ? pcc_decode_classes_header(headers + offset) : PCC_CLASSES_PRINTABLE);
+}
 /****************************************************************************/
 
 
@@ -250,65 +1273,2301 @@ client_error:
 /**************************************************************************
 ************************* AUXILIARY FUNCTIONS *****************************
 ***************************************************************************/
-static uint64_t receive_and_process_file(int sockfd, uint64_t file_size, uint64_t pcc_current[]) {
+static uint64_t receive_and_process_file(struct worker *w, int sockfd, uint64_t file_size, uint64_t pcc_current[], const struct pcc_class_set *classes) {
 	uint64_t printable_chars = 0; // how many printable characters were found in the file
 	uint64_t notread_from_file = file_size; // the file size we expect to process
+	char *file_data_buff = buff_get(w, file_size); // a buffer of the smallest class holding the file, up to 1MB
 
 	while ( notread_from_file > 0 ) {
 		
 		// reading the next 1MB from the file
-		uint64_t notread = (notread_from_file >= 1000000) ? 1000000 : notread_from_file;
+		uint64_t notread = (notread_from_file >= FILE_BUFF_SIZE) ? FILE_BUFF_SIZE : notread_from_file;
 		if ( CLIENT_TERMINATED == recv_data(sockfd, file_data_buff, notread) ) { // if the connection terminated unexpectedly 
 			goto client_error;
 		} else { // if the data was received without any errors, advance
 			notread_from_file -= notread;
 		}
+		if ( thread_hash ) pcc_hash_update(thread_hash, file_data_buff, notread);
 		
 		// process characters read from file into the buffer <file_data_buff>
-		printable_chars += update_pcc_current(file_data_buff, notread, pcc_current);
+		printable_chars += update_pcc_current(file_data_buff, notread, pcc_current, classes);
 	}
 	
 	// return the amount of printable characters processed
+	buff_put(w, file_data_buff, file_size);
 	return printable_chars; 
 	
 client_error:
+	buff_put(w, file_data_buff, file_size);
 	return CLIENT_TERMINATED;
 }
 
-static void print_stats(uint64_t pcc_stats[], bool terminate) {
-	// printing the stats
-	for (unsigned int i = 0; i < CHARS_RANGE; i++) {
-		printf("char '%c' : %lu times\n", (char)(i + 32), pcc_stats[i]);
-	}
-	
-	// terminating
-	if (terminate) {
-		exit(0);
+static uint64_t receive_and_process_upload(struct worker *w, int sockfd, uint64_t file_size, uint64_t pcc_current[], const struct pcc_class_set *classes) {
+	if (recv_strategy == RECV_PIPELINED) {
+		return receive_and_process_file_pipelined(w, sockfd, file_size, pcc_current, classes);
+	} else if (recv_strategy == RECV_STREAMING) {
+		return receive_and_process_file_streaming(w, sockfd, file_size, pcc_current, classes);
+	} else {
+		return receive_and_process_file(w, sockfd, file_size, pcc_current, classes);
 	}
 }
 
-static void update_pcc_total(uint64_t pcc_current[]) { 
-	// adding the the current statistics with the total statistics
-	for (unsigned int i = 0; i < CHARS_RANGE; i++) {
-		pcc_total[i] += pcc_current[i];
+static uint64_t receive_and_process_file_pipelined(struct worker *w, int sockfd, uint64_t file_size, uint64_t pcc_current[], const struct pcc_class_set *classes) {
+	struct pipeline *pl = w->pipeline;
+	uint64_t notread_from_file = file_size; // the file size we expect to process
+	bool terminated = false; // whether the connection terminated unexpectedly
+	
+	// the counter works on this connection's statistics until the pipeline is drained
+	pl->pcc_current = pcc_current;
+	pl->classes = classes;
+	pl->printable_chars = 0;
+
+	while ( notread_from_file > 0 ) {
+		
+		// waiting for the counter to be done with the slot we're about to reuse
+		while ( 0 != sem_wait(&pl->empty) ); // only EINTR (SIG_INT handler) can fail it
+		
+		// reading the next chunk from the file into the slot
+		uint64_t slot = pl->received % PIPELINE_SLOTS;
+		uint64_t notread = (notread_from_file >= PIPELINE_SLOT_SIZE) ? PIPELINE_SLOT_SIZE : notread_from_file;
+		if ( CLIENT_TERMINATED == recv_data(sockfd, pl->slots + slot * PIPELINE_SLOT_SIZE, notread) ) { // if the connection terminated unexpectedly 
+			sem_post(&pl->empty); // the slot was never handed over
+			terminated = true;
+			break;
+		}
+		notread_from_file -= notread;
+		if ( thread_hash ) pcc_hash_update(thread_hash, pl->slots + slot * PIPELINE_SLOT_SIZE, notread);
+		
+		// handing the chunk to the counter, and moving on to the next one right away
+		pl->sizes[slot] = notread;
+		pl->received++;
+		sem_post(&pl->filled);
 	}
+	
+	// draining the pipeline: every slot is empty once the counter is done with the last chunk
+	for (int i = 0; i < PIPELINE_SLOTS; i++) {
+		while ( 0 != sem_wait(&pl->empty) );
+	}
+	for (int i = 0; i < PIPELINE_SLOTS; i++) {
+		sem_post(&pl->empty);
+	}
+	
+	// return the amount of printable characters processed
+	return terminated ? CLIENT_TERMINATED : pl->printable_chars;
 }
 
-static uint64_t update_pcc_current(char file_data_buff[], uint64_t size, uint64_t pcc_current[]) {
-	uint64_t printable_chars = 0; // the amount of printable characters in <file_data_buff>
+static uint64_t receive_and_process_file_streaming(struct worker *w, int sockfd, uint64_t file_size, uint64_t pcc_current[], const struct pcc_class_set *classes) {
+	uint64_t printable_chars = 0; // how many printable characters were found in the file
+	uint64_t notread_from_file = file_size; // the file size we expect to process
+	ssize_t nread = 0; // how much we've read in last read() call
+	uint64_t read_size = (file_size >= stream_buff_size) ? stream_buff_size : file_size; // the most bytes a single read() takes
+	char *file_data_buff = buff_get(w, read_size);
 
-	// inserting the statistics of the printable characters in the given buffer into <pcc_current>
-	for (uint64_t i = 0; i < size; i++) { 
-		if (IS_PRINTABLE(file_data_buff[i])) { // if a printable character was found
-			printable_chars++;
-			pcc_current[(int)file_data_buff[i] - 32]++;
+	while ( notread_from_file > 0 ) {
+		
+		// reading whatever already arrived, up to the size of the buffer
+		uint64_t notread = (notread_from_file >= read_size) ? read_size : notread_from_file;
+		instr_count(COUNTER_SYSCALLS, 1);
+		if ( 0 >= (nread = read(sockfd, file_data_buff, notread)) ) {
+			if ( (nread < 0) && errno == EINTR) { // if the error is EINTR, simply ignore it (SIG_INT handler) and redo the reading
+				continue;
+			} else { 
+				handle_connection_termination(nread == 0); // terminate if not a TCP error or unexpected connection termination
+				goto client_error;
+			}
+		}
+		instr_count(COUNTER_BYTES, nread);
+		notread_from_file -= nread;
+		if ( deadline_passed() ) { // a client trickling its upload
+			goto client_error;
 		}
+		
+		// process characters read from file while they're still in cache
+		if ( thread_hash ) pcc_hash_update(thread_hash, file_data_buff, nread);
+		printable_chars += update_pcc_current(file_data_buff, nread, pcc_current, classes);
 	}
 	
-	// returning the amount of printable characters in the given buffer
+	// return the amount of printable characters processed
+	buff_put(w, file_data_buff, read_size);
 	return printable_chars; 
-}
-/**************************************************************************/
+	
+client_error:
+	buff_put(w, file_data_buff, read_size);
+	return CLIENT_TERMINATED;
+}
+
+static uint64_t receive_and_process_deflated(struct worker *w, int sockfd, uint64_t file_size, uint64_t pcc_current[], const struct pcc_class_set *classes) {
+	uint64_t printable_chars = 0; // how many printable characters were found in the inflated file
+	uint64_t notinflated = file_size; // the inflated size we expect to process
+	bool inflated_all = false; // whether the stream ended
+	uint32_t block_size_n = 0;
+	char *file_data_buff = buff_get(w, STREAM_BUFF_SIZE);
+	
+	inflater_reset(&w->inflater);
+	while ( true ) {
+	
+		// reading the length of the next block, up to the empty block ending the body
+		if ( CLIENT_TERMINATED == recv_data(sockfd, &block_size_n, PCC_BLOCK_HEADER_SIZE) ) {
+			goto client_error;
+		}
+		uint64_t notread = be32toh(block_size_n);
+		if ( notread == 0 ) {
+			break;
+		}
+		
+		// inflating the block a buffer at a time
+		while ( notread > 0 ) {
+			uint64_t size = (notread >= STREAM_BUFF_SIZE) ? STREAM_BUFF_SIZE : notread;
+			if ( CLIENT_TERMINATED == recv_data(sockfd, file_data_buff, size) ) {
+				goto client_error;
+			}
+			if ( !inflate_and_count(w->inflater, file_data_buff, size, &notinflated, &inflated_all, &printable_chars, pcc_current, classes) ) {
+				goto protocol_error;
+			}
+			notread -= size;
+		}
+	}
+	
+	if ( !inflated_all || notinflated > 0 ) { // the stream ended early, or inflated short of the size
+		goto protocol_error;
+	}
+	
+	buff_put(w, file_data_buff, STREAM_BUFF_SIZE);
+	return printable_chars;
+	
+protocol_error:
+	errno = EPROTO;
+	print_err("Error: Client sent a malformed compressed body", false);
+client_error:
+	buff_put(w, file_data_buff, STREAM_BUFF_SIZE);
+	return CLIENT_TERMINATED;
+}
+
+static bool inflate_and_count(z_stream *zs, char buff[], uint64_t size, uint64_t *notinflated, bool *inflated_all,
+                              uint64_t *printable_chars, uint64_t pcc_current[], const struct pcc_class_set *classes) {
+	char chunk[INFLATE_CHUNK_SIZE];
+	
+	if ( *inflated_all ) { // nothing may follow the end of the stream
+		return size == 0;
+	}
+	
+	zs->next_in = (Bytef*)buff;
+	zs->avail_in = size;
+	do {
+		zs->next_out = (Bytef*)chunk;
+		zs->avail_out = INFLATE_CHUNK_SIZE;
+		int ret = inflate(zs, Z_NO_FLUSH);
+		if ( ret != Z_OK && ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && zs->avail_in == 0) ) { // malformed, or stuck
+			return false;
+		}
+		
+		uint64_t inflated = INFLATE_CHUNK_SIZE - zs->avail_out;
+		if ( inflated > *notinflated ) {
+			return false;
+		}
+		*printable_chars += update_pcc_current(chunk, inflated, pcc_current, classes);
+		*notinflated -= inflated;
+		
+		if ( ret == Z_STREAM_END ) {
+			*inflated_all = true;
+			return zs->avail_in == 0;
+		}
+	} while ( zs->avail_out == 0 || zs->avail_in > 0 ); // a full chunk may have more output pending
+	
+	return true;
+}
+
+static void inflater_reset(z_stream **zs) {
+	if ( NULL != *zs ) {
+		inflateReset(*zs);
+		return;
+	}
+	
+	if ( NULL == (*zs = calloc(1, sizeof(z_stream))) || Z_OK != inflateInit2(*zs, -MAX_WBITS) ) { // a raw deflate stream
+		print_err("Error: Couldn't allocate an inflater", true);
+	}
+}
+
+static void inflater_free(z_stream **zs) {
+	if ( NULL != *zs ) {
+		inflateEnd(*zs);
+		free(*zs);
+		*zs = NULL;
+	}
+}
+
+static void pipeline_start(struct worker *w) {
+	struct pipeline *pl = calloc(1, sizeof(struct pipeline));
+	if ( NULL == pl ) {
+		print_err("Error: Couldn't allocate a pipeline", true);
+	}
+	
+	pl->slots = w->file_data_buff;
+	if ( -1 == sem_init(&pl->filled, 0, 0) || -1 == sem_init(&pl->empty, 0, PIPELINE_SLOTS) ) {
+		print_err("Error: Couldn't initialize the semaphores of a pipeline", true);
+	}
+	
+	if ( 0 != (errno = pthread_create(&pl->counter, NULL, pipeline_counter_main, pl)) ) {
+		print_err("Error: Couldn't create a counter thread", true);
+	}
+	
+	w->pipeline = pl;
+}
+
+static void pipeline_stop(struct worker *w) {
+	struct pipeline *pl = w->pipeline;
+	
+	pl->stop = true;
+	sem_post(&pl->filled);
+	pthread_join(pl->counter, NULL);
+	
+	sem_destroy(&pl->filled);
+	sem_destroy(&pl->empty);
+	free(pl);
+	w->pipeline = NULL;
+}
+
+static void *pipeline_counter_main(void *arg) {
+	struct pipeline *pl = arg;
+	uint64_t chunk = 0; // the index of the next chunk to count, across all connections
+	
+	while ( true ) {
+		while ( 0 != sem_wait(&pl->filled) );
+		if ( pl->stop ) {
+			break;
+		}
+		
+		// counting the chunks in the order they were received, and handing the slot back
+		uint64_t slot = chunk % PIPELINE_SLOTS;
+		pl->printable_chars += update_pcc_current(pl->slots + slot * PIPELINE_SLOT_SIZE, pl->sizes[slot], pl->pcc_current, pl->classes);
+		chunk++;
+		sem_post(&pl->empty);
+	}
+	
+	return NULL;
+}
+
+static void print_stats(uint64_t pcc_stats[], bool terminate) {
+	// printing the stats
+	for (unsigned int i = 0; i < CHARS_RANGE; i++) {
+		printf("char '%c' : %lu times\n", (char)(i + 32), pcc_stats[i]);
+	}
+	
+	// terminating
+	if (terminate) {
+		exit(0);
+	}
+}
+
+static void update_pcc_total(struct worker *w, uint64_t pcc_current[], uint64_t files, uint64_t bytes) { 
+	
+	// the record is appended along with the update, so a checkpoint never holds half of it. The journal may be opened
+	// meanwhile, once a predecessor handed its statistics over, so whether it's open is only read under the lock: an
+	// update made before then is in the shards by the time the checkpoint that follows the opening snapshots them
+	bool journaled = (NULL != checkpoint_path && journal_sync_ms >= 0);
+	if ( journaled ) {
+		pthread_mutex_lock(&journal_lock);
+		if ( journal_fd != -1 ) {
+			journal_append(pcc_current, files, bytes);
+		}
+	}
+	
+	// adding the the current statistics with the worker's share of the total statistics
+	pcc_shard_add(&w->shard, pcc_current, files, bytes);
+	
+	if ( journaled ) {
+		pthread_mutex_unlock(&journal_lock);
+	}
+}
+
+static void snapshot_stats(struct stats_snapshot *total) {
+	struct stats_snapshot copy;
+	memset(total, 0, sizeof(struct stats_snapshot));
+	
+	// summing the statistics of the previous runs and the shares of all workers, each copied until it didn't change under our feet
+	for (int w = -1; w < num_workers; w++) {
+		pcc_shard_read((w == -1) ? &inherited : &workers[w].shard, copy.pcc, &copy.files, &copy.bytes);
+		for (unsigned int i = 0; i < CHARS_RANGE; i++) {
+			total->pcc[i] += copy.pcc[i];
+		}
+		total->files += copy.files;
+		total->bytes += copy.bytes;
+	}
+}
+
+static uint64_t update_pcc_current(char file_data_buff[], uint64_t size, uint64_t pcc_current[], const struct pcc_class_set *classes) {
+	if ( classes->id != PCC_CLASSES_PRINTABLE ) { // the bytes are projected onto the class set once the body is complete
+		pcc_count_bytes(file_data_buff, size, pcc_current);
+		return 0;
+	}
+	return pcc_kernel_impl(file_data_buff, size, pcc_current);
+}
+
+static uint64_t complete_classes(const struct pcc_class_set *classes, uint64_t *printable_chars, uint64_t pcc_current[], uint64_t hist[]) {
+	if ( classes->id == PCC_CLASSES_PRINTABLE ) {
+		memcpy(hist, pcc_current, CHARS_RANGE * sizeof(uint64_t));
+		return *printable_chars;
+	}
+	
+	// the bytes of the body, projected onto the class set and onto the printable characters
+	uint64_t pcc[CHARS_RANGE] = {0};
+	memset(hist, 0, classes->buckets * sizeof(uint64_t));
+	uint64_t count = pcc_project(classes, pcc_current, hist);
+	*printable_chars = pcc_project_printable(pcc_current, pcc);
+	memset(pcc_current, 0, PCC_BYTE_VALUES * sizeof(uint64_t));
+	memcpy(pcc_current, pcc, sizeof(pcc));
+	
+	return count;
+}
+/**************************************************************************/
+
+
+
+
+
+
+
+/*********************************************************************
+************************* POOLS **************************************
+**********************************************************************/
+static void pool_init(struct pool *pool, uint64_t obj_size) {
+	pool->obj_size = (obj_size + 63) & ~(uint64_t)63; // whole cache lines, so objects never share one
+	pool->free_list = NULL;
+	pool_grow(pool);
+}
+
+static void pool_grow(struct pool *pool) {
+	uint64_t slab_size = (pool->obj_size > POOL_SLAB_SIZE) ? (pool->obj_size + POOL_SLAB_SIZE - 1) & ~(uint64_t)(POOL_SLAB_SIZE - 1) : POOL_SLAB_SIZE;
+	
+	// mapping an extra huge page, and trimming the mapping down to an aligned slab
+	char *mapping = mmap(NULL, slab_size + POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( MAP_FAILED == mapping ) {
+		print_err("Error: Couldn't allocate a slab of a pool", true);
+	}
+	char *slab = (char*)(((uintptr_t)mapping + POOL_SLAB_SIZE - 1) & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+	if ( slab > mapping ) {
+		munmap(mapping, slab - mapping);
+	}
+	munmap(slab + slab_size, (mapping + slab_size + POOL_SLAB_SIZE) - (slab + slab_size));
+	madvise(slab, slab_size, MADV_HUGEPAGE); // only a hint, the kernel may not support it
+	
+	// linking the objects into the free list, in order, which touches their first page
+	uint64_t nobjs = slab_size / pool->obj_size;
+	for (uint64_t i = nobjs; i-- > 0; ) {
+		void *obj = slab + i * pool->obj_size;
+		*(void**)obj = pool->free_list;
+		pool->free_list = obj;
+	}
+	instr_add(&pool->capacity, nobjs);
+}
+
+static void *pool_get(struct pool *pool) {
+	if ( NULL == pool->free_list ) {
+		pool_grow(pool);
+	}
+	
+	void *obj = pool->free_list;
+	pool->free_list = *(void**)obj;
+	
+	uint64_t in_use = atomic_load_explicit(&pool->in_use, memory_order_relaxed) + 1;
+	atomic_store_explicit(&pool->in_use, in_use, memory_order_relaxed);
+	if ( in_use > atomic_load_explicit(&pool->high_water, memory_order_relaxed) ) {
+		atomic_store_explicit(&pool->high_water, in_use, memory_order_relaxed);
+	}
+	return obj;
+}
+
+static void pool_put(struct pool *pool, void *obj) {
+	*(void**)obj = pool->free_list;
+	pool->free_list = obj;
+	atomic_store_explicit(&pool->in_use, atomic_load_explicit(&pool->in_use, memory_order_relaxed) - 1, memory_order_relaxed);
+}
+
+static unsigned int buff_class(uint64_t size) {
+	unsigned int c = 0;
+	while ( c < BUFF_CLASSES - 1 && buff_class_sizes[c] < size ) {
+		c++;
+	}
+	return c;
+}
+
+static char *buff_get(struct worker *w, uint64_t size) {
+	return pool_get(&w->buffs[buff_class(size)]);
+}
+
+static void buff_put(struct worker *w, char *buff, uint64_t size) {
+	pool_put(&w->buffs[buff_class(size)], buff);
+}
+/**************************************************************************/
+
+
+
+
+
+
+
+
+/*********************************************************************
+************************* INSTRUMENTATION ****************************
+**********************************************************************/
+static uint64_t instr_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void instr_count(enum counter counter, uint64_t n) {
+	if ( NULL != thread_instr ) {
+		instr_add(&thread_instr->counters[counter], n);
+	}
+}
+
+static uint64_t instr_phase(enum phase phase, uint64_t start) {
+	uint64_t now = instr_now();
+	if ( NULL != thread_instr ) {
+		instr_add(&thread_instr->latency[phase][latency_bucket(now - start)], 1);
+	}
+	return now;
+}
+
+static void instr_add(atomic_uint_least64_t *counter, uint64_t n) {
+	// a single writer needs no read-modify-write instruction, only untorn loads and stores
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static unsigned int latency_bucket(uint64_t nsec) {
+	if ( nsec < (1 << LATENCY_SUB_BITS) ) { // the first buckets are exact
+		return nsec;
+	}
+	
+	// the power of 2, then the top bits under it
+	unsigned int msb = 63 - __builtin_clzll(nsec);
+	unsigned int sub = (nsec >> (msb - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1);
+	return ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + sub;
+}
+
+static uint64_t latency_bucket_max(unsigned int bucket) {
+	if ( bucket < (1 << LATENCY_SUB_BITS) ) {
+		return bucket;
+	}
+	
+	unsigned int msb = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+	uint64_t sub = bucket & ((1 << LATENCY_SUB_BITS) - 1);
+	uint64_t min = (((uint64_t)1 << LATENCY_SUB_BITS) + sub) << (msb - LATENCY_SUB_BITS);
+	return min + ((uint64_t)1 << (msb - LATENCY_SUB_BITS)) - 1;
+}
+
+static void snapshot_instruments(struct instruments_snapshot *total) {
+	memset(total, 0, sizeof(struct instruments_snapshot));
+	
+	for (int w = 0; w < num_workers; w++) {
+		struct instruments *instr = &workers[w].instr;
+		for (unsigned int p = 0; p < PHASES; p++) {
+			for (unsigned int b = 0; b < LATENCY_BUCKETS; b++) {
+				total->latency[p][b] += atomic_load_explicit(&instr->latency[p][b], memory_order_relaxed);
+			}
+		}
+		for (unsigned int c = 0; c < COUNTERS; c++) {
+			total->counters[c] += atomic_load_explicit(&instr->counters[c], memory_order_relaxed);
+		}
+	}
+}
+
+static uint64_t latency_quantile(uint64_t hist[], double quantile) {
+	uint64_t count = 0;
+	for (unsigned int b = 0; b < LATENCY_BUCKETS; b++) {
+		count += hist[b];
+	}
+	if ( count == 0 ) {
+		return 0;
+	}
+	
+	// the first bucket that the rank of the quantile falls into
+	uint64_t rank = (uint64_t)(quantile * (count - 1)) + 1;
+	uint64_t seen = 0;
+	for (unsigned int b = 0; b < LATENCY_BUCKETS; b++) {
+		if ( (seen += hist[b]) >= rank ) {
+			return latency_bucket_max(b);
+		}
+	}
+	return latency_bucket_max(LATENCY_BUCKETS - 1);
+}
+/**************************************************************************/
+
+
+
+
+
+
+
+/*********************************************************************
+************************* TRANSFERS **********************************
+**********************************************************************/
+static enum frame_result complete_frame(uint32_t flags, const struct pcc_part_header *part, uint64_t *size,
+                                        uint64_t *printable_chars, uint64_t pcc_current[]) {
+	
+	if ( flags & PCC_FRAME_PART ) {
+		if ( flags & PCC_FRAME_COMMIT ) {
+			return FRAME_INVALID;
+		}
+		return transfer_add_part(part, *size, *printable_chars, pcc_current);
+		
+	} else if ( flags & PCC_FRAME_COMMIT ) { // the reply and the statistics stand for the whole file
+		if ( *size != 0 || !transfer_commit(part, printable_chars, pcc_current) ) {
+			return FRAME_INVALID;
+		}
+		*size = part->total_size;
+	}
+	
+	return FRAME_FILE;
+}
+
+static void transfers_start(void) {
+	for (unsigned int i = 0; i < TRANSFER_SHARDS; i++) {
+		pthread_mutex_init(&transfer_shards[i].lock, NULL);
+	}
+}
+
+static enum frame_result transfer_add_part(const struct pcc_part_header *part, uint64_t size, uint64_t printable_chars, uint64_t pcc_current[]) {
+	enum frame_result result = FRAME_PART;
+	
+	if ( size > part->total_size || part->offset > part->total_size - size ) { // past the end of the file
+		return FRAME_INVALID;
+	} else if ( size == 0 ) { // nothing to add
+		return FRAME_PART;
+	}
+	
+	struct transfer **bucket = NULL;
+	struct transfer_shard *shard = transfer_shard_of(part->transfer_id, &bucket);
+	pthread_mutex_lock(&shard->lock);
+	struct transfer **link = transfer_find(bucket, part->transfer_id);
+	struct transfer *t = *link;
+	uint64_t now = instr_now();
+	
+	// starting the transfer upon its first part, unless it's a retry of a part of a committed transfer
+	if ( NULL == t ) {
+		for (unsigned int i = 0; i < TRANSFER_COMMITTED; i++) {
+			struct transfer_commit *c = &shard->commits[i];
+			if ( c->committed > 0 && c->id == part->transfer_id && c->total_size == part->total_size &&
+			     now - c->committed <= TRANSFER_IDLE_TIMEOUT * 1000000000ULL ) {
+				goto out;
+			}
+		}
+		if ( atomic_fetch_add(&num_transfers, 1) >= TRANSFER_MAX_OPEN ) {
+			atomic_fetch_sub(&num_transfers, 1);
+			result = FRAME_SHED;
+			goto out;
+		}
+		if ( NULL == (t = calloc(1, sizeof(struct transfer))) ) {
+			print_err("Error: Couldn't allocate a transfer", true);
+		}
+		t->id = part->transfer_id;
+		t->total_size = part->total_size;
+		*link = t;
+	}
+	t->last_active = now;
+	
+	if ( t->total_size != part->total_size ) {
+		result = FRAME_INVALID;
+		goto out;
+	}
+	
+	// the first range starting at or after the part, which may only be a retry of it, and the range
+	// before it, which must end by the start of the part
+	uint64_t lo = 0, hi = t->num_ranges;
+	while ( lo < hi ) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if ( t->ranges[mid].offset < part->offset ) lo = mid + 1;
+		else hi = mid;
+	}
+	if ( lo < t->num_ranges && t->ranges[lo].offset == part->offset && t->ranges[lo].size == size ) { // a retry of a part already counted
+		goto out;
+	} else if ( (lo < t->num_ranges && t->ranges[lo].offset < part->offset + size) ||
+	            (lo > 0 && t->ranges[lo - 1].offset + t->ranges[lo - 1].size > part->offset) ) {
+		result = FRAME_INVALID;
+		goto out;
+	} else if ( t->num_ranges == TRANSFER_MAX_RANGES ) {
+		result = FRAME_SHED;
+		goto out;
+	}
+	
+	// remembering the range in its place, and adding its counts
+	if ( t->num_ranges == t->ranges_size ) {
+		t->ranges_size = (t->ranges_size > 0) ? 2 * t->ranges_size : 8;
+		if ( NULL == (t->ranges = realloc(t->ranges, t->ranges_size * sizeof(struct transfer_range))) ) {
+			print_err("Error: Couldn't allocate the ranges of a transfer", true);
+		}
+	}
+	memmove(&t->ranges[lo + 1], &t->ranges[lo], (t->num_ranges - lo) * sizeof(struct transfer_range));
+	t->ranges[lo].offset = part->offset;
+	t->ranges[lo].size = size;
+	t->num_ranges++;
+	t->received += size;
+	t->printable_chars += printable_chars;
+	for (unsigned int i = 0; i < CHARS_RANGE; i++) {
+		t->pcc[i] += pcc_current[i];
+	}
+	
+out:
+	pthread_mutex_unlock(&shard->lock);
+	return result;
+}
+
+static bool transfer_commit(const struct pcc_part_header *part, uint64_t *printable_chars, uint64_t pcc_current[]) {
+	
+	if ( part->total_size == 0 ) { // an empty file has no parts at all
+		*printable_chars = 0;
+		return true;
+	}
+	
+	struct transfer **bucket = NULL;
+	struct transfer_shard *shard = transfer_shard_of(part->transfer_id, &bucket);
+	pthread_mutex_lock(&shard->lock);
+	struct transfer **link = transfer_find(bucket, part->transfer_id);
+	struct transfer *t = *link;
+	bool valid = (NULL != t) && t->total_size == part->total_size && t->received == t->total_size;
+	
+	if ( valid ) {
+		*printable_chars = t->printable_chars;
+		memcpy(pcc_current, t->pcc, CHARS_RANGE * sizeof(uint64_t));
+		transfer_free(link);
+		
+		// remembering the commit, in place of the oldest one
+		struct transfer_commit *c = &shard->commits[shard->next_commit];
+		c->id = part->transfer_id;
+		c->total_size = part->total_size;
+		c->committed = instr_now();
+		shard->next_commit = (shard->next_commit + 1) % TRANSFER_COMMITTED;
+	}
+	
+	pthread_mutex_unlock(&shard->lock);
+	return valid;
+}
+
+static struct transfer_shard *transfer_shard_of(uint64_t id, struct transfer ***bucket) {
+	uint64_t mixed = id * PCC_HASH_PRIME1; // the IDs are chosen by the clients, so their bits are mixed first
+	mixed ^= mixed >> 32;
+	
+	struct transfer_shard *shard = &transfer_shards[mixed & (TRANSFER_SHARDS - 1)];
+	*bucket = &shard->buckets[(mixed >> 4) & (TRANSFER_BUCKETS - 1)];
+	return shard;
+}
+
+static struct transfer **transfer_find(struct transfer **bucket, uint64_t id) {
+	struct transfer **link = bucket;
+	while ( NULL != *link && (*link)->id != id ) {
+		link = &(*link)->next;
+	}
+	return link;
+}
+
+static void transfer_free(struct transfer **link) {
+	struct transfer *t = *link;
+	*link = t->next;
+	atomic_fetch_sub(&num_transfers, 1);
+	
+	free(t->ranges);
+	free(t);
+}
+
+static void transfers_sweep(void) {
+	for (unsigned int i = 0; i < TRANSFER_SHARDS; i++) {
+		struct transfer_shard *shard = &transfer_shards[i];
+		pthread_mutex_lock(&shard->lock);
+		uint64_t now = instr_now();
+		for (unsigned int j = 0; j < TRANSFER_BUCKETS; j++) {
+			struct transfer **link = &shard->buckets[j];
+			while ( NULL != *link ) {
+				if ( now - (*link)->last_active > TRANSFER_IDLE_TIMEOUT * 1000000000ULL ) { // the client gave up on it
+					transfer_free(link);
+				} else {
+					link = &(*link)->next;
+				}
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+/**************************************************************************/
+
+
+
+
+
+
+
+/*********************************************************************
+************************* DEDUP CACHE ********************************
+**********************************************************************/
+static void cache_start(void) {
+	if ( cache_capacity == 0 ) {
+		return;
+	}
+	
+	if ( NULL == (cache_shards = aligned_alloc(PCC_CACHE_LINE_SIZE, CACHE_SHARDS * sizeof(struct cache_shard))) ) {
+		print_err("Error: Couldn't allocate the dedup cache", true);
+	}
+	memset(cache_shards, 0, CACHE_SHARDS * sizeof(struct cache_shard));
+	
+	for (unsigned int i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache_shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->capacity = (cache_capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
+		for (shard->nbuckets = 1; shard->nbuckets < shard->capacity; shard->nbuckets *= 2);
+		if ( NULL == (shard->buckets = calloc(shard->nbuckets, sizeof(struct cache_entry*))) ) {
+			print_err("Error: Couldn't allocate the dedup cache", true);
+		}
+	}
+}
+
+static struct cache_shard *cache_shard_of(uint64_t hash) {
+	return &cache_shards[hash & (CACHE_SHARDS - 1)];
+}
+
+static bool cache_lookup(uint64_t hash, uint64_t size, uint64_t *printable_chars, uint64_t pcc_current[]) {
+	if ( NULL == cache_shards ) { // no cache, every lookup misses
+		instr_count(COUNTER_CACHE_MISSES, 1);
+		return false;
+	}
+	
+	struct cache_shard *shard = cache_shard_of(hash);
+	struct cache_entry *e = NULL;
+	
+	pthread_mutex_lock(&shard->lock);
+	for (e = shard->buckets[(hash >> 4) & (shard->nbuckets - 1)]; e != NULL && (e->hash != hash || e->size != size); e = e->bucket_next);
+	
+	if ( e ) {
+		*printable_chars = e->printable_chars;
+		memcpy(pcc_current, e->pcc, CHARS_RANGE * sizeof(uint64_t));
+		
+		// moving it to the front of the LRU list
+		if ( e != shard->lru_head ) {
+			e->lru_prev->lru_next = e->lru_next;
+			if ( e->lru_next ) e->lru_next->lru_prev = e->lru_prev;
+			else shard->lru_tail = e->lru_prev;
+			e->lru_prev = NULL;
+			e->lru_next = shard->lru_head;
+			shard->lru_head->lru_prev = e;
+			shard->lru_head = e;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+	
+	instr_count(e ? COUNTER_CACHE_HITS : COUNTER_CACHE_MISSES, 1);
+	return e != NULL;
+}
+
+static void cache_insert(uint64_t hash, uint64_t computed, uint64_t size, uint64_t printable_chars, const uint64_t pcc_current[]) {
+	if ( NULL == cache_shards ) {
+		return;
+	}
+	
+	struct cache_shard *shard = cache_shard_of(hash);
+	struct cache_entry *e = NULL, **link = NULL;
+	
+	pthread_mutex_lock(&shard->lock);
+	if ( hash != computed ) {
+		shard->rejections++;
+		goto out;
+	}
+	
+	for (e = shard->buckets[(hash >> 4) & (shard->nbuckets - 1)]; e != NULL && (e->hash != hash || e->size != size); e = e->bucket_next);
+	if ( e ) { // another connection sent the same body first
+		goto out;
+	}
+	
+	// making room by unlinking the least recently used entry, whose memory is reused
+	if ( shard->entries == shard->capacity ) {
+		e = shard->lru_tail;
+		for (link = &shard->buckets[(e->hash >> 4) & (shard->nbuckets - 1)]; *link != e; link = &(*link)->bucket_next);
+		*link = e->bucket_next;
+		shard->lru_tail = e->lru_prev;
+		if ( shard->lru_tail ) shard->lru_tail->lru_next = NULL;
+		else shard->lru_head = NULL;
+		shard->entries--;
+		shard->evictions++;
+	} else if ( NULL == (e = malloc(sizeof(struct cache_entry))) ) {
+		print_err("Error: Couldn't allocate an entry of the dedup cache", true);
+	}
+	
+	e->hash = hash;
+	e->size = size;
+	e->printable_chars = printable_chars;
+	memcpy(e->pcc, pcc_current, CHARS_RANGE * sizeof(uint64_t));
+	link = &shard->buckets[(hash >> 4) & (shard->nbuckets - 1)];
+	e->bucket_next = *link;
+	*link = e;
+	e->lru_prev = NULL;
+	e->lru_next = shard->lru_head;
+	if ( shard->lru_head ) shard->lru_head->lru_prev = e;
+	else shard->lru_tail = e;
+	shard->lru_head = e;
+	shard->entries++;
+	shard->insertions++;
+	
+out:
+	pthread_mutex_unlock(&shard->lock);
+}
+
+static void snapshot_cache(struct cache_snapshot *total) {
+	memset(total, 0, sizeof(struct cache_snapshot));
+	if ( NULL == cache_shards ) {
+		return;
+	}
+	
+	for (unsigned int i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache_shards[i];
+		pthread_mutex_lock(&shard->lock);
+		total->entries += shard->entries;
+		total->capacity += shard->capacity;
+		total->memory += sizeof(struct cache_shard) + shard->nbuckets * sizeof(struct cache_entry*) + shard->entries * sizeof(struct cache_entry);
+		total->insertions += shard->insertions;
+		total->evictions += shard->evictions;
+		total->rejections += shard->rejections;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+/**************************************************************************/
+
+
+
+
+
+
+
+/*********************************************************************
+************************* ADMISSION AND DEADLINES ********************
+**********************************************************************/
+static bool admit_upload(uint64_t size) {
+	if ( max_upload_size > 0 && size > max_upload_size ) {
+		return false;
+	} else if ( inflight_budget == 0 ) {
+		return true;
+	}
+	
+	// the room left is compared against, rather than the sum, which a huge declared size would wrap around
+	uint64_t inflight = atomic_load_explicit(&inflight_bytes, memory_order_relaxed);
+	do {
+		uint64_t room = (inflight < inflight_budget) ? inflight_budget - inflight : 0; // an upload alone may overrun the budget
+		if ( inflight > 0 && size > room ) {
+			return false;
+		}
+	} while ( !atomic_compare_exchange_weak_explicit(&inflight_bytes, &inflight, inflight + size, memory_order_relaxed, memory_order_relaxed) );
+	
+	return true;
+}
+
+static void release_upload(uint64_t size) {
+	if ( inflight_budget > 0 && size > 0 ) {
+		atomic_fetch_sub(&inflight_bytes, size);
+		admission_wake();
+	}
+}
+
+static bool accepting_allowed(void) {
+	return (max_connections == 0 || open_connections < max_connections) &&
+	       (inflight_budget == 0 || atomic_load_explicit(&inflight_bytes, memory_order_relaxed) < inflight_budget);
+}
+
+static bool reserve_connection(void) {
+	if ( inflight_budget > 0 && atomic_load(&inflight_bytes) >= inflight_budget ) {
+		return false;
+	}
+	
+	int open = atomic_load(&open_connections);
+	do {
+		if ( max_connections > 0 && open >= max_connections ) {
+			return false;
+		}
+	} while ( !atomic_compare_exchange_weak(&open_connections, &open, open + 1) );
+	
+	return true;
+}
+
+static void release_connection(void) {
+	atomic_fetch_sub(&open_connections, 1);
+	if ( max_connections > 0 ) {
+		admission_wake();
+	}
+}
+
+static void admission_wake(void) {
+	uint64_t wake = 1;
+	
+	// a worker sets its flag before checking for room one last time, so either it sees the room made, or it's woken up
+	for (int i = 0; i < num_workers; i++) {
+		if ( atomic_load(&workers[i].admission_waiting) && atomic_exchange(&workers[i].admission_waiting, false) ) {
+			if ( sizeof(uint64_t) != write(workers[i].wakefd, &wake, sizeof(uint64_t)) ) {
+				print_err("Error: Couldn't wake up a worker", true);
+			}
+		}
+	}
+}
+
+static void shed_connection(struct worker *w, int connfd) {
+	uint64_t reply_n = htobe64(PCC_REPLY_SHED);
+	struct timeval linger = { .tv_sec = SHED_DISCARD_MS / 1000, .tv_usec = (SHED_DISCARD_MS % 1000) * 1000 };
+	uint64_t linger_end = instr_now() + SHED_DISCARD_MS * 1000000ULL;
+	uint64_t discarded = 0;
+	ssize_t nread = 0;
+	
+	instr_count(COUNTER_SHED, 1);
+	if ( CLIENT_TERMINATED == send_data(connfd, &reply_n, PCC_REPLY_SIZE) ) {
+		return;
+	}
+	shutdown(connfd, SHUT_WR); // the refusal is all the client gets, so it's told right away
+	
+	char *discard = buff_get(w, STREAM_BUFF_SIZE);
+	setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &linger, sizeof(linger));
+	while ( instr_now() < linger_end && discarded < SHED_DISCARD_SIZE ) {
+		instr_count(COUNTER_SYSCALLS, 1);
+		if ( 0 > (nread = read(connfd, discard, STREAM_BUFF_SIZE)) && errno == EINTR ) { // SIG_INT handler, simply redo the reading
+			continue;
+		} else if ( nread <= 0 ) { // the client closed, or the linger ran out
+			break;
+		}
+		discarded += nread;
+	}
+	buff_put(w, discard, STREAM_BUFF_SIZE);
+}
+
+static void set_socket_timeouts(int connfd) {
+	uint64_t timeout = (idle_timeout > 0) ? idle_timeout : transfer_timeout;
+	if ( timeout == 0 ) {
+		return;
+	}
+	
+	struct timeval tv = { .tv_sec = timeout / 1000000000ULL, .tv_usec = (timeout % 1000000000ULL) / 1000 };
+	if ( -1 == setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) || -1 == setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) ) {
+		print_err("Error: Couldn't set the timeouts of a connection", true);
+	}
+}
+
+static bool deadline_passed(void) {
+	if ( thread_deadline == 0 || instr_now() < thread_deadline ) {
+		return false;
+	}
+	
+	handle_connection_timeout();
+	return true;
+}
+
+static uint64_t conn_deadline(struct conn *conn) {
+	uint64_t deadline = UINT64_MAX;
+	
+	if ( conn->state == CONN_SHED ) { // a refused upload only lingers
+		return conn->transfer_start + SHED_LINGER * 1000000000ULL;
+	}
+	if ( idle_timeout > 0 ) {
+		deadline = conn->last_active + idle_timeout;
+	}
+	if ( transfer_timeout > 0 && conn->transfer_start > 0 && conn->transfer_start + transfer_timeout < deadline ) {
+		deadline = conn->transfer_start + transfer_timeout;
+	}
+	
+	return deadline;
+}
+
+static bool conn_admit(struct conn *conn) {
+	if ( admit_upload(conn->frame_size) ) {
+		conn->admitted = conn->frame_size;
+		return true;
+	}
+	
+	conn_shed(conn);
+	return false;
+}
+
+static void conn_shed(struct conn *conn) {
+	// the refusal is queued after the replies to the previous frames, whatever the frame asked for
+	uint64_t reply_n = htobe64(PCC_REPLY_SHED);
+	if ( conn->out_len == conn->out_sent ) {
+		conn->reply_start = instr_now();
+	}
+	memcpy(conn->out + conn->out_len, &reply_n, PCC_REPLY_SIZE);
+	conn->out_len += PCC_REPLY_SIZE;
+	conn->transfer_start = instr_now(); // the start of the linger
+	conn->state = CONN_SHED;
+	instr_count(COUNTER_SHED, 1);
+}
+
+static void conn_miss(struct conn *conn) {
+	uint64_t reply_n = htobe64(PCC_REPLY_MISS);
+	if ( conn->out_len == conn->out_sent ) {
+		conn->reply_start = instr_now();
+	}
+	memcpy(conn->out + conn->out_len, &reply_n, PCC_REPLY_SIZE);
+	conn->out_len += PCC_REPLY_SIZE;
+	conn->transfer_start = 0;
+	conn->header_read = 0;
+	conn->state = CONN_READ_FRAME_HEADER;
+}
+
+static void timers_start(struct worker *w) {
+	struct itimerspec every_tick = { .it_interval = { .tv_nsec = TIMER_TICK_MS * 1000000L }, .it_value = { .tv_nsec = TIMER_TICK_MS * 1000000L } };
+	
+	memset(w->timers.slots, 0, sizeof(w->timers.slots));
+	w->timers.tick = instr_now() / (TIMER_TICK_MS * 1000000ULL);
+	if ( -1 == (w->timers.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) || -1 == timerfd_settime(w->timers.fd, 0, &every_tick, NULL) ) {
+		print_err("Error: Couldn't create the timer of a worker", true);
+	}
+}
+
+static void timer_schedule(struct worker *w, struct conn *conn, uint64_t now) {
+	struct timer_wheel *wheel = &w->timers;
+	const uint64_t tick_nsec = TIMER_TICK_MS * 1000000ULL;
+	uint64_t recheck = SHED_LINGER * 1000000000ULL; // the shortest timeout
+	
+	if ( idle_timeout > 0 && idle_timeout < recheck ) recheck = idle_timeout;
+	if ( transfer_timeout > 0 && transfer_timeout < recheck ) recheck = transfer_timeout;
+	uint64_t when = conn_deadline(conn);
+	if ( when > now + recheck ) {
+		when = now + recheck;
+	}
+	
+	// rounding up to a tick, within a single turn of the wheel
+	uint64_t tick = (when + tick_nsec - 1) / tick_nsec;
+	if ( tick <= wheel->tick ) tick = wheel->tick + 1;
+	if ( tick >= wheel->tick + TIMER_SLOTS ) tick = wheel->tick + TIMER_SLOTS - 1;
+	
+	struct conn **slot = &wheel->slots[tick % TIMER_SLOTS];
+	conn->timer_tick = tick;
+	conn->timer_prev = NULL;
+	conn->timer_next = *slot;
+	if ( NULL != *slot ) {
+		(*slot)->timer_prev = conn;
+	}
+	*slot = conn;
+	conn->timer_armed = true;
+}
+
+static void timer_cancel(struct worker *w, struct conn *conn) {
+	if ( !conn->timer_armed ) {
+		return;
+	}
+	
+	if ( NULL != conn->timer_prev ) {
+		conn->timer_prev->timer_next = conn->timer_next;
+	} else {
+		w->timers.slots[conn->timer_tick % TIMER_SLOTS] = conn->timer_next;
+	}
+	if ( NULL != conn->timer_next ) {
+		conn->timer_next->timer_prev = conn->timer_prev;
+	}
+	conn->timer_armed = false;
+}
+
+static void timers_advance(struct worker *w, bool shut_down) {
+	struct timer_wheel *wheel = &w->timers;
+	uint64_t now = instr_now();
+	uint64_t now_tick = now / (TIMER_TICK_MS * 1000000ULL);
+	
+	// a late tick checks every slot it skipped, though a full turn of the wheel already covers all of them
+	if ( now_tick - wheel->tick > TIMER_SLOTS ) {
+		wheel->tick = now_tick - TIMER_SLOTS;
+	}
+	
+	while ( wheel->tick < now_tick ) {
+		wheel->tick++;
+		struct conn *conn = wheel->slots[wheel->tick % TIMER_SLOTS];
+		wheel->slots[wheel->tick % TIMER_SLOTS] = NULL;
+		
+		while ( NULL != conn ) {
+			struct conn *next = conn->timer_next;
+			conn->timer_armed = false;
+			
+			if ( now < conn_deadline(conn) ) { // it made progress since it was scheduled
+				timer_schedule(w, conn, now);
+			} else {
+				if ( conn->state != CONN_SHED ) { // a refused upload simply lingered long enough
+					handle_connection_timeout();
+				}
+				if ( shut_down ) {
+					conn->timed_out = true;
+					shutdown(conn->fd, SHUT_RDWR);
+				} else {
+					conn_close(w, conn);
+				}
+			}
+			conn = next;
+		}
+	}
+}
+/**********************************************************************/
+
+
+
+
+
+
+
+/*********************************************************************
+************************* ADMIN ENDPOINT *****************************
+**********************************************************************/
+static void admin_start(void) {
+	int adminfd = -1;
+	
+	if ( -1 == (adminfd = listen_unix_socket(admin_path, &admin_ino)) ) {
+		print_err("Error: Couldn't listen on the admin socket passed to `-a`", true);
+	}
+	
+	// the admin thread lives until the process exits
+	pthread_t admin;
+	if ( 0 != (errno = pthread_create(&admin, NULL, admin_main, (void *)(intptr_t)adminfd)) ) {
+		print_err("Error: Couldn't create the admin thread", true);
+	}
+	pthread_detach(admin);
+}
+
+static void *admin_main(void *arg) {
+	int adminfd = (int)(intptr_t)arg;
+	int connfd = -1;
+	
+	while ( true ) {
+		if ( -1 == (connfd = accept(adminfd, NULL, NULL)) ) {
+			if ( errno == EINTR || errno == ECONNABORTED ) {
+				continue;
+			}
+			print_err("Error: Couldn't accept a connection on the admin socket", false);
+			return NULL;
+		}
+		admin_report(connfd);
+		close_safe(connfd);
+	}
+}
+
+static void admin_report(int connfd) {
+	static const char *phase_names[PHASES] = { "accept", "header", "body", "reply" };
+	uint64_t pools[BUFF_CLASSES + 1][3] = {{0}}; // the in-use, high-water and capacity counts of the pools, summed over the workers
+	struct stats_snapshot total;
+	struct instruments_snapshot instr;
+	struct cache_snapshot cache;
+	struct timespec now;
+	char report[16384];
+	int len = 0;
+	
+	snapshot_stats(&total);
+	snapshot_instruments(&instr);
+	snapshot_cache(&cache);
+	for (int i = 0; i < num_workers; i++) {
+		for (unsigned int c = 0; c <= BUFF_CLASSES; c++) {
+			struct pool *pool = (c < BUFF_CLASSES) ? &workers[i].buffs[c] : &workers[i].conns;
+			pools[c][0] += atomic_load_explicit(&pool->in_use, memory_order_relaxed);
+			pools[c][1] += atomic_load_explicit(&pool->high_water, memory_order_relaxed);
+			pools[c][2] += atomic_load_explicit(&pool->capacity, memory_order_relaxed);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double uptime = (now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec) / 1e9;
+	
+	// the counters first, then the statistics in the same format as upon exiting
+	len += snprintf(report + len, sizeof(report) - len, "uptime: %.3f sec\n", uptime);
+	len += snprintf(report + len, sizeof(report) - len, "open connections: %d\n", (int)open_connections);
+	len += snprintf(report + len, sizeof(report) - len, "open transfers: %lu\n", (uint64_t)atomic_load(&num_transfers));
+	len += snprintf(report + len, sizeof(report) - len, "files: %lu\n", total.files);
+	len += snprintf(report + len, sizeof(report) - len, "bytes: %lu\n", total.bytes);
+	len += snprintf(report + len, sizeof(report) - len, "throughput: %.0f bytes/sec\n", (uptime > 0) ? total.bytes / uptime : 0);
+	len += snprintf(report + len, sizeof(report) - len, "connections: %lu\n", instr.counters[COUNTER_CONNECTIONS]);
+	len += snprintf(report + len, sizeof(report) - len, "aborted: %lu\n", instr.counters[COUNTER_ABORTED]);
+	len += snprintf(report + len, sizeof(report) - len, "timeouts: %lu\n", instr.counters[COUNTER_TIMEOUTS]);
+	len += snprintf(report + len, sizeof(report) - len, "shed: %lu\n", instr.counters[COUNTER_SHED]);
+	len += snprintf(report + len, sizeof(report) - len, "in-flight bytes: %lu\n", (uint64_t)atomic_load_explicit(&inflight_bytes, memory_order_relaxed));
+	len += snprintf(report + len, sizeof(report) - len, "bytes received: %lu\n", instr.counters[COUNTER_BYTES]);
+	if ( NULL != checkpoint_path ) {
+		len += snprintf(report + len, sizeof(report) - len, "checkpoint generation: %lu\n", checkpoint_generation);
+	}
+	len += snprintf(report + len, sizeof(report) - len, "syscalls: %lu (%.1f per MB)\n", instr.counters[COUNTER_SYSCALLS],
+	                (instr.counters[COUNTER_BYTES] > 0) ? instr.counters[COUNTER_SYSCALLS] / (instr.counters[COUNTER_BYTES] / 1e6) : 0);
+	len += snprintf(report + len, sizeof(report) - len, "dedup cache: entries %lu capacity %lu memory %lu bytes hits %lu misses %lu insertions %lu evictions %lu rejections %lu\n",
+	                cache.entries, cache.capacity, cache.memory, instr.counters[COUNTER_CACHE_HITS], instr.counters[COUNTER_CACHE_MISSES],
+	                cache.insertions, cache.evictions, cache.rejections);
+	
+	// the latency of each phase, in microseconds
+	for (unsigned int p = 0; p < PHASES; p++) {
+		uint64_t count = 0;
+		for (unsigned int b = 0; b < LATENCY_BUCKETS; b++) {
+			count += instr.latency[p][b];
+		}
+		len += snprintf(report + len, sizeof(report) - len, "latency %s: count %lu p50 %.1f us p90 %.1f us p99 %.1f us max %.1f us\n",
+		                phase_names[p], count, latency_quantile(instr.latency[p], 0.5) / 1e3, latency_quantile(instr.latency[p], 0.9) / 1e3,
+		                latency_quantile(instr.latency[p], 0.99) / 1e3, latency_quantile(instr.latency[p], 1.0) / 1e3);
+	}
+	
+	// the pools, the high-water marks being summed per worker
+	for (unsigned int c = 0; c <= BUFF_CLASSES; c++) {
+		len += (c < BUFF_CLASSES) ? snprintf(report + len, sizeof(report) - len, "pool buffers %lu: ", buff_class_sizes[c])
+		                          : snprintf(report + len, sizeof(report) - len, "pool connections: ");
+		len += snprintf(report + len, sizeof(report) - len, "in use %lu high-water %lu capacity %lu\n", pools[c][0], pools[c][1], pools[c][2]);
+	}
+	for (unsigned int i = 0; i < CHARS_RANGE; i++) {
+		len += snprintf(report + len, sizeof(report) - len, "char '%c' : %lu times\n", (char)(i + 32), total.pcc[i]);
+	}
+	
+	// a reader that went away is simply dropped
+	for (int sent = 0, nsent = 0; sent < len; sent += nsent) {
+		if ( 0 >= (nsent = send(connfd, report + sent, len - sent, MSG_NOSIGNAL)) ) {
+			if ( nsent < 0 && errno == EINTR ) {
+				nsent = 0;
+				continue;
+			}
+			return;
+		}
+	}
+}
+/**************************************************************************/
+
+
+
+
+
+
+
+/*********************************************************************
+************************* PERSISTENCE ********************************
+**********************************************************************/
+static void persistence_start(bool restore) {
+	int fd = -1;
+	struct stat sb;
+	
+	// a new (or short) file is extended to both slots, which are then invalid until written
+	if ( -1 == (fd = open(checkpoint_path, O_RDWR | O_CREAT, 0644)) || -1 == fstat(fd, &sb) ) {
+		print_err("Error: Couldn't open the checkpoint file passed to `-C`", true);
+	}
+	if ( sb.st_size < 2 * CHECKPOINT_SLOT_SIZE && -1 == ftruncate(fd, 2 * CHECKPOINT_SLOT_SIZE) ) {
+		print_err("Error: Couldn't extend the checkpoint file", true);
+	}
+	if ( MAP_FAILED == (checkpoint_slots = mmap(NULL, 2 * CHECKPOINT_SLOT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ) {
+		print_err("Error: Couldn't map the checkpoint file", true);
+	}
+	close_safe(fd); // the mapping holds on to the file
+	
+	// restoring the newest valid slot, if any (otherwise, the journal of the first epoch holds everything)
+	struct checkpoint *slots[2] = { checkpoint_slots, (struct checkpoint*)((char*)checkpoint_slots + CHECKPOINT_SLOT_SIZE) };
+	struct checkpoint *newest = NULL;
+	for (int i = 0; i < 2; i++) {
+		if ( checkpoint_valid(slots[i]) && (NULL == newest || slots[i]->generation > newest->generation) ) {
+			newest = slots[i];
+		}
+	}
+	uint64_t epoch = 0, offset = JOURNAL_HEADER_SIZE;
+	if ( NULL != newest ) {
+		if ( restore ) {
+			pcc_shard_add(&inherited, newest->pcc, newest->files, newest->bytes);
+		}
+		checkpoint_generation = newest->generation;
+		epoch = newest->journal_epoch;
+		offset = newest->journal_offset;
+	}
+	
+	// replaying the journal past the slot, unless it's of another epoch (all of which the slot already holds). The
+	// workers may be counting already, so none of them appends to the journal before it's ready
+	if ( journal_sync_ms >= 0 ) {
+		char journal_path[PATH_MAX];
+		uint64_t header[2] = { 0, 0 };
+		snprintf(journal_path, sizeof(journal_path), "%s.journal", checkpoint_path);
+		pthread_mutex_lock(&journal_lock);
+		if ( -1 == (journal_fd = open(journal_path, O_RDWR | O_CREAT | O_APPEND, 0644)) ) {
+			print_err("Error: Couldn't open the journal", true);
+		}
+		if ( !restore ) { // the statistics handed over hold the whole journal
+			journal_reset(epoch + 1);
+		} else if ( JOURNAL_HEADER_SIZE == pread(journal_fd, header, JOURNAL_HEADER_SIZE, 0) && header[0] == JOURNAL_MAGIC && header[1] == epoch ) {
+			journal_epoch = epoch;
+			journal_replay(&inherited, offset);
+		} else {
+			journal_reset(epoch);
+		}
+		pthread_mutex_unlock(&journal_lock);
+	}
+	
+	// the persistence thread lives until the process exits
+	pthread_t persistence;
+	if ( 0 != (errno = pthread_create(&persistence, NULL, persistence_main, NULL)) ) {
+		print_err("Error: Couldn't create the persistence thread", true);
+	}
+	pthread_detach(persistence);
+}
+
+static void *persistence_main(void *arg) {
+	(void)arg;
+	uint64_t period_ms = checkpoint_interval_ms; // the thread wakes up for whichever of the two is due sooner
+	if ( journal_sync_ms > 0 && (uint64_t)journal_sync_ms < period_ms ) {
+		period_ms = journal_sync_ms;
+	}
+	struct timespec period = { .tv_sec = period_ms / 1000, .tv_nsec = (period_ms % 1000) * 1000000L };
+	uint64_t last_checkpoint = instr_now();
+	
+	while ( true ) {
+		nanosleep(&period, NULL);
+		
+		// syncing the journal in batches, off the path of the workers
+		if ( journal_sync_ms > 0 && -1 == fdatasync(journal_fd) ) {
+			print_err("Error: Couldn't sync the journal", false);
+		}
+		if ( instr_now() - last_checkpoint >= checkpoint_interval_ms * 1000000ULL ) {
+			checkpoint_write();
+			last_checkpoint = instr_now();
+		}
+	}
+	
+	return NULL;
+}
+
+static void checkpoint_write(void) {
+	struct stats_snapshot total;
+	bool rotate = false; // whether the journal starts over along with this checkpoint
+	
+	pthread_mutex_lock(&checkpoint_lock);
+	struct checkpoint *newest = (struct checkpoint*)((char*)checkpoint_slots + (checkpoint_generation % 2) * CHECKPOINT_SLOT_SIZE);
+	struct checkpoint *slot = (struct checkpoint*)((char*)checkpoint_slots + ((checkpoint_generation + 1) % 2) * CHECKPOINT_SLOT_SIZE);
+	
+	// the snapshot holds exactly the records before the end of the journal, since both are updated under the lock
+	if ( journal_fd != -1 ) {
+		pthread_mutex_lock(&journal_lock);
+	}
+	snapshot_stats(&total);
+	uint64_t epoch = journal_epoch, offset = journal_size;
+	if ( journal_fd != -1 && journal_size > JOURNAL_ROTATE_SIZE ) {
+		rotate = true; // the lock is held until the journal starts over, so nothing is appended to the old one meanwhile
+		epoch++;
+		offset = JOURNAL_HEADER_SIZE;
+	} else if ( journal_fd != -1 ) {
+		pthread_mutex_unlock(&journal_lock);
+	}
+	
+	// nothing was counted since the newest slot
+	if ( !rotate && checkpoint_valid(newest) && newest->files == total.files && newest->bytes == total.bytes && newest->journal_offset == offset ) {
+		pthread_mutex_unlock(&checkpoint_lock);
+		return;
+	}
+	
+	slot->magic = 0; // invalid until it's complete, should the write be torn
+	slot->version = CHECKPOINT_VERSION;
+	slot->generation = checkpoint_generation + 1;
+	slot->journal_epoch = epoch;
+	slot->journal_offset = offset;
+	slot->files = total.files;
+	slot->bytes = total.bytes;
+	memcpy(slot->pcc, total.pcc, sizeof(slot->pcc));
+	slot->checksum = crc32(0, (const Bytef*)&slot->generation, sizeof(struct checkpoint) - offsetof(struct checkpoint, generation));
+	slot->magic = CHECKPOINT_MAGIC;
+	if ( -1 == msync(slot, CHECKPOINT_SLOT_SIZE, MS_SYNC) ) {
+		print_err("Error: Couldn't sync the checkpoint file", false);
+	} else {
+		checkpoint_generation++;
+	}
+	
+	// once the slot is synced, the old journal is no longer needed (a crash before it starts over leaves a
+	// journal of the previous epoch, which is ignored)
+	if ( rotate ) {
+		journal_reset(epoch);
+		pthread_mutex_unlock(&journal_lock);
+	}
+	pthread_mutex_unlock(&checkpoint_lock);
+}
+
+static bool checkpoint_valid(const struct checkpoint *slot) {
+	return slot->magic == CHECKPOINT_MAGIC && slot->version == CHECKPOINT_VERSION &&
+	       slot->checksum == crc32(0, (const Bytef*)&slot->generation, sizeof(struct checkpoint) - offsetof(struct checkpoint, generation));
+}
+
+static void journal_append(uint64_t pcc_current[], uint64_t files, uint64_t bytes) {
+	char record[JOURNAL_RECORD_MAX_SIZE];
+	uint64_t counts[2] = { files, bytes };
+	ssize_t nwritten = 0;
+	
+	// the size and the checksum of the payload, then the counts and the encoded histogram
+	memcpy(record + 8, counts, sizeof(counts));
+	uint32_t size = sizeof(counts) + pcc_encode_histogram(record + 8 + sizeof(counts), pcc_current, CHARS_RANGE);
+	uint32_t checksum = crc32(0, (const Bytef*)record + 8, size);
+	memcpy(record, &size, 4);
+	memcpy(record + 4, &checksum, 4);
+	
+	for (uint64_t totalwritten = 0; totalwritten < 8 + size; totalwritten += nwritten) {
+		if ( 0 > (nwritten = write(journal_fd, record + totalwritten, 8 + size - totalwritten)) ) {
+			if ( errno == EINTR ) {
+				nwritten = 0;
+				continue;
+			}
+			print_err("Error: Couldn't append to the journal", true);
+		}
+	}
+	journal_size += 8 + size;
+	
+	if ( journal_sync_ms == 0 && -1 == fdatasync(journal_fd) ) {
+		print_err("Error: Couldn't sync the journal", true);
+	}
+}
+
+static void journal_replay(struct pcc_shard *shard, uint64_t offset) {
+	char record[JOURNAL_RECORD_MAX_SIZE];
+	uint64_t pcc[CHARS_RANGE];
+	uint64_t counts[2];
+	uint32_t prefix[2]; // the size and the checksum of the payload
+	struct stat sb;
+	
+	while ( 8 == pread(journal_fd, prefix, 8, offset) ) {
+		if ( prefix[0] < sizeof(counts) + PCC_HISTOGRAM_BITMAP_SIZE(CHARS_RANGE) || prefix[0] > JOURNAL_RECORD_MAX_SIZE - 8 ||
+		     prefix[0] != pread(journal_fd, record, prefix[0], offset + 8) || prefix[1] != crc32(0, (const Bytef*)record, prefix[0]) ||
+		     0 != pcc_decode_histogram(record + sizeof(counts), prefix[0] - sizeof(counts), pcc, CHARS_RANGE) ) {
+			break; // torn by a crash
+		}
+		
+		memcpy(counts, record, sizeof(counts));
+		pcc_shard_add(shard, pcc, counts[0], counts[1]);
+		offset += 8 + prefix[0];
+	}
+	
+	// appending right after the last whole record
+	if ( 0 == fstat(journal_fd, &sb) && (uint64_t)sb.st_size > offset && -1 == ftruncate(journal_fd, offset) ) {
+		print_err("Error: Couldn't cut off the end of the journal", true);
+	}
+	journal_size = offset;
+}
+
+static void journal_reset(uint64_t epoch) {
+	uint64_t header[2] = { JOURNAL_MAGIC, epoch };
+	
+	// O_APPEND writes the header at the start of the emptied file
+	if ( -1 == ftruncate(journal_fd, 0) || JOURNAL_HEADER_SIZE != write(journal_fd, header, JOURNAL_HEADER_SIZE) || -1 == fdatasync(journal_fd) ) {
+		print_err("Error: Couldn't start the journal over", true);
+	}
+	journal_epoch = epoch;
+	journal_size = JOURNAL_HEADER_SIZE;
+}
+/**********************************************************************/
+
+
+
+
+
+
+
+/*********************************************************************
+************************* LIFECYCLE **********************************
+**********************************************************************/
+static void signals_start(void) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	
+	// the signals are never delivered asynchronously, but read off the signalfd by the main thread
+	if ( 0 != (errno = pthread_sigmask(SIG_BLOCK, &mask, NULL)) ) {
+		print_err("Error: Couldn't block SIGINT and SIGTERM", true);
+	}
+	if ( -1 == (signal_fd = signalfd(-1, &mask, 0)) ) {
+		print_err("Error: Couldn't create a signalfd", true);
+	}
+	if ( -1 == (done_fd = eventfd(0, 0)) ) {
+		print_err("Error: Couldn't create an eventfd", true);
+	}
+}
+
+static bool lifecycle_run(void) {
+	struct pollfd fds[4];
+	struct signalfd_siginfo info;
+	uint64_t done = 0;
+	char warning[128];
+	uint64_t next_sweep = instr_now() + TRANSFER_SWEEP_INTERVAL * 1000000000ULL;
+	
+	while ( running_workers > 0 || predecessor_fd != -1 ) {
+		uint64_t now = instr_now();
+		
+		// dropping the transfers the clients gave up on, then waking up for the next sweep at the latest
+		if ( now >= next_sweep ) {
+			transfers_sweep();
+			next_sweep = now + TRANSFER_SWEEP_INTERVAL * 1000000000ULL;
+		}
+		int timeout_ms = (next_sweep - now + 999999) / 1000000;
+		
+		// giving up on the connections in flight once the drain took too long
+		if ( drain_deadline > 0 ) {
+			if ( now >= drain_deadline ) {
+				snprintf(warning, sizeof(warning), "Warning: The drain deadline passed, abandoning %d connections in flight", (int)open_connections);
+				errno = ETIMEDOUT;
+				print_err(warning, false);
+				return false;
+			}
+			if ( drain_deadline - now < next_sweep - now ) {
+				timeout_ms = (drain_deadline - now + 999999) / 1000000;
+			}
+		}
+		
+		// the descriptors that are closed (-1) are ignored
+		fds[0] = (struct pollfd){ .fd = signal_fd, .events = POLLIN };
+		fds[1] = (struct pollfd){ .fd = done_fd, .events = POLLIN };
+		fds[2] = (struct pollfd){ .fd = handoff_fd, .events = POLLIN };
+		fds[3] = (struct pollfd){ .fd = predecessor_fd, .events = POLLIN };
+		if ( -1 == poll(fds, 4, timeout_ms) ) {
+			if ( errno == EINTR ) continue;
+			print_err("Error: Couldn't wait for signals", true);
+		}
+		
+		// the first signal drains the server, a second one doesn't wait for the connections in flight
+		if ( (fds[0].revents & POLLIN) && sizeof(info) == read(signal_fd, &info, sizeof(info)) ) {
+			if ( finished ) {
+				snprintf(warning, sizeof(warning), "Warning: Signaled again while draining, abandoning %d connections in flight", (int)open_connections);
+				errno = EINTR;
+				print_err(warning, false);
+				return false;
+			}
+			drain_begin();
+		}
+		if ( fds[1].revents & POLLIN ) {
+			read(done_fd, &done, sizeof(uint64_t));
+		}
+		if ( fds[2].revents & POLLIN ) {
+			handoff_accept();
+		}
+		if ( fds[3].revents & (POLLIN | POLLHUP | POLLERR) ) {
+			handoff_receive_totals();
+		}
+	}
+	
+	return true;
+}
+
+static void drain_begin(void) {
+	uint64_t wake = 1;
+	
+	if ( finished ) {
+		return;
+	}
+	finished = true;
+	drain_deadline = (drain_timeout > 0) ? instr_now() + drain_timeout : 0;
+	
+	// waking up workers waiting on their listening socket or event loop (the listening sockets aren't shut down,
+	// since a successor may be accepting on them)
+	for (int i = 0; i < num_workers; i++) {
+		if ( sizeof(uint64_t) != write(workers[i].wakefd, &wake, sizeof(uint64_t)) ) {
+			print_err("Error: Couldn't wake up a worker", true);
+		}
+	}
+}
+
+static int handoff_connect(int listenfds[]) {
+	int fd = -1;
+	struct sockaddr_un addr;
+	struct handoff_hello hello;
+	char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+	
+	if ( strlen(handoff_path) >= sizeof(addr.sun_path) ) {
+		errno = ENAMETOOLONG;
+		print_err("Error: The path passed to `-H` is too long", true);
+	}
+	if ( -1 == (fd = socket(AF_UNIX, SOCK_STREAM, 0)) ) {
+		print_err("Error: Couldn't open the handoff socket", true);
+	}
+	
+	// no server listens there (or one left its socket behind), so this one starts afresh
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, handoff_path);
+	if ( 0 != connect(fd, (struct sockaddr*) &addr, sizeof(addr)) ) {
+		if ( errno != ENOENT && errno != ECONNREFUSED ) {
+			print_err("Error: Couldn't connect to the handoff socket passed to `-H`", true);
+		}
+		close_safe(fd);
+		return 0;
+	}
+	
+	// the hello, carrying the listening sockets
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+	ssize_t nrecv = recvmsg(fd, &msg, MSG_WAITALL);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if ( nrecv != sizeof(hello) || hello.magic != HANDOFF_MAGIC || NULL == cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	     hello.nfds == 0 || hello.nfds != (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int) ) {
+		errno = EPROTO;
+		print_err("Error: The server at the handoff socket didn't hand its listening sockets over", true);
+	}
+	memcpy(listenfds, CMSG_DATA(cmsg), hello.nfds * sizeof(int));
+	
+	predecessor_fd = fd;
+	return hello.nfds;
+}
+
+static void handoff_accept(void) {
+	int fd = -1;
+	struct handoff_hello hello = { .magic = HANDOFF_MAGIC, .nfds = num_workers };
+	char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+	
+	if ( -1 == (fd = accept(handoff_fd, NULL, NULL)) ) {
+		if ( errno != EINTR && errno != ECONNABORTED && errno != EAGAIN ) {
+			print_err("Error: Couldn't accept a connection on the handoff socket", false);
+		}
+		return;
+	}
+	
+	// the hello, carrying the listening sockets of the workers
+	memset(control, 0, sizeof(control));
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = CMSG_SPACE(num_workers * sizeof(int)) };
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(num_workers * sizeof(int));
+	for (int i = 0; i < num_workers; i++) {
+		memcpy(CMSG_DATA(cmsg) + i * sizeof(int), &workers[i].listenfd, sizeof(int));
+	}
+	if ( sizeof(hello) != sendmsg(fd, &msg, MSG_NOSIGNAL) ) {
+		print_err("Error: Couldn't hand the listening sockets over to a new server", false);
+		close_safe(fd);
+		return;
+	}
+	
+	// the successor accepts from now on, and gets the final statistics once the connections in flight are done
+	successor_fd = fd;
+	close_safe(handoff_fd);
+	handoff_fd = -1;
+	drain_begin();
+}
+
+static void handoff_receive_totals(void) {
+	struct stats_snapshot total;
+	
+	bool received = (sizeof(total) == recv(predecessor_fd, &total, sizeof(total), MSG_WAITALL));
+	close_safe(predecessor_fd);
+	predecessor_fd = -1;
+	if ( received ) {
+		pcc_shard_add(&inherited, total.pcc, total.files, total.bytes);
+	} else {
+		errno = ECONNRESET;
+		print_err("Warning: The previous server exited without handing its statistics over", false);
+	}
+	
+	// the statistics of the predecessor hold its checkpoint and journal, unless it never sent them
+	if ( NULL != checkpoint_path ) {
+		persistence_start(!received);
+		checkpoint_write();
+	}
+}
+
+static void handoff_send_totals(const struct stats_snapshot *total) {
+	if ( successor_fd == -1 ) {
+		return;
+	}
+	if ( sizeof(struct stats_snapshot) != send(successor_fd, total, sizeof(struct stats_snapshot), MSG_NOSIGNAL) ) {
+		print_err("Error: Couldn't hand the statistics over to the new server", false);
+	}
+	close_safe(successor_fd);
+	successor_fd = -1;
+}
+/**********************************************************************/
+
+
+
+
+
+
+
+/*********************************************************************
+************************* EVENT LOOP HELPERS *************************
+**********************************************************************/
+static void set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if ( -1 == flags || -1 == fcntl(fd, F_SETFL, flags | O_NONBLOCK) ) {
+		print_err("Error: Couldn't set a socket to be non-blocking", true);
+	}
+}
+
+static bool conn_reading(struct conn *conn) {
+	return conn->state == CONN_READ_HEADER || conn->state == CONN_READ_FRAME_HEADER || conn->state == CONN_READ_BODY || conn->state == CONN_READ_DEFLATED ||
+	       conn->state == CONN_SHED;
+}
+
+static void conn_set_lowat(struct conn *conn) {
+	if ( rcvlowat > 0 && conn_reading(conn) ) { // anything of a refused upload is discarded right away
+		set_lowat(conn->fd, &conn->lowat, (conn->state == CONN_SHED) ? 1 : conn_want(conn, rcvlowat));
+	}
+}
+
+static uint64_t conn_want(struct conn *conn, uint64_t buff_size) {
+	uint64_t want = 0;
+	
+	if ( conn->out_len + PCC_MAX_REPLY_SIZE > CONN_OUT_SIZE ) { // no room for another reply, wait for the queue to drain
+		return 0;
+	}
+	
+	if ( conn->state == CONN_READ_HEADER ) {
+		want = PCC_SIZE_HEADER_SIZE - conn->header_read;
+	} else if ( conn->state == CONN_READ_FRAME_HEADER ) { // a part header follows the frame header of a part or a commit
+		want = ((conn->header_read < PCC_FRAME_HEADER_SIZE) ? PCC_FRAME_HEADER_SIZE : pcc_frame_headers_size(conn->frame_flags)) - conn->header_read;
+	} else if ( conn->state == CONN_READ_BODY ) {
+		want = conn->notread_from_file;
+	} else if ( conn->state == CONN_READ_DEFLATED ) { // the length of the next block, then its bytes
+		want = (conn->block_header_read < PCC_BLOCK_HEADER_SIZE) ? PCC_BLOCK_HEADER_SIZE - conn->block_header_read : conn->block_left;
+	} else if ( conn->state == CONN_SHED ) { // anything, to be discarded
+		want = buff_size;
+	}
+	
+	return (want >= buff_size) ? buff_size : want;
+}
+
+static bool conn_consume(struct conn *conn, char buff[], uint64_t size) {
+	instr_count(COUNTER_BYTES, size);
+	conn->last_active = instr_now();
+	if ( conn->transfer_start == 0 ) { // the first bytes of the next frame
+		conn->transfer_start = conn->last_active;
+	}
+	
+	if ( conn->state == CONN_SHED ) { // the upload was refused, drop whatever follows
+		return true;
+	}
+	
+	if ( conn->state == CONN_READ_HEADER ) { // the size of a single-shot upload, or the magic of a session
+		memcpy(conn->header + conn->header_read, buff, size);
+		conn->header_read += size;
+		if ( conn->header_read == PCC_SIZE_HEADER_SIZE ) {
+			uint64_t header_n;
+			memcpy(&header_n, conn->header, sizeof(uint64_t));
+			uint8_t version = pcc_session_version(header_n);
+			
+			if ( version > PCC_PROTOCOL_VERSION ) { // a session of a version we don't know
+				conn->error = "Error: Client opened a session of an unknown version";
+				return false;
+			} else if ( version > 0 ) { // a session, move on to its first frame
+				conn->session = true;
+				conn->header_read = 0;
+				conn->state = CONN_READ_FRAME_HEADER;
+			} else {
+				conn->frame_size = conn->notread_from_file = be64toh(header_n);
+				pcc_class_set_builtin(&conn->classes, PCC_CLASSES_PRINTABLE);
+				conn->state = CONN_READ_BODY;
+				conn->phase_start = instr_phase(PHASE_HEADER, conn->phase_start);
+				if ( !conn_admit(conn) ) {
+					return true;
+				}
+			}
+		}
+		
+	} else if ( conn->state == CONN_READ_FRAME_HEADER ) { // advance the frame headers, and move on to the body once they're complete
+		memcpy(conn->header + conn->header_read, buff, size);
+		conn->header_read += size;
+		if ( conn->header_read == PCC_FRAME_HEADER_SIZE ) {
+			struct pcc_frame_header frame;
+			pcc_decode_frame_header(conn->header, &frame);
+			if ( !pcc_frame_flags_valid(frame.flags) ) {
+				return false;
+			}
+			conn->frame_flags = frame.flags;
+			conn->frame_size = conn->notread_from_file = frame.size;
+		}
+		if ( conn->header_read >= PCC_FRAME_HEADER_SIZE && conn->header_read == pcc_frame_headers_size(conn->frame_flags) ) {
+			pcc_decode_part_header(conn->header + PCC_FRAME_HEADER_SIZE, &conn->part);
+			if ( !decode_classes(conn->frame_flags, conn->header, &conn->classes) ) {
+				return false;
+			}
+			conn->state = CONN_READ_BODY;
+			conn->phase_start = instr_phase(PHASE_HEADER, conn->phase_start);
+			
+			// a lookup has no body to admit: it's replied to from the dedup cache right below, or the client is told to send the body
+			if ( conn->frame_flags & PCC_FRAME_LOOKUP ) {
+				if ( !cache_lookup(pcc_decode_hash_header(conn->header + PCC_FRAME_HEADER_SIZE), conn->frame_size, &conn->printable_chars, conn->pcc_current) ) {
+					conn_miss(conn);
+					return true;
+				}
+				conn->notread_from_file = 0;
+			} else if ( !conn_admit(conn) ) {
+				return true;
+			}
+			
+			if ( conn->frame_flags & PCC_FRAME_HASH ) {
+				pcc_hash_init(&conn->hash);
+			}
+			if ( conn->frame_flags & PCC_FRAME_DEFLATE ) { // a compressed body, ended by its empty block rather than by its size
+				inflater_reset(&conn->inflater);
+				conn->inflated_all = false;
+				conn->block_header_read = 0;
+				conn->state = CONN_READ_DEFLATED;
+			}
+		}
+		
+	} else if ( conn->state == CONN_READ_DEFLATED ) { // advance the length of the block, or inflate its bytes right away
+		if ( conn->block_header_read < PCC_BLOCK_HEADER_SIZE ) {
+			memcpy(conn->block_header + conn->block_header_read, buff, size);
+			conn->block_header_read += size;
+			if ( conn->block_header_read == PCC_BLOCK_HEADER_SIZE ) {
+				uint32_t block_size_n;
+				memcpy(&block_size_n, conn->block_header, PCC_BLOCK_HEADER_SIZE);
+				conn->block_left = be32toh(block_size_n);
+				if ( conn->block_left == 0 ) { // the empty block ends the body, which must have been inflated in full
+					if ( !conn->inflated_all || conn->notread_from_file > 0 ) {
+						return false;
+					}
+					conn->state = CONN_READ_BODY;
+				}
+			}
+		} else {
+			if ( !inflate_and_count(conn->inflater, buff, size, &conn->notread_from_file, &conn->inflated_all, &conn->printable_chars, conn->pcc_current, &conn->classes) ) {
+				return false;
+			}
+			conn->block_left -= size;
+			if ( conn->block_left == 0 ) { // on to the next block
+				conn->block_header_read = 0;
+			}
+		}
+		
+	} else { // process characters read from the file right away
+		if ( conn->frame_flags & PCC_FRAME_HASH ) pcc_hash_update(&conn->hash, buff, size);
+		conn->printable_chars += update_pcc_current(buff, size, conn->pcc_current, &conn->classes);
+		conn->notread_from_file -= size;
+	}
+	
+	// once the whole body was received, queue its reply and move on to the next frame (or stop reading)
+	if ( conn->state == CONN_READ_BODY && conn->notread_from_file == 0 ) {
+		conn->phase_start = instr_phase(PHASE_BODY, conn->phase_start);
+		release_upload(conn->admitted);
+		conn->admitted = 0;
+		conn->transfer_start = 0;
+		enum frame_result result = complete_frame(conn->frame_flags, &conn->part, &conn->frame_size, &conn->printable_chars, conn->pcc_current);
+		if ( result == FRAME_INVALID ) {
+			return false;
+		} else if ( result == FRAME_SHED ) {
+			conn_shed(conn);
+			return true;
+		}
+		if ( (conn->frame_flags & (PCC_FRAME_HASH | PCC_FRAME_LOOKUP)) == PCC_FRAME_HASH ) {
+			cache_insert(pcc_decode_hash_header(conn->header + PCC_FRAME_HEADER_SIZE), pcc_hash_digest(&conn->hash), conn->frame_size, conn->printable_chars, conn->pcc_current);
+		}
+		if ( conn->out_len == conn->out_sent ) { // the reply is the oldest one queued
+			conn->reply_start = conn->phase_start;
+		}
+		uint64_t hist[PCC_MAX_BUCKETS];
+		uint64_t count = complete_classes(&conn->classes, &conn->printable_chars, conn->pcc_current, hist);
+		conn->out_len += encode_reply(conn->out + conn->out_len, conn->frame_flags, count, hist, conn->classes.buckets);
+		
+		// a part only counts once its transfer is committed
+		if ( result == FRAME_FILE ) {
+			for (unsigned int i = 0; i < CHARS_RANGE; i++) {
+				conn->pcc_unsent[i] += conn->pcc_current[i];
+			}
+			conn->files_unsent++;
+			conn->bytes_unsent += conn->frame_size;
+		}
+		memset(conn->pcc_current, 0, sizeof(conn->pcc_current));
+		conn->printable_chars = 0;
+		conn->header_read = 0;
+		conn->state = conn->session ? CONN_READ_FRAME_HEADER : CONN_DRAIN;
+	}
+	
+	return true;
+}
+
+static void conn_protocol_error(struct conn *conn) {
+	errno = EPROTO;
+	print_err((NULL != conn->error) ? conn->error : "Error: Client sent an invalid header", false);
+}
+
+static void conn_break(struct conn *conn) {
+	conn->broken = true;
+	conn->state = (conn->out_sent == conn->out_len) ? CONN_DONE : CONN_DRAIN;
+}
+
+static bool conn_eof(struct conn *conn) {
+	
+	if ( conn->state == CONN_READ_FRAME_HEADER && conn->header_read == 0 ) { // the end of a session
+		conn->state = (conn->out_sent == conn->out_len) ? CONN_DONE : CONN_DRAIN;
+		return true;
+	} else if ( conn->state == CONN_SHED ) { // the client is done with its refused upload, once it read the refusal
+		conn->state = (conn->out_sent == conn->out_len) ? CONN_DONE : CONN_DRAIN;
+		return true;
+	}
+	
+	return false;
+}
+
+static void conn_sent(struct worker *w, struct conn *conn, uint64_t size) {
+	conn->out_sent += size;
+	conn->last_active = instr_now();
+	
+	// once every queued reply was sent, the bodies they answer count
+	if ( conn->out_sent == conn->out_len ) {
+		instr_phase(PHASE_REPLY, conn->reply_start);
+		if ( conn->files_unsent > 0 ) { // not for refusals and misses alone
+			update_pcc_total(w, conn->pcc_unsent, conn->files_unsent, conn->bytes_unsent);
+		}
+		memset(conn->pcc_unsent, 0, CHARS_RANGE * sizeof(uint64_t));
+		conn->files_unsent = conn->bytes_unsent = 0;
+		conn->out_len = conn->out_sent = 0;
+		
+		if ( conn->state == CONN_DRAIN ) {
+			conn->state = CONN_DONE;
+		}
+	}
+}
+
+static bool conn_advance(struct worker *w, struct conn *conn) {
+	ssize_t nread = 0; // how much we've read in last read() call
+	ssize_t nsent = 0; // how much we've written in last write() call
+	uint64_t want = 0; // how much the state machine wants to read next
+
+	// alternate between reading and writing until the socket would block on both (edge-triggered)
+	while ( true ) {
+		bool read_blocked = false;  // whether the last read would have blocked
+		bool write_blocked = false; // whether the last write would have blocked
+		
+		// read headers and bodies, as long as there's room for their replies
+		while ( conn_reading(conn) && (want = conn_want(conn, FILE_BUFF_SIZE)) > 0 ) {
+			
+			instr_count(COUNTER_SYSCALLS, 1);
+			if ( 0 >= (nread = read(conn->fd, w->file_data_buff, want)) ) {
+				if ( (nread < 0) && errno == EINTR ) { // SIG_INT handler, simply redo the reading
+					continue;
+				} else if ( (nread < 0) && (errno == EAGAIN || errno == EWOULDBLOCK) ) { // nothing left to read for now
+					conn_set_lowat(conn);
+					read_blocked = true;
+					break;
+				} else if ( (nread == 0) && conn_eof(conn) ) { // the client ended its session
+					break;
+				} else if ( nread == 0 ) { // the client ended the connection in the middle of a frame, it may still read the replies
+					handle_connection_termination(true);
+					conn_break(conn);
+					break;
+				} else {
+					handle_connection_termination(false); // terminate if not a TCP error
+					goto client_error;
+				}
+			}
+			
+			if ( !conn_consume(conn, w->file_data_buff, nread) ) {
+				conn_protocol_error(conn);
+				conn_break(conn);
+				break;
+			}
+		}
+		
+		// write the queued replies until they're fully sent, or the socket is full
+		while ( conn->out_sent < conn->out_len ) {
+		
+			instr_count(COUNTER_SYSCALLS, 1);
+			if ( 0 >= (nsent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL)) ) {
+				if ( (nsent < 0) && errno == EINTR ) { // SIG_INT handler, simply redo the sending
+					continue;
+				} else if ( (nsent < 0) && (errno == EAGAIN || errno == EWOULDBLOCK) ) { // wait for the socket to drain
+					write_blocked = true;
+					break;
+				} else {
+					handle_connection_termination(nsent == 0); // terminate if not a TCP error or unexpected connection termination
+					goto client_error;
+				}
+			}
+			
+			conn_sent(w, conn, nsent);
+		}
+		
+		if ( conn->state == CONN_DONE ) { // the connection is done
+			return true;
+		}
+		
+		// wait for readiness once neither side can make progress
+		bool read_stalled = read_blocked || !conn_reading(conn) || conn_want(conn, FILE_BUFF_SIZE) == 0;
+		bool write_stalled = write_blocked || conn->out_sent == conn->out_len;
+		if ( read_stalled && write_stalled ) {
+			return false;
+		}
+	}
+	
+client_error:
+	return true;
+}
+
+static void conn_close(struct worker *w, struct conn *conn) {
+	instr_count(COUNTER_ABORTED, conn->broken || (conn->state != CONN_DONE && conn->state != CONN_SHED));
+	timer_cancel(w, conn);
+	release_upload(conn->admitted);
+	close_safe(conn->fd); // closing also removes it from the epoll instance
+	inflater_free(&conn->inflater);
+	pool_put(&w->conns, conn);
+	w->open_connections--;
+	release_connection();
+}
+
+static void accept_connections(struct worker *w, int epfd) {
+	int fd = -1;
+	
+	// accept until the backlog is empty, since the listening socket is edge-triggered,
+	// or until the server is saturated (the backlog is then accepted once it's not)
+	w->accept_paused = false;
+	while ( true ) {
+		
+		if ( !reserve_connection() ) {
+			w->accept_paused = true;
+			return;
+		}
+		
+		instr_count(COUNTER_SYSCALLS, 1);
+		if ( -1 == (fd = accept(w->listenfd, NULL, NULL)) ) {
+			release_connection(); // no connection took the place after all
+			if (errno == EAGAIN || errno == EWOULDBLOCK || finished) { // the backlog is empty (or a successor took the connection)
+				return;
+			} else if (errno == EINTR || errno == ECONNABORTED) { // SIG_INT handler, or a client that gave up while in the backlog
+				continue;
+			} else {
+				print_err("Error: Couldn't accept a connection on the port we are listening", true);
+			}
+		}
+		
+		struct conn *conn = pool_get(&w->conns);
+		memset(conn, 0, sizeof(struct conn));
+		conn->fd = fd;
+		conn->state = CONN_READ_HEADER;
+		conn->phase_start = conn->last_active = conn->transfer_start = instr_now();
+		instr_count(COUNTER_CONNECTIONS, 1);
+		set_nonblocking(fd);
+		if ( bounded ) {
+			timer_schedule(w, conn, conn->phase_start);
+		}
+		
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+		if ( -1 == epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) ) {
+			print_err("Error: Couldn't register a connection in epoll", true);
+		}
+		w->open_connections++;
+	}
+}
+/**********************************************************************/
+
+
+
+
+
+
+
+
+/*********************************************************************
+************************* IO_URING HELPERS ***************************
+**********************************************************************/
+static bool uring_setup(struct uring *ring) {
+	struct io_uring_params params;
+	memset(ring, 0, sizeof(struct uring));
+	memset(&params, 0, sizeof(params));
+	
+	if ( -1 == (ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) ) {
+		if (errno == ENOSYS || errno == EPERM || errno == EACCES) return false; // io_uring is not available
+		print_err("Error: Couldn't set up an io_uring", true);
+	}
+	
+	// mapping the submission queue, the completion queue and the submission entries
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	if ( params.features & IORING_FEAT_SINGLE_MMAP ) { // both queues share a single mapping
+		if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ring :
+	                mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if ( MAP_FAILED == ring->sq_ring || MAP_FAILED == ring->cq_ring || MAP_FAILED == ring->sqes ) {
+		print_err("Error: Couldn't map the queues of an io_uring", true);
+	}
+	
+	ring->sq_head  = (unsigned*)((char*)ring->sq_ring + params.sq_off.head);
+	ring->sq_tail  = (unsigned*)((char*)ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask  = (unsigned*)((char*)ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)((char*)ring->sq_ring + params.sq_off.array);
+	ring->cq_head  = (unsigned*)((char*)ring->cq_ring + params.cq_off.head);
+	ring->cq_tail  = (unsigned*)((char*)ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask  = (unsigned*)((char*)ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe*)((char*)ring->cq_ring + params.cq_off.cqes);
+	ring->sq_entries = params.sq_entries;
+	ring->sqe_tail = *ring->sq_tail;
+	
+	// allocating the receive buffers, and registering them so the kernel doesn't map them upon every read
+	if ( MAP_FAILED == (ring->buffs = mmap(NULL, (size_t)URING_BUFFERS * URING_BUFF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) ) {
+		print_err("Error: Couldn't allocate the receive buffers of an io_uring", true);
+	}
+	madvise(ring->buffs, (size_t)URING_BUFFERS * URING_BUFF_SIZE, MADV_HUGEPAGE); // only a hint, the kernel may not support it
+	struct iovec iovecs[URING_BUFFERS];
+	for (int i = 0; i < URING_BUFFERS; i++) {
+		iovecs[i].iov_base = ring->buffs + (size_t)i * URING_BUFF_SIZE;
+		iovecs[i].iov_len = URING_BUFF_SIZE;
+		ring->free_buffs[i] = i;
+	}
+	ring->nfree = URING_BUFFERS;
+	ring->fixed_buffs = (0 == syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovecs, URING_BUFFERS)); // may exceed RLIMIT_MEMLOCK
+	ring->multishot_accept = true;
+	
+	return true;
+}
+
+static void uring_teardown(struct uring *ring) {
+	munmap(ring->buffs, (size_t)URING_BUFFERS * URING_BUFF_SIZE);
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close_safe(ring->fd); // this also cancels every operation still in flight
+}
+
+static int uring_enter(struct uring *ring, unsigned min_complete) {
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	
+	instr_count(COUNTER_SYSCALLS, 1);
+	int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if ( ret >= 0 ) {
+		ring->to_submit -= ret;
+	}
+	
+	return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+	
+	// the submission queue is full, hand what's queued to the kernel first
+	while ( ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries ) {
+		if ( 0 > uring_enter(ring, 0) && errno != EINTR ) {
+			print_err("Error: Couldn't submit to an io_uring", true);
+		}
+	}
+	
+	unsigned index = ring->sqe_tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_array[index] = index;
+	ring->sqe_tail++;
+	ring->to_submit++;
+	
+	return sqe;
+}
+
+static bool uring_submit_accept(struct worker *w, struct uring *ring) {
+	struct io_uring_sqe *sqe = NULL;
+	
+	if ( ring->multishot_accept ) {
+		if ( !accepting_allowed() ) {
+			return false;
+		}
+		sqe = uring_get_sqe(ring);
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = w->listenfd;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->user_data = URING_ACCEPT_TAG;
+	} else { // nothing is reserved until a connection arrives, so an idle worker never holds a place
+		sqe = uring_get_sqe(ring);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = w->listenfd;
+		sqe->poll32_events = POLLIN;
+		sqe->user_data = URING_LISTEN_TAG;
+	}
+	ring->accept_armed = true;
+	return true;
+}
+
+static void uring_accept_reserved(struct worker *w, struct uring *ring) {
+	if ( !reserve_connection() ) {
+		atomic_store(&w->admission_waiting, true);
+		if ( !reserve_connection() ) { // otherwise, room was made before the flag was set
+			w->accept_paused = true;
+			return;
+		}
+		atomic_store(&w->admission_waiting, false);
+	}
+	ring->accept_reserved = true;
+	w->open_connections++; // so the worker waits for a cancelled accept to give its place back
+	
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = w->listenfd;
+	sqe->user_data = URING_ACCEPT_TAG;
+	ring->accept_armed = true;
+}
+
+static void uring_submit_conn(struct uring *ring, struct conn *conn) {
+	
+	if ( conn->out_sent < conn->out_len ) { // sending the rest of the queued replies first
+		struct io_uring_sqe *sqe = uring_get_sqe(ring);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = conn->fd;
+		sqe->addr = (uint64_t)(uintptr_t)(conn->out + conn->out_sent);
+		sqe->len = conn->out_len - conn->out_sent;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = (uint64_t)(uintptr_t)conn;
+		conn->sending = true;
+		return;
+	}
+	
+	// every registered buffer is used by a read in flight, wait for one to be released
+	if ( ring->nfree == 0 ) {
+		conn->next = NULL;
+		if (ring->waiting_tail) ring->waiting_tail->next = conn; else ring->waiting_head = conn;
+		ring->waiting_tail = conn;
+		return;
+	}
+	
+	// reading the next header or the next part of the body into a free registered buffer
+	conn->buff_index = ring->free_buffs[--ring->nfree];
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	sqe->opcode = ring->fixed_buffs ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = conn->fd;
+	sqe->addr = (uint64_t)(uintptr_t)(ring->buffs + (size_t)conn->buff_index * URING_BUFF_SIZE);
+	sqe->len = conn_want(conn, URING_BUFF_SIZE);
+	sqe->buf_index = conn->buff_index;
+	conn_set_lowat(conn); // a read that finds nothing waits for this much
+	sqe->user_data = (uint64_t)(uintptr_t)conn;
+	conn->sending = false;
+}
+
+static void uring_release_buff(struct uring *ring, int index) {
+	ring->free_buffs[ring->nfree++] = index;
+	
+	// handing the buffer to the connection that waited the longest for one
+	if ( ring->waiting_head ) {
+		struct conn *conn = ring->waiting_head;
+		ring->waiting_head = conn->next;
+		if (NULL == ring->waiting_head) ring->waiting_tail = NULL;
+		uring_submit_conn(ring, conn);
+	}
+}
+
+static bool uring_complete_conn(struct worker *w, struct uring *ring, struct conn *conn, int res) {
+	
+	if ( conn->timed_out ) { // shut down upon missing its deadline, whatever completed
+		if ( !conn->sending ) {
+			uring_release_buff(ring, conn->buff_index);
+		}
+		return true;
+	}
+	
+	if ( !conn->sending ) { // hand the received bytes straight to the state machine, and release the buffer
+		char *buff = ring->buffs + (size_t)conn->buff_index * URING_BUFF_SIZE;
+		bool valid = (res <= 0) || conn_consume(conn, buff, res);
+		uring_release_buff(ring, conn->buff_index);
+		
+		if ( res == 0 && conn_eof(conn) ) { // the client ended its session
+			// the queued replies are still sent below
+		} else if ( res == 0 ) { // the client ended the connection in the middle of a frame, it may still read the replies
+			handle_connection_termination(true);
+			conn_break(conn);
+		} else if ( res < 0 ) { // an error (the negated errno)
+			errno = -res;
+			handle_connection_termination(false); // terminate if not a TCP error
+			return true;
+		} else if ( !valid ) {
+			conn_protocol_error(conn);
+			conn_break(conn);
+		}
+		
+	} else if ( res <= 0 ) { // the send failed (the negated errno)
+		errno = -res;
+		handle_connection_termination(res == 0); // terminate if not a TCP error or unexpected connection termination
+		return true;
+		
+	} else { // advance the queued replies
+		conn_sent(w, conn, res);
+	}
+	
+	if ( conn->state == CONN_DONE ) {
+		return true;
+	}
+	
+	uring_submit_conn(ring, conn);
+	return false;
+}
+/**********************************************************************/
 
 
 
@@ -320,11 +3579,18 @@ static uint64_t update_pcc_current(char file_data_buff[], uint64_t size, uint64_
 /*********************************************************************
 ************************* MAIN MECHANISM *****************************
 **********************************************************************/
-static void process_connections(int listenfd) {
+static void process_connections(struct worker *w) {
 	uint64_t pcc_current[CHARS_RANGE]; // will hold the statistics for the current connection that is being processed
+	int connfd = -1; // stores the fd for the connected socket
+	uint64_t phase_start = 0; // when the current phase of the connection started
+	uint64_t wake = 0; // the counter read off the wake-up eventfd
 	
+	// the listening socket is polled along with the wake-up eventfd, so draining never has to shut it down (a successor
+	// may be accepting on it too, and take a connection first)
+	struct pollfd ready[2] = { { .fd = w->listenfd, .events = POLLIN }, { .fd = w->wakefd, .events = POLLIN } };
+	set_nonblocking(w->listenfd);
 	
-	while( !finished ) { // accepting connections until SIGINT arrives or an unexpected error terminated the program
+	while( !finished ) { // accepting connections until the server drains or an unexpected error terminated the program
 		
 		// zero-ing out the recent connection-based statistics
 		memset(pcc_current, 0, CHARS_RANGE * sizeof(uint64_t));
@@ -332,70 +3598,504 @@ static void process_connections(int listenfd) {
 		// Accept a connection.
 		// Can use NULL in 2nd and 3rd arguments
 		// but we want to print the client socket details
-		if ( -1 == (connfd = accept(listenfd, NULL, NULL)) ) {
-			if (errno == EINTR) { // must be caused by our signal handler (every handler on linux has SA_RESTART turned on by default)
-				break; // exit loop
-			} else { // if it's a non-sigint-related error
+		phase_start = instr_now();
+		instr_count(COUNTER_SYSCALLS, 1);
+		if ( -1 == poll(ready, 2, -1) && errno != EINTR ) {
+			print_err("Error: Couldn't wait for a connection on the port we are listening", true);
+		}
+		if ( finished ) { // woken up once the server drains
+			break; // exit loop
+		}
+		if ( ready[1].revents & POLLIN ) { // a wake-up that came after room was made for another connection, only cleared
+			read(w->wakefd, &wake, sizeof(uint64_t));
+		}
+		if ( !(ready[0].revents & POLLIN) ) {
+			continue;
+		}
+		
+		// a connection is waiting: reserving its place before accepting it, or else waiting on the wake-up eventfd while
+		// the other workers saturate the server, until one of them makes room (or the server drains)
+		while ( !finished && !reserve_connection() ) {
+			atomic_store(&w->admission_waiting, true);
+			if ( reserve_connection() ) { // room was made before the flag was set
+				atomic_store(&w->admission_waiting, false);
+				break;
+			}
+			instr_count(COUNTER_SYSCALLS, 2);
+			if ( -1 == poll(&ready[1], 1, -1) && errno != EINTR ) {
+				print_err("Error: Couldn't wait for the server to make room for a connection", true);
+			}
+			atomic_store(&w->admission_waiting, false);
+			read(w->wakefd, &wake, sizeof(uint64_t));
+		}
+		if ( finished ) {
+			break;
+		}
+		instr_count(COUNTER_SYSCALLS, 1);
+		if ( -1 == (connfd = accept(w->listenfd, NULL, NULL)) ) {
+			release_connection(); // no connection took the place after all
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) { // taken by a successor, or gone already
+				continue;
+			} else {
 				print_err("Error: Couldn't accept a connection on the port we are listening", true);
 			}	
 		}
+		
+		// the client is counted in `open_connections` since its place was reserved
+		phase_start = instr_phase(PHASE_ACCEPT, phase_start);
+		instr_count(COUNTER_CONNECTIONS, 1);
+		
+		// bounding a client that stops, or trickles its upload
+		set_socket_timeouts(connfd);
+		thread_deadline = (transfer_timeout > 0) ? phase_start + transfer_timeout : 0;
 
 		// read the amount of characters that the file being sent will hold
 		uint64_t file_size_n;
 		if ( CLIENT_TERMINATED == recv_data(connfd, &file_size_n, sizeof(uint64_t)) ) {
+			goto client_error;
+		}
+		uint64_t file_size_h = be64toh(file_size_n);
+		
+		// the client may open a session instead of uploading a single file
+		uint8_t version = pcc_session_version(file_size_n);
+		if ( version > PCC_PROTOCOL_VERSION ) {
+			errno = EPROTO;
+			print_err("Error: Client opened a session of an unknown version", false);
+			goto client_error;
+		} else if ( version > 0 ) {
+			instr_count(COUNTER_ABORTED, !process_session(w, connfd, phase_start));
 			close_safe(connfd);
+			release_connection();
 			continue;
 		}
-		uint64_t file_size_h = be64toh(file_size_n);
+		phase_start = instr_phase(PHASE_HEADER, phase_start);
 		
-		// read the file sent and fetch the amount of printable characters in that file
-		uint64_t printable_chars_h = 0;
-		if ( CLIENT_TERMINATED == (printable_chars_h = receive_and_process_file(connfd, file_size_h, pcc_current)) ) {
+		// refuse a file too large, or one the server has no room for
+		if ( !admit_upload(file_size_h) ) {
+			shed_connection(w, connfd);
 			close_safe(connfd);
+			release_connection();
 			continue;
 		}
 		
+		// read the file sent and fetch the amount of printable characters in that file
+		uint64_t printable_chars_h = receive_and_process_upload(w, connfd, file_size_h, pcc_current, &printable_classes);
+		release_upload(file_size_h);
+		if ( CLIENT_TERMINATED == printable_chars_h ) {
+			goto client_error;
+		}
+		phase_start = instr_phase(PHASE_BODY, phase_start);
+		
 		// send the amount of printable characters in the file sent to the client
 		uint64_t printable_chars_n = htobe64(printable_chars_h);
 		if ( CLIENT_TERMINATED == send_data(connfd, &printable_chars_n, sizeof(uint64_t)) ) {
-			close_safe(connfd);
-			continue;
+			goto client_error;
 		}
+		instr_phase(PHASE_REPLY, phase_start);
 
 		// close socket + update pcc_total
-		update_pcc_total(pcc_current);
+		update_pcc_total(w, pcc_current, 1, file_size_h);
 		close_safe(connfd);
 		
 		// signal to the handler that no client is currently being processed
-		connfd = -1;
+		release_connection();
+		continue;
+		
+	client_error: // the client terminated, or broke the protocol
+		instr_count(COUNTER_ABORTED, 1);
+		close_safe(connfd);
+		release_connection();
 	}
 }
-/**********************************************************************/
-
-
-
-
-
-
 
+static bool process_session(struct worker *w, int connfd, uint64_t phase_start) {
+	uint64_t pcc_current[PCC_BYTE_VALUES]; // will hold the statistics for the current frame that is being processed
+	uint64_t hist[PCC_MAX_BUCKETS]; // and its histogram in its class set, once it was processed
+	char header[PCC_MAX_HEADERS_SIZE]; // the headers of the current frame
+	struct pcc_frame_header frame;
+	struct pcc_part_header part;
+	struct pcc_class_set classes;
+	struct pcc_hash hash; // the hash of the body of the current frame, if it's flagged with PCC_FRAME_HASH
+	uint64_t ret = 0;
+	
+	while ( true ) { // serving frames until the client ends the session
+		
+		// zero-ing out the recent frame-based statistics
+		memset(pcc_current, 0, sizeof(pcc_current));
+		
+		// read the header of the next frame, the deadline of the frame starting with it
+		thread_deadline = 0;
+		if ( PCC_FRAME_HEADER_SIZE != (ret = recv_frame_header(connfd, header)) ) {
+			return (ret == 0); // the session ended, or the client terminated
+		}
+		thread_deadline = (transfer_timeout > 0) ? instr_now() + transfer_timeout : 0;
+		pcc_decode_frame_header(header, &frame);
+		if ( !pcc_frame_flags_valid(frame.flags) ) {
+			goto protocol_error;
+		}
+		
+		// a part or a commit carries the part header too, and a frame of another class set its class set header or table
+		if ( pcc_frame_headers_size(frame.flags) > PCC_FRAME_HEADER_SIZE ) {
+			if ( CLIENT_TERMINATED == recv_data(connfd, header + PCC_FRAME_HEADER_SIZE, pcc_frame_headers_size(frame.flags) - PCC_FRAME_HEADER_SIZE) ) {
+				return false;
+			}
+			pcc_decode_part_header(header + PCC_FRAME_HEADER_SIZE, &part);
+		}
+		if ( !decode_classes(frame.flags, header, &classes) ) {
+			goto protocol_error;
+		}
+		phase_start = instr_phase(PHASE_HEADER, phase_start);
+		
+		// a lookup has no body to admit: it's replied to from the dedup cache, or the client is told to send the body
+		uint64_t printable_chars_h = 0;
+		if ( frame.flags & PCC_FRAME_LOOKUP ) {
+			if ( !cache_lookup(pcc_decode_hash_header(header + PCC_FRAME_HEADER_SIZE), frame.size, &printable_chars_h, pcc_current) ) {
+				uint64_t miss_n = htobe64(PCC_REPLY_MISS);
+				if ( CLIENT_TERMINATED == send_data(connfd, (char*)&miss_n, PCC_REPLY_SIZE) ) {
+					return false;
+				}
+				phase_start = instr_phase(PHASE_REPLY, phase_start);
+				continue;
+			}
+			goto counted;
+		}
+		
+		// refuse a frame too large, or one the server has no room for, and ignore the rest of the session
+		if ( !admit_upload(frame.size) ) {
+			shed_connection(w, connfd);
+			return true;
+		}
+		
+		// read the body of the frame (inflating it if it's compressed, hashing it if it's to be remembered) and fetch the amount of printable characters in it
+		if ( frame.flags & PCC_FRAME_DEFLATE ) {
+			printable_chars_h = receive_and_process_deflated(w, connfd, frame.size, pcc_current, &classes);
+		} else {
+			if ( frame.flags & PCC_FRAME_HASH ) {
+				pcc_hash_init(&hash);
+				thread_hash = &hash;
+			}
+			printable_chars_h = receive_and_process_upload(w, connfd, frame.size, pcc_current, &classes);
+			thread_hash = NULL;
+		}
+		release_upload(frame.size);
+		if ( CLIENT_TERMINATED == printable_chars_h ) {
+			return false;
+		}
+		if ( frame.flags & PCC_FRAME_HASH ) {
+			cache_insert(pcc_decode_hash_header(header + PCC_FRAME_HEADER_SIZE), pcc_hash_digest(&hash), frame.size, printable_chars_h, pcc_current);
+		}
+		phase_start = instr_phase(PHASE_BODY, phase_start);
+counted:;
+		enum frame_result result = complete_frame(frame.flags, &part, &frame.size, &printable_chars_h, pcc_current);
+		if ( result == FRAME_INVALID ) {
+			goto protocol_error;
+		} else if ( result == FRAME_SHED ) { // the transfer table has no room for the part
+			shed_connection(w, connfd);
+			return true;
+		}
+		
+		// reply to the frame, and only then count it (a part only counts once its transfer is committed)
+		char reply[PCC_MAX_REPLY_SIZE];
+		uint64_t count = complete_classes(&classes, &printable_chars_h, pcc_current, hist);
+		if ( CLIENT_TERMINATED == send_data(connfd, reply, encode_reply(reply, frame.flags, count, hist, classes.buckets)) ) {
+			return false;
+		}
+		phase_start = instr_phase(PHASE_REPLY, phase_start);
+		if ( result == FRAME_FILE ) {
+			update_pcc_total(w, pcc_current, 1, frame.size);
+		}
+	}
+	
+protocol_error:
+	errno = EPROTO;
+	print_err("Error: Client sent an invalid header", false);
+	return false;
+}
 
+static void process_connections_epoll(struct worker *w) {
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	bool listening = true; // whether new connections are still accepted
+	int epfd = -1;
+	
+	if ( -1 == (epfd = epoll_create1(0)) ) {
+		print_err("Error: Couldn't create an epoll instance", true);
+	}
+	
+	// the listening socket is identified by a NULL pointer, the wake-up eventfd by the worker, and connections by their state
+	set_nonblocking(w->listenfd);
+	struct epoll_event listen_ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+	struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = w };
+	if ( -1 == epoll_ctl(epfd, EPOLL_CTL_ADD, w->listenfd, &listen_ev) || -1 == epoll_ctl(epfd, EPOLL_CTL_ADD, w->wakefd, &wake_ev) ) {
+		print_err("Error: Couldn't register the listening socket in epoll", true);
+	}
+	
+	// the timerfd of the timer wheel is identified by the wheel
+	if ( bounded ) {
+		timers_start(w);
+		struct epoll_event timer_ev = { .events = EPOLLIN, .data.ptr = &w->timers };
+		if ( -1 == epoll_ctl(epfd, EPOLL_CTL_ADD, w->timers.fd, &timer_ev) ) {
+			print_err("Error: Couldn't register the timer in epoll", true);
+		}
+	}
+	
+	// serving connections until the server drains and every connection in flight is done
+	while ( !finished || w->open_connections > 0 ) {
+	
+		// once the server drains, stop accepting new connections but finish the ones in flight
+		if ( finished && listening ) {
+			epoll_ctl(epfd, EPOLL_CTL_DEL, w->listenfd, NULL);
+			listening = false;
+		}
+		
+		instr_count(COUNTER_SYSCALLS, 1);
+		int nevents = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, -1);
+		if ( -1 == nevents ) {
+			if (errno == EINTR) continue;
+			print_err("Error: Couldn't wait for events on epoll", true);
+		}
+		
+		bool ticked = false; // whether the timer wheel is due, checked once no event refers to a connection it may close
+		for (int i = 0; i < nevents; i++) {
+			struct conn *conn = events[i].data.ptr;
+			
+			if ( NULL == conn ) { // the listening socket
+				if (listening) accept_connections(w, epfd);
+				continue;
+			} else if ( (void*)conn == (void*)w ) { // woken up once the server drains, stop waiting on the eventfd
+				epoll_ctl(epfd, EPOLL_CTL_DEL, w->wakefd, NULL);
+				continue;
+			} else if ( (void*)conn == (void*)&w->timers ) { // a tick (or several) of the timer wheel
+				read(w->timers.fd, &w->timers.expirations, sizeof(uint64_t));
+				ticked = true;
+				continue;
+			}
+			
+			if ( conn_advance(w, conn) ) { // the connection is done, or was terminated (only replied bodies were counted)
+				conn_close(w, conn);
+			}
+		}
+		
+		if ( ticked ) {
+			timers_advance(w, false);
+		}
+		
+		// resuming accepting once the server is no longer saturated
+		if ( listening && w->accept_paused && accepting_allowed() ) {
+			accept_connections(w, epfd);
+		}
+	}
+	
+	if ( bounded ) {
+		close_safe(w->timers.fd);
+	}
+	close_safe(epfd);
+}
 
-/*************** MAIN ******************/
-int main(int argc, char *argv[]) {
+static bool process_connections_uring(struct worker *w) {
+	struct uring ring;
+	bool listening = true; // whether new connections are still accepted
+	
+	if ( !uring_setup(&ring) ) {
+		return false;
+	}
+	if ( max_connections > 0 || inflight_budget > 0 ) { // a multishot accept would take the whole backlog, past the cap
+		ring.multishot_accept = false;
+	}
+	
+	// accepting connections, and waiting for the wake-up once the server drains
+	w->accept_paused = !uring_submit_accept(w, &ring);
+	struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = w->wakefd;
+	sqe->addr = (uint64_t)(uintptr_t)&ring.wake;
+	sqe->len = sizeof(uint64_t);
+	sqe->user_data = URING_WAKE_TAG;
+	
+	// ticking the timer wheel
+	if ( bounded ) {
+		timers_start(w);
+		sqe = uring_get_sqe(&ring);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = w->timers.fd;
+		sqe->addr = (uint64_t)(uintptr_t)&w->timers.expirations;
+		sqe->len = sizeof(uint64_t);
+		sqe->user_data = URING_TIMER_TAG;
+	}
+	
+	// serving connections until the server drains and every connection in flight is done
+	while ( !finished || w->open_connections > 0 ) {
+	
+		// once the server drains, stop accepting new connections but finish the ones in flight
+		if ( finished && listening ) {
+			sqe = uring_get_sqe(&ring);
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = URING_ACCEPT_TAG;
+			sqe = uring_get_sqe(&ring);
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = URING_LISTEN_TAG;
+			listening = false;
+			continue;
+		}
+		
+		// submitting everything queued since the last batch, and waiting for completions
+		if ( 0 > uring_enter(&ring, 1) ) {
+			if (errno == EINTR) continue;
+			print_err("Error: Couldn't wait for completions on io_uring", true);
+		}
+		
+		// handling every completion of the batch
+		unsigned head = *ring.cq_head;
+		while ( head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) ) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			uint64_t user_data = cqe->user_data;
+			int res = cqe->res;
+			unsigned flags = cqe->flags;
+			__atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+			
+			if ( user_data == 0 ) { // the completion of cancelling the accept
+				continue;
+				
+			} else if ( user_data == URING_WAKE_TAG ) { // woken up once the server drains, or once room was made (read again)
+				if ( !finished ) {
+					sqe = uring_get_sqe(&ring);
+					sqe->opcode = IORING_OP_READ;
+					sqe->fd = w->wakefd;
+					sqe->addr = (uint64_t)(uintptr_t)&ring.wake;
+					sqe->len = sizeof(uint64_t);
+					sqe->user_data = URING_WAKE_TAG;
+				}
+				
+			} else if ( user_data == URING_LISTEN_TAG ) { // a connection arrived for a single-shot accept, or the poll stopped
+				ring.accept_armed = false;
+				if ( res >= 0 && listening && !finished ) {
+					uring_accept_reserved(w, &ring);
+				} else if ( res < 0 && res != -EINTR && res != -ECANCELED && !finished ) {
+					errno = -res;
+					print_err("Error: Couldn't wait for a connection on the port we are listening", true);
+				}
+				
+			} else if ( user_data == URING_TIMER_TAG ) { // a tick (or several) of the timer wheel, read again for the next one
+				timers_advance(w, true);
+				sqe = uring_get_sqe(&ring);
+				sqe->opcode = IORING_OP_READ;
+				sqe->fd = w->timers.fd;
+				sqe->addr = (uint64_t)(uintptr_t)&w->timers.expirations;
+				sqe->len = sizeof(uint64_t);
+				sqe->user_data = URING_TIMER_TAG;
+				
+			} else if ( user_data == URING_ACCEPT_TAG ) { // a new connection, or the accept stopped
+				bool reserved = ring.accept_reserved; // a single-shot accept, done either way
+				ring.accept_reserved = false;
+				if ( reserved && res < 0 ) {
+					w->open_connections--;
+					release_connection(); // no connection took the place after all
+				}
+				
+				if ( res >= 0 ) { // served even if it raced with the drain, since it's no longer in the backlog for a successor to take
+					struct conn *conn = pool_get(&w->conns);
+					memset(conn, 0, sizeof(struct conn));
+					conn->fd = res;
+					conn->state = CONN_READ_HEADER;
+					conn->phase_start = conn->last_active = conn->transfer_start = instr_now();
+					instr_count(COUNTER_CONNECTIONS, 1);
+					if ( !reserved ) { // the client of a multishot accept takes its place now
+						w->open_connections++;
+						open_connections++;
+					}
+					if ( bounded ) {
+						timer_schedule(w, conn, conn->phase_start);
+					}
+					uring_submit_conn(&ring, conn);
+				} else if ( res == -EINVAL && ring.multishot_accept && listening ) { // multishot accept isn't supported by this kernel
+					ring.multishot_accept = false;
+				} else if ( res != -EINTR && res != -ECONNABORTED && res != -ECANCELED && res != -EAGAIN && !finished ) { // (a successor may take a connection first)
+					errno = -res;
+					print_err("Error: Couldn't accept a connection on the port we are listening", true);
+				}
+				
+				// re-arming the accept once it stopped producing connections, unless it was paused
+				if ( !(flags & IORING_CQE_F_MORE) ) {
+					ring.accept_armed = false;
+					if ( listening && !finished && !w->accept_paused && !uring_submit_accept(w, &ring) ) {
+						w->accept_paused = true;
+					}
+				}
+				
+			} else { // an operation of a connection
+				struct conn *conn = (struct conn*)(uintptr_t)user_data;
+				
+				if ( uring_complete_conn(w, &ring, conn, res) ) { // the connection is done, or was terminated (only replied bodies were counted)
+					conn_close(w, conn);
+				}
+			}
+		}
+		
+		// pausing the multishot accept while the server is saturated (a single-shot one reserves its place instead),
+		// and resuming the accept once it's not (once a cancelled accept completes, if it's still in flight)
+		if ( listening && !w->accept_paused && ring.multishot_accept && !accepting_allowed() ) {
+			w->accept_paused = true;
+			if ( ring.accept_armed ) {
+				sqe = uring_get_sqe(&ring);
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->addr = URING_ACCEPT_TAG;
+			}
+		} else if ( listening && w->accept_paused && accepting_allowed() && !ring.accept_armed ) {
+			atomic_store(&w->admission_waiting, false);
+			w->accept_paused = !uring_submit_accept(w, &ring);
+		}
+	}
+	
+	uring_teardown(&ring);
+	if ( bounded ) {
+		close_safe(w->timers.fd);
+	}
+	return true;
+}
 
-	int listenfd  = -1; // stores the fd for the listening socket
-	struct sockaddr_in serv_addr; // server addreess
+static void *worker_main(void *arg) {
+	struct worker *w = arg;
+	thread_instr = &w->instr;
+	
+	// the pools are first touched here, so their memory is local to the worker's NUMA node
+	for (unsigned int c = 0; c < BUFF_CLASSES; c++) {
+		pool_init(&w->buffs[c], buff_class_sizes[c]);
+	}
+	if ( io_mode != IO_MODE_BLOCKING ) {
+		pool_init(&w->conns, sizeof(struct conn));
+	}
+	if ( io_mode != IO_MODE_BLOCKING || recv_strategy == RECV_PIPELINED ) {
+		w->file_data_buff = buff_get(w, FILE_BUFF_SIZE);
+	}
+	
+	if (io_mode == IO_MODE_URING) {
+		if ( !process_connections_uring(w) ) { // io_uring isn't available, fall back to epoll
+			print_err("Warning: io_uring is not available, falling back to epoll", false);
+			process_connections_epoll(w);
+		}
+	} else if (io_mode == IO_MODE_EPOLL) {
+		process_connections_epoll(w);
+	} else if (recv_strategy == RECV_PIPELINED) {
+		pipeline_start(w);
+		process_connections(w);
+		pipeline_stop(w);
+	} else {
+		process_connections(w);
+	}
 	
-	// connecting signal handler
-	set_sigint_handler();
+	inflater_free(&w->inflater);
 	
-	// parse args
-	if (argc != 2) {
-		errno = EINVAL;
-		print_err("Error: Not enough arguments passed", true);
+	// the main thread exits once the last worker is done
+	uint64_t done = 1;
+	running_workers--;
+	if ( sizeof(uint64_t) != write(done_fd, &done, sizeof(uint64_t)) ) {
+		print_err("Error: Couldn't wake up the main thread", true);
 	}
+	return NULL;
+}
 
-	uint16_t port = atoi(argv[1]); // transfer to 16 bit
+static int open_listening_socket(uint16_t port, bool reuseport) {
+	int listenfd  = -1; // stores the fd for the listening socket
+	struct sockaddr_in serv_addr; // server addreess
 
 	// create listening socket
 	if ( -1 == (listenfd = socket( AF_INET, SOCK_STREAM, 0 )) ) {
@@ -407,6 +4107,11 @@ int main(int argc, char *argv[]) {
 	if ( 0 != (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &option_value, sizeof(int))) ) {
 		print_err("Error: Couldn't set socket options", true);
 	}
+	
+	// letting every worker listen on the same port, with the kernel balancing connections between them
+	if ( reuseport && 0 != (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &option_value, sizeof(int))) ) {
+		print_err("Error: Couldn't set socket options", true);
+	}
 
 	// configuring our server address correctly and binding our listening socket to the server address
 	memset( &serv_addr, 0, addrsize);
@@ -416,19 +4121,367 @@ int main(int argc, char *argv[]) {
 
 	if( 0 != bind( listenfd, (struct sockaddr*) &serv_addr,	addrsize ) ) {
 		print_err("Error: Couldn't bind a listening socket", true);
-		return 1;
 	}
 
-	// listening on the socket for connections
-	if( 0 != listen( listenfd, 10 ) ) {
+	tune_listening_socket(listenfd);
+	return listenfd;
+}
+
+static void tune_listening_socket(int listenfd) {
+	
+	// the connections only reach accept once their size header arrived, so a worker never waits on it
+	if ( defer_accept > 0 && 0 != setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(int)) ) {
+		print_err("Error: Couldn't set TCP_DEFER_ACCEPT", true);
+	}
+	
+	// set before the handshake, so the window scale of the connections is picked for it. With a low-water mark, the
+	// buffer holds it several times over: the kernel would otherwise clamp the window to the mark itself, and a
+	// window that's left with less than a segment of room (as on loopback) is never opened again
+	int rcvbuf = (rcvlowat > 0 && rcvbuf_size < 4 * rcvlowat) ? 4 * rcvlowat : rcvbuf_size;
+	if ( rcvbuf > 0 && 0 != setsockopt(listenfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int)) ) {
+		print_err("Error: Couldn't set SO_RCVBUF", true);
+	}
+	
+	// only blocking reads busy-poll (the event loops would, only if net.core.busy_poll is set)
+	if ( busy_poll_usec > 0 && 0 != setsockopt(listenfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usec, sizeof(int)) ) {
+		print_err("Error: Couldn't set SO_BUSY_POLL (raising it takes CAP_NET_ADMIN)", true);
+	}
+
+	// listening on the socket for connections (an event loop takes bursts of connections, so give it a deeper backlog)
+	int backlog = (listen_backlog > 0) ? listen_backlog : (io_mode != IO_MODE_BLOCKING) ? SOMAXCONN : 10;
+	if( 0 != listen( listenfd, backlog ) ) {
 		print_err("Error: Couldn't `listen` to socket", true);
-		return 1;
+	}
+}
+
+static void parse_socket_knobs(char *knobs) {
+	char *knob = NULL;
+	
+	while ( NULL != (knob = strsep(&knobs, ",")) ) {
+		char *value = strchr(knob, '=');
+		int n = (NULL != value) ? atoi(value + 1) : 0;
+		if ( NULL != value ) {
+			*value = '\0';
+		}
+		
+		if ( 0 == strcmp(knob, "pin") && NULL == value ) {
+			pin_workers = true;
+			continue;
+		} else if ( NULL == value || n <= 0 ) {
+			errno = EINVAL;
+			print_err("Error: The knobs passed to `-o` must be pin, or one of backlog|defer_accept|rcvbuf|rcvlowat|busy_poll set to a positive value", true);
+		}
+		
+		if ( 0 == strcmp(knob, "backlog") ) {
+			listen_backlog = n;
+		} else if ( 0 == strcmp(knob, "defer_accept") ) {
+			defer_accept = n;
+		} else if ( 0 == strcmp(knob, "rcvbuf") ) {
+			rcvbuf_size = n;
+		} else if ( 0 == strcmp(knob, "rcvlowat") ) {
+			rcvlowat = n;
+		} else if ( 0 == strcmp(knob, "busy_poll") ) {
+			busy_poll_usec = n;
+		} else {
+			errno = EINVAL;
+			print_err("Error: Unknown knob passed to `-o` (expected pin|backlog|defer_accept|rcvbuf|rcvlowat|busy_poll)", true);
+		}
+	}
+}
+
+static void pin_workers_to_cpus(void) {
+	cpu_set_t allowed;
+	int cpus[CPU_SETSIZE];
+	int ncpus = 0;
+	
+	if ( 0 != sched_getaffinity(0, sizeof(allowed), &allowed) ) {
+		print_err("Error: Couldn't get the CPUs the server may run on", true);
+	}
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if ( CPU_ISSET(cpu, &allowed) ) {
+			cpus[ncpus++] = cpu;
+		}
+	}
+	
+	// the kernel hands a connection to the socket of the CPU its packets are processed on (falling back to the hash)
+	for (int i = 0; i < num_workers; i++) {
+		workers[i].cpu = cpus[i % ncpus];
+		if ( num_workers > 1 && 0 != setsockopt(workers[i].listenfd, SOL_SOCKET, SO_INCOMING_CPU, &workers[i].cpu, sizeof(int)) ) {
+			print_err("Error: Couldn't set SO_INCOMING_CPU", true);
+		}
+	}
+}
+/**********************************************************************/
+
+
+
+
+
+
+
+
+
+/*************** MAIN ******************/
+int main(int argc, char *argv[]) {
+	
+	// reading SIGINT and SIGTERM off a signalfd, rather than handling them
+	signals_start();
+	
+	// parse options
+	int opt;
+	const char *kernel_name = "auto";
+	double seconds = 0;
+	while ( -1 != (opt = getopt(argc, argv, "m:t:k:r:s:a:i:T:c:M:b:C:I:J:D:H:o:d:")) ) {
+		switch (opt) {
+			case 'm': // the way connections are driven
+				if (0 == strcmp(optarg, "blocking")) {
+					io_mode = IO_MODE_BLOCKING;
+				} else if (0 == strcmp(optarg, "epoll")) {
+					io_mode = IO_MODE_EPOLL;
+				} else if (0 == strcmp(optarg, "uring")) {
+					io_mode = IO_MODE_URING;
+				} else {
+					errno = EINVAL;
+					print_err("Error: Unknown mode passed to `-m` (expected blocking|epoll|uring)", true);
+				}
+				break;
+			case 't': // the amount of workers
+				if ( 0 >= (num_workers = atoi(optarg)) ) {
+					errno = EINVAL;
+					print_err("Error: The amount of workers passed to `-t` must be positive", true);
+				}
+				break;
+			case 'r': // the way the blocking mode receives files
+				if (0 == strcmp(optarg, "batch")) {
+					recv_strategy = RECV_BATCH;
+				} else if (0 == strcmp(optarg, "pipelined")) {
+					recv_strategy = RECV_PIPELINED;
+				} else if (0 == strcmp(optarg, "streaming")) {
+					recv_strategy = RECV_STREAMING;
+				} else {
+					errno = EINVAL;
+					print_err("Error: Unknown strategy passed to `-r` (expected batch|pipelined|streaming)", true);
+				}
+				break;
+			case 's': // the buffer size of the streaming receive
+				stream_buff_size = strtoull(optarg, NULL, 10);
+				if ( stream_buff_size == 0 || stream_buff_size > FILE_BUFF_SIZE ) {
+					errno = EINVAL;
+					print_err("Error: The buffer size passed to `-s` must be between 1 and 1000000 bytes", true);
+				}
+				break;
+			case 'k': // the counting kernel
+				kernel_name = optarg;
+				break;
+			case 'a': // the path of the admin endpoint
+				admin_path = optarg;
+				break;
+			case 'i': // the idle timeout, in seconds
+				if ( 0.001 > (seconds = strtod(optarg, NULL)) ) {
+					errno = EINVAL;
+					print_err("Error: The timeout passed to `-i` must be at least 0.001 seconds", true);
+				}
+				idle_timeout = seconds * 1e9;
+				break;
+			case 'T': // the transfer timeout, in seconds
+				if ( 0.001 > (seconds = strtod(optarg, NULL)) ) {
+					errno = EINVAL;
+					print_err("Error: The timeout passed to `-T` must be at least 0.001 seconds", true);
+				}
+				transfer_timeout = seconds * 1e9;
+				break;
+			case 'c': // the connections served at once
+				if ( 0 >= (max_connections = atoi(optarg)) ) {
+					errno = EINVAL;
+					print_err("Error: The amount of connections passed to `-c` must be positive", true);
+				}
+				break;
+			case 'M': // the largest upload
+				if ( 0 == (max_upload_size = strtoull(optarg, NULL, 10)) ) {
+					errno = EINVAL;
+					print_err("Error: The size passed to `-M` must be positive", true);
+				}
+				break;
+			case 'b': // the in-flight budget
+				if ( 0 == (inflight_budget = strtoull(optarg, NULL, 10)) ) {
+					errno = EINVAL;
+					print_err("Error: The size passed to `-b` must be positive", true);
+				}
+				break;
+			case 'C': // the checkpoint file
+				checkpoint_path = optarg;
+				break;
+			case 'I': // the checkpoint interval, in seconds
+				if ( 0.001 > (seconds = strtod(optarg, NULL)) ) {
+					errno = EINVAL;
+					print_err("Error: The interval passed to `-I` must be at least 0.001 seconds", true);
+				}
+				checkpoint_interval_ms = seconds * 1e3;
+				break;
+			case 'J': // the journal sync interval, in milliseconds
+				if ( 0 > (journal_sync_ms = atoll(optarg)) ) {
+					errno = EINVAL;
+					print_err("Error: The interval passed to `-J` must not be negative", true);
+				}
+				break;
+			case 'D': // the drain deadline, in seconds
+				if ( 0 > (seconds = strtod(optarg, NULL)) ) {
+					errno = EINVAL;
+					print_err("Error: The deadline passed to `-D` must not be negative", true);
+				}
+				drain_timeout = seconds * 1e9;
+				break;
+			case 'H': // the handoff socket
+				handoff_path = optarg;
+				break;
+			case 'o': // the socket knobs
+				parse_socket_knobs(optarg);
+				break;
+			case 'd': // the entries of the dedup cache
+				if ( 0 == (cache_capacity = strtoull(optarg, NULL, 10)) ) {
+					errno = EINVAL;
+					print_err("Error: The amount of entries passed to `-d` must be positive", true);
+				}
+				break;
+			default:
+				errno = EINVAL;
+				print_err("Error: Usage: server [-m blocking|epoll|uring] [-t workers] [-r batch|pipelined|streaming] [-s stream buffer size] [-k auto|scalar|sse4.2|avx2|bytes] [-a admin socket path] "
+				          "[-i idle timeout] [-T transfer timeout] [-c max connections] [-M max upload size] [-b in-flight bytes] "
+				          "[-C checkpoint path] [-I checkpoint interval] [-J journal sync ms] [-D drain deadline] [-H handoff socket path] "
+				          "[-o pin,backlog=n,defer_accept=sec,rcvbuf=bytes,rcvlowat=bytes,busy_poll=usec] [-d dedup cache entries] <port>", true);
+		}
+	}
+	if ( journal_sync_ms >= 0 && NULL == checkpoint_path ) {
+		errno = EINVAL;
+		print_err("Error: The journal (`-J`) is kept next to the checkpoint file, so `-C` must be passed too", true);
+	}
+	if ( rcvlowat > 0 && io_mode == IO_MODE_BLOCKING ) { // see `set_lowat`
+		errno = EINVAL;
+		print_err("Warning: Only the event loops (`-m epoll|uring`) wait for a low-water mark, so `-o rcvlowat` is ignored", false);
+		rcvlowat = 0;
+	}
+	bounded = (idle_timeout > 0 || transfer_timeout > 0 || max_connections > 0 || max_upload_size > 0 || inflight_budget > 0);
+
+	// parse args
+	if (argc - optind != 1) {
+		errno = EINVAL;
+		print_err("Error: Not enough arguments passed", true);
+	}
+
+	uint16_t port = atoi(argv[optind]); // transfer to 16 bit
+	
+	// picking the counting kernel, according to the CPU
+	if ( NULL == (pcc_kernel_impl = select_pcc_kernel(kernel_name)) ) {
+		errno = EINVAL;
+		print_err("Error: The kernel passed to `-k` is unknown or not supported by this CPU (expected auto|scalar|sse4.2|avx2|bytes)", true);
+	}
+
+	// taking the listening sockets over from a running server, if any, which decide the amount of workers
+	int listenfds[HANDOFF_MAX_FDS];
+	int handed = 0;
+	if ( NULL != handoff_path ) {
+		if ( num_workers > HANDOFF_MAX_FDS ) {
+			errno = EINVAL;
+			print_err("Error: At most 253 workers (`-t`) hand their listening sockets over (`-H`)", true);
+		}
+		if ( 0 < (handed = handoff_connect(listenfds)) && handed != num_workers ) {
+			errno = EINVAL;
+			print_err("Warning: The previous server handed over a listening socket per worker, so as many workers serve them (rather than `-t`)", false);
+			num_workers = handed;
+		}
+	}
+	
+	// create the workers, each with its own listening socket (their pools are created by the workers themselves)
+	if ( NULL == (workers = aligned_alloc(PCC_CACHE_LINE_SIZE, num_workers * sizeof(struct worker))) ) {
+		print_err("Error: Couldn't allocate the workers", true);
+	}
+	memset(workers, 0, num_workers * sizeof(struct worker));
+	for (int i = 0; i < num_workers; i++) {
+		if ( handed > 0 ) { // tuned by this server's knobs, rather than the predecessor's
+			workers[i].listenfd = listenfds[i];
+			tune_listening_socket(workers[i].listenfd);
+		} else {
+			workers[i].listenfd = open_listening_socket(port, num_workers > 1);
+		}
+		if ( -1 == (workers[i].wakefd = eventfd(0, EFD_NONBLOCK)) ) {
+			print_err("Error: Couldn't create an eventfd", true);
+		}
+	}
+	if ( pin_workers ) {
+		pin_workers_to_cpus();
+	}
+
+	// letting the next server take the listening sockets over
+	if ( NULL != handoff_path && -1 == (handoff_fd = listen_unix_socket(handoff_path, &handoff_ino)) ) {
+		print_err("Error: Couldn't listen on the handoff socket passed to `-H`", true);
+	}
+	
+	// restoring the statistics of the previous run, and checkpointing them from now on (once the previous
+	// server handed its statistics over, if it handed its listening sockets over)
+	if ( NULL != checkpoint_path && predecessor_fd == -1 ) {
+		persistence_start(true);
 	}
 
-	// processing new connections
-	process_connections(listenfd);
+	// remembering the counts of the bodies sent with their hash, for the clients looking them up
+	cache_start();
+	
+	// the table of the files uploaded over several sessions at once
+	transfers_start();
+	
+	// serving snapshots of the statistics while the workers run
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	if ( NULL != admin_path ) {
+		admin_start();
+	}
+
+	// processing new connections, each worker on its own thread, while the main thread runs the lifecycle of the server
+	// (a pinned worker starts on its CPU, so its pools are first touched on that CPU's NUMA node)
+	running_workers = num_workers;
+	for (int i = 0; i < num_workers; i++) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if ( pin_workers ) {
+			cpu_set_t cpu;
+			CPU_ZERO(&cpu);
+			CPU_SET(workers[i].cpu, &cpu);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+		}
+		if ( 0 != (errno = pthread_create(&workers[i].thread, &attr, worker_main, &workers[i])) ) {
+			print_err("Error: Couldn't create a worker thread", true);
+		}
+		pthread_attr_destroy(&attr);
+	}
+	if ( lifecycle_run() ) {
+		for (int i = 0; i < num_workers; i++) {
+			pthread_join(workers[i].thread, NULL);
+		}
+		
+		// closing listening sockets (a successor holds its own copies of them)
+		for (int i = 0; i < num_workers; i++) {
+			close_safe(workers[i].listenfd);
+			close_safe(workers[i].wakefd);
+		}
+	}
+	
+	// leaving the sockets a successor bound in their place
+	if ( NULL != admin_path ) {
+		unlink_unix_socket(admin_path, admin_ino);
+	}
+	if ( NULL != handoff_path ) {
+		unlink_unix_socket(handoff_path, handoff_ino);
+	}
+	
+	// the final checkpoint, after which nothing is counted anymore (by an abandoned connection), so the
+	// statistics printed and handed over are exactly the checkpointed ones
+	if ( NULL != checkpoint_slots ) {
+		checkpoint_write();
+		pthread_mutex_lock(&checkpoint_lock);
+		pthread_mutex_lock(&journal_lock);
+	}
 	
-	// closing listening socket and printing statistics
-	close_safe(listenfd);
-	print_stats(pcc_total, true); // exits with 0 status
+	// handing the statistics over and printing them
+	struct stats_snapshot total;
+	snapshot_stats(&total);
+	handoff_send_totals(&total);
+	print_stats(total.pcc, true); // exits with 0 status
 }